@@ -31,10 +31,285 @@ EXTERNC_BEGIN
 #define CRYPTO_PUBLICKEYBYTES sizeof(pk_t)
 #define CRYPTO_BYTES          SIG_BYTE_LEN
 
-void rainbow_keypair(pk_t *pk, sk_t *sk, const uint8_t *sk_seed);
+// Returns 0 on success, and -1 when its work memory cannot be allocated.
+int  rainbow_keypair(pk_t *pk, sk_t *sk, const uint8_t *sk_seed);
 int  rainbow_sign(uint8_t *signature, const sk_t *sk, const uint8_t *digest);
 int  rainbow_verify(const uint8_t *digest,
                     const uint8_t *signature,
                     const pk_t *   pk);
 
+// A public key that is converted once to the internal field representation
+// and kept in 64-byte aligned heap memory. Verifying against a prepared key
+// avoids the per-call conversion (and the large stack copy) of the key.
+typedef struct rainbow_pk_prepared_st rainbow_pk_prepared_t;
+
+// The internal memory layout of a prepared public key.
+typedef enum
+{
+    // The pk_t layout: one 72-byte row per term.
+    RAINBOW_PK_LAYOUT_ROWS = 0,
+    // The first 64 equations of every term in a 64-byte aligned plane, and the
+    // remaining 8 equations of 8 consecutive terms packed in one 64-byte line.
+    RAINBOW_PK_LAYOUT_SPLIT,
+    // The first 16 equations of every term in their own plane. Verification
+    // evaluates them first and rejects a signature on a mismatch without
+    // evaluating the remaining 56 equations.
+    RAINBOW_PK_LAYOUT_EARLY_REJECT,
+} rainbow_pk_layout_t;
+
+// Returns NULL on allocation failure.
+// The returned object must be released with rainbow_pk_release.
+// rainbow_pk_prepare uses RAINBOW_PK_LAYOUT_ROWS.
+rainbow_pk_prepared_t *rainbow_pk_prepare(const pk_t *pk);
+rainbow_pk_prepared_t *rainbow_pk_prepare_layout(const pk_t *        pk,
+                                                 rainbow_pk_layout_t layout);
+void                   rainbow_pk_release(rainbow_pk_prepared_t *ppk);
+
+int rainbow_verify_prepared(const uint8_t *              digest,
+                            const uint8_t *              signature,
+                            const rainbow_pk_prepared_t *ppk);
+
+// Verifies n signatures against the same prepared key. The public key is
+// streamed once for every group of signatures instead of once per signature.
+// results[i] receives the result of verifying sigs[i] over digests[i] (as
+// returned by rainbow_verify). Returns 0 if all signatures are valid and -1
+// otherwise.
+int rainbow_verify_batch(const rainbow_pk_prepared_t *ppk,
+                         const uint8_t *const         digests[],
+                         const uint8_t *const         sigs[],
+                         size_t                       n,
+                         int                          results[]);
+
+// Verifies n independent (ppks[i], digests[i], sigs[i]) triples. The
+// evaluations of different keys are interleaved, so the loads of several keys
+// are in flight at the same time. results[i] receives the result of the i-th
+// verification (as returned by rainbow_verify). Returns 0 if all signatures are
+// valid and -1 otherwise.
+int rainbow_verify_multi(const rainbow_pk_prepared_t *const ppks[],
+                         const uint8_t *const               digests[],
+                         const uint8_t *const               sigs[],
+                         size_t                             n,
+                         int                                results[]);
+
+// Fills |buf| with the next |len| bytes of a public key (in the pk_t format).
+// Returns 0 on success.
+typedef int (*rainbow_pk_read_cb)(void *ctx, uint8_t *buf, size_t len);
+
+// Verifies a signature without holding the public key in memory. The key is
+// read through |read_cb| in chunks of about 16KB. When the caller may run on
+// more than one CPU, a helper thread reads the next chunk while the current
+// one is evaluated. Otherwise every chunk is read and then evaluated while it
+// is still in the L1 cache. The memory used is two chunks plus a constant.
+int rainbow_verify_stream(const uint8_t *    digest,
+                          const uint8_t *    signature,
+                          rainbow_pk_read_cb read_cb,
+                          void *             ctx);
+
+// Same as rainbow_verify_stream, reading the public key from |fd| (from its
+// current offset). The kernel is advised to read the file ahead.
+int rainbow_verify_stream_fd(const uint8_t *digest,
+                             const uint8_t *signature,
+                             int            fd);
+
+// A bounded cache of verified signatures, shared by multiple threads.
+typedef struct rainbow_sigcache_st rainbow_sigcache_t;
+
+// |capacity| is the number of cached signatures (rounded up).
+// Returns NULL on failure. The returned object must be released with
+// rainbow_sigcache_release.
+rainbow_sigcache_t *rainbow_sigcache_create(size_t capacity);
+void                rainbow_sigcache_release(rainbow_sigcache_t *cache);
+
+// Same as rainbow_verify_prepared, but a (pk, digest, signature) tuple that
+// was already verified successfully is accepted without evaluating the public
+// map. Thread safe.
+int rainbow_verify_cached(rainbow_sigcache_t *         cache,
+                          const uint8_t *              digest,
+                          const uint8_t *              signature,
+                          const rainbow_pk_prepared_t *ppk);
+
+// The number of lookups that hit/missed the cache since it was created.
+void rainbow_sigcache_stats(rainbow_sigcache_t *cache,
+                            uint64_t *          hits,
+                            uint64_t *          misses);
+
+// Signs n digests with the same key. sigs[i] receives the signature of
+// digests[i], identical to the output of rainbow_sign. The secret key matrices
+// are multiplied by the vinegars of several signatures together.
+// Returns 0 if all the signatures were generated successfully.
+int rainbow_sign_batch(uint8_t *const       sigs[],
+                       const sk_t *         sk,
+                       const uint8_t *const digests[],
+                       size_t               n);
+
+// Signing and verification with a small stack, for fiber and coroutine
+// workers. rainbow_sign_ws takes the scratch memory that rainbow_sign keeps
+// on the stack (most notably a copy of the secret key) from |ws|: a buffer of
+// rainbow_workspace_size() bytes, aligned to RAINBOW_WORKSPACE_ALIGN. The
+// workspace may be reused for any number of calls, but not concurrently.
+// It is zeroized before the call returns.
+// rainbow_sign_ws and rainbow_verify use at most RAINBOW_LOW_STACK_BYTES
+// bytes of stack (rainbow_verify reads the public key in place, so it needs
+// no workspace).
+#define RAINBOW_WORKSPACE_ALIGN (64)
+#define RAINBOW_LOW_STACK_BYTES (6144)
+
+size_t rainbow_workspace_size(void);
+int    rainbow_sign_ws(uint8_t *signature, const sk_t *sk, const uint8_t *digest, void *ws);
+
+// The fault check modes of a signature. The check maps the signature back to
+// its message hash with the secret key (x = T * w, y = F(x), z = S * y). A
+// signature that does not match is not released: it is zeroized and the
+// function fails.
+// RAINBOW_FAULT_CHECK takes the vinegar products of F from the values that
+// signing computed for the vinegar. It detects faults in the solving of the
+// linear systems and in the S and T transforms, for a small fraction of the
+// cost of a verify.
+// RAINBOW_FAULT_CHECK_FULL evaluates the vinegar maps again from the secret
+// key, so it also detects faults in them. It costs about as much as the
+// vinegar maps.
+#define RAINBOW_FAULT_CHECK_OFF  (0)
+#define RAINBOW_FAULT_CHECK      (1)
+#define RAINBOW_FAULT_CHECK_FULL (2)
+
+// Same as rainbow_sign_ws, with the fault check |mode| (one of the above).
+int rainbow_sign_ws_checked(uint8_t *      signature,
+                            const sk_t *   sk,
+                            const uint8_t *digest,
+                            void *         ws,
+                            int            mode);
+
+// A secret key that is converted once to the internal field representation
+// and kept in 64-byte aligned heap memory. Signing with a prepared key
+// produces the same signatures as rainbow_sign.
+typedef struct rainbow_sk_prepared_st rainbow_sk_prepared_t;
+
+// Returns NULL on allocation failure.
+// The returned object must be released (and zeroized) with rainbow_sk_release.
+rainbow_sk_prepared_t *rainbow_sk_prepare(const sk_t *sk);
+void                   rainbow_sk_release(rainbow_sk_prepared_t *psk);
+
+// Restores the standard sk_t serialization of a prepared key.
+void rainbow_sk_export(sk_t *sk, const rainbow_sk_prepared_t *psk);
+
+// Sets the fault check |mode| (see above) of the signatures with |psk|.
+// RAINBOW_FAULT_CHECK_OFF by default. A sign pool takes the setting of |psk|
+// when it is created. The setting must not change while |psk| is used.
+void rainbow_sk_set_fault_check(rainbow_sk_prepared_t *psk, int mode);
+
+int rainbow_sign_prepared(uint8_t *                    signature,
+                          const rainbow_sk_prepared_t *psk,
+                          const uint8_t *              digest);
+
+// A pool of precomputed vinegar bundles for randomized signing. Every bundle
+// holds the message independent part of a signature (the vinegar, the inverse
+// of the layer 1 system and the vinegar products of layer 2). Background
+// threads fill the pool from a DRBG that is seeded by the OS.
+typedef struct rainbow_sign_pool_st rainbow_sign_pool_t;
+
+// Starts |n_threads| workers that fill the pool up to |depth| bundles. Once the
+// pool is drained to |low_watermark| bundles the workers refill it.
+// |psk| must outlive the pool.
+// Returns NULL on failure. The returned object must be released (and
+// zeroized) with rainbow_sign_pool_release.
+rainbow_sign_pool_t *rainbow_sign_pool_create(const rainbow_sk_prepared_t *psk,
+                                              size_t depth,
+                                              size_t low_watermark,
+                                              size_t n_threads);
+void                 rainbow_sign_pool_release(rainbow_sign_pool_t *pool);
+
+// The number of ready bundles.
+size_t rainbow_sign_pool_available(rainbow_sign_pool_t *pool);
+
+// Returns -1 if a worker stopped because it could not reseed its DRBG from the
+// OS, and 0 otherwise. The pool keeps working with the other workers, and
+// rainbow_sign_online computes the bundles itself once the pool is empty.
+int rainbow_sign_pool_status(rainbow_sign_pool_t *pool);
+
+// Signs |digest| with a bundle from the pool. The bundle is used once and is
+// zeroized. When the pool is empty, the bundle is computed by the caller.
+// Unlike rainbow_sign, the signature is randomized. Thread safe.
+int rainbow_sign_online(uint8_t *            signature,
+                        rainbow_sign_pool_t *pool,
+                        const uint8_t *      digest);
+
+// A small group of helper threads that one job (a signature or a key
+// generation) is spread over, for a lower latency of that job. The helpers
+// spin for a short while after a job, and then sleep on a futex. A team runs
+// one job at a time, and can be reused for any number of jobs.
+typedef struct rainbow_team_st rainbow_team_t;
+
+// Creates up to |n_helpers| helper threads, but not more than the CPUs of the
+// caller's affinity mask other than its own, since a helper without a CPU of
+// its own only slows the job down. A team may have no helpers (|n_helpers| is
+// 0, or the caller may run on a single CPU), and then the caller runs all the
+// work. If |first_cpu| is not negative, helper i is pinned to CPU
+// first_cpu + i. Returns NULL on failure, including when a helper cannot be
+// pinned.
+rainbow_team_t *rainbow_team_create(size_t n_helpers, int first_cpu);
+void            rainbow_team_release(rainbow_team_t *team);
+
+// Returns the number of helpers that were started.
+size_t rainbow_team_size(const rainbow_team_t *team);
+
+// Same as rainbow_sign_prepared (it outputs the same signature), with the
+// vinegar maps evaluated by the caller and the helpers of |team| together.
+// The maps are split into 3 parts (F1, F2 and F3), so at most 2 helpers have
+// work in a sign and any further helper stays idle.
+int rainbow_sign_prepared_team(uint8_t *                    signature,
+                               const rainbow_sk_prepared_t *psk,
+                               const uint8_t *              digest,
+                               rainbow_team_t *             team);
+
+// Same as rainbow_keypair (it outputs the same keypair), with the public key
+// computed by the caller and the helpers of |team| together.
+int rainbow_keypair_team(pk_t *          pk,
+                         sk_t *          sk,
+                         const uint8_t * sk_seed,
+                         rainbow_team_t *team);
+
+// Same as rainbow_keypair_team, with a team of n_threads - 1 helpers that
+// live for the duration of the call. Callers that generate many keys should
+// keep a team and use rainbow_keypair_team.
+int rainbow_keypair_mt(pk_t *         pk,
+                       sk_t *         sk,
+                       const uint8_t *sk_seed,
+                       size_t         n_threads);
+
+// Writes the next |len| bytes of a public key (in the pk_t format).
+// Returns 0 on success.
+typedef int (*rainbow_pk_write_cb)(void *ctx, const uint8_t *buf, size_t len);
+
+// Same as rainbow_keypair, without holding the public key in memory. The
+// public key is passed to |write_cb| in order, in chunks of at most 64KB, and
+// a helper thread writes a chunk while the next one is computed. The memory
+// used is about 0.5MB (instead of about 1.1MB for a pk_t and the work memory
+// of rainbow_keypair). Returns 0 on success. On failure |sk| is zeroized.
+int rainbow_keypair_stream(sk_t *              sk,
+                           const uint8_t *     sk_seed,
+                           rainbow_pk_write_cb write_cb,
+                           void *              ctx);
+
+// Same as rainbow_keypair_stream, writing the public key to |fd|.
+int rainbow_keypair_stream_fd(sk_t *sk, const uint8_t *sk_seed, int fd);
+
+// Receives keypair |i| of a batch, which is valid only during the call.
+// Returns 0 to continue the batch.
+typedef int (*rainbow_keypair_sink_cb)(void *      ctx,
+                                       size_t      i,
+                                       const pk_t *pk,
+                                       const sk_t *sk);
+
+// Generates the keypairs of the SKSEED_BYTE_LEN seeds |seeds[0..n-1]| (the
+// same keypairs as rainbow_keypair), and passes them to |sink| in order.
+// Different keys are generated concurrently by |n_threads| threads (the
+// caller included), and every thread holds a single keypair at a time.
+// Returns 0 on success, and -1 on allocation failure, when |n_threads| is too
+// large or when |sink| stops the batch.
+int rainbow_keypair_batch(const uint8_t *const    seeds[],
+                          size_t                  n,
+                          size_t                  n_threads,
+                          rainbow_keypair_sink_cb sink,
+                          void *                  ctx);
+
 EXTERNC_END
@@ -25,7 +25,9 @@
 #include <immintrin.h>
 
 #include "gfni.h"
+#include "prepared.h"
 #include "rainbow_config.h"
+#include "utils_mem.h"
 
 #define LOAD(in)        (_mm512_loadu_si512((const void *)(in)))
 #define STORE(mem, reg) (_mm512_storeu_si512((void *)(mem), reg))
@@ -152,26 +154,71 @@ uint8_t gf256_inv(IN OUT uint8_t *a)
     return *a;
 }
 
+// Every 64-byte chunk of |c| is accumulated in a register over all the
+// columns. A masked store does not forward to the next masked load of the same
+// bytes, so an accumulator in memory stalls every column of a short matrix.
 void gfmat_prod_native(uint8_t *      c,
                        const uint8_t *matA,
                        uint32_t       n_A_vec_byte,
                        uint32_t       n_A_width,
                        const uint8_t *b)
 {
-    const size_t    num_zmm = n_A_vec_byte >> 6;
-    const size_t    zmm_rem = n_A_vec_byte & 0x3f;
-    const __mmask64 k       = (1ULL << zmm_rem) - 1;
+    size_t          num_zmm;
+    const __mmask64 k = split_to_zmm_regs(&num_zmm, n_A_vec_byte);
 
-    memset(c, 0, n_A_vec_byte);
-    for(size_t i = 0; i < n_A_width; i++, matA += zmm_rem) {
-        uint8_t *c2 = c;
-        __m512i  bv = SET1(b[i]);
+    for(size_t j = 0; j <= num_zmm; j++) {
+        const __mmask64 kj  = (j < num_zmm) ? (__mmask64)-1 : k;
+        __m512i         acc = _mm512_setzero_si512();
 
-        for(size_t j = 0; j < num_zmm; j++, matA += ZMM_BYTES, c2 += ZMM_BYTES) {
-            STORE(c2, LOAD(c2) ^ GFMUL(LOAD(matA), bv));
+        if(0 == kj) {
+            break;
         }
 
-        MSTORE(c2, k, MLOAD(k, c2) ^ GFMUL(MLOAD(k, matA), bv));
+        const uint8_t *a = &matA[j * ZMM_BYTES];
+        for(size_t i = 0; i < n_A_width; i++, a += n_A_vec_byte) {
+            acc ^= GFMUL(MLOAD(kj, a), SET1(b[i]));
+        }
+
+        MSTORE(&c[j * ZMM_BYTES], kj, acc);
+    }
+}
+
+// The output is computed one 64-byte chunk at a time, so the MAT_BATCH
+// accumulators of a chunk stay in registers while the columns of |matA| are
+// walked.
+void gfmat_prod_native_batch(uint8_t *const       c[MAT_BATCH],
+                             const uint8_t *      matA,
+                             uint32_t             n_A_vec_byte,
+                             uint32_t             n_A_width,
+                             const uint8_t *const b[MAT_BATCH])
+{
+    size_t          num_zmm;
+    const __mmask64 k    = split_to_zmm_regs(&num_zmm, n_A_vec_byte);
+    const __m512i   zero = _mm512_setzero_si512();
+
+    for(size_t j = 0; j <= num_zmm; j++) {
+        const __mmask64 kj = (j < num_zmm) ? (__mmask64)-1 : k;
+        __m512i         acc[MAT_BATCH];
+
+        if(0 == kj) {
+            break;
+        }
+
+        for(size_t v = 0; v < MAT_BATCH; v++) {
+            acc[v] = zero;
+        }
+
+        const uint8_t *a = &matA[j * ZMM_BYTES];
+        for(size_t i = 0; i < n_A_width; i++, a += n_A_vec_byte) {
+            const __m512i av = MLOAD(kj, a);
+            for(size_t v = 0; v < MAT_BATCH; v++) {
+                acc[v] ^= GFMUL(av, SET1(b[v][i]));
+            }
+        }
+
+        for(size_t v = 0; v < MAT_BATCH; v++) {
+            MSTORE(&c[v][j * ZMM_BYTES], kj, acc[v]);
+        }
     }
 }
 
@@ -181,60 +228,70 @@ void gfmat_prod_native(uint8_t *      c,
 #    error "The functions below are optimized for O1=O2=36"
 #endif
 
-// Returns in |c| the dot product calculations of a matrix |A| with a vector |b|
-// The size of A is 36x36 bytes and the size of b is 36 bytes
-_INLINE_
-void gfmat_prod_36(OUT uint8_t *c, IN const uint8_t *A, IN const uint8_t *b)
+// Stores one term of the public key at |out|: the layer 1 coefficients |cv|
+// followed by the layer 2 coefficients |l2|, in the AES field.
+_INLINE_ void store_pk_term(OUT uint8_t *out,
+                            IN const __m512i cv,
+                            IN const uint8_t *l2)
 {
-    const __mmask64 k = NINE_ELEMS_MASK;
-
-    __m512i cv = MLOAD(k, c);
-
-    for(size_t i = 0; i < ELEMS; i++, A += ELEMS) {
-        cv ^= GFMUL(MLOAD(k, A), SET1(b[i]));
-    }
+    const __mmask64 k   = NINE_ELEMS_MASK;
+    __m512i         l1v = cv;
+    __m512i         l2v = MLOAD(k, l2);
+
+#ifndef USE_AES_FIELD
+    const __m512i A = _mm512_set1_epi64(MATRIX_A_INV);
+    l1v             = _mm512_gf2p8affine_epi64_epi8(l1v, A, 0);
+    l2v             = _mm512_gf2p8affine_epi64_epi8(l2v, A, 0);
+#endif
 
-    MSTORE(c, k, cv);
+    MSTORE(out, k, l1v);
+    MSTORE(&out[O1], k, l2v);
 }
 
 #define ROUNDS (16ULL)
 
-_INLINE_
-void gfmat_prod_36_16(OUT uint8_t *c, IN const uint8_t *A, IN const uint8_t *b)
+void pk_store_terms_36(OUT uint8_t *out,
+                       IN const uint8_t *l1_polys,
+                       IN const uint8_t *l2_polys,
+                       IN uint32_t       n_terms,
+                       IN const uint8_t *s1)
 {
     const __mmask64 k = NINE_ELEMS_MASK;
-    __m512i         cv[ROUNDS];
 
-    for(size_t j = 0; j < ROUNDS; j++) {
-        cv[j] = MLOAD(k, &c[j * O1]);
-    }
+    // The S1 products of ROUNDS terms share the loads of the columns of S1.
+    for(; n_terms >= ROUNDS; n_terms -= ROUNDS) {
+        __m512i cv[ROUNDS];
 
-    for(size_t i = 0; i < O1; i++) {
-        const __m512i av = MLOAD(k, &A[i * ELEMS]);
         for(size_t j = 0; j < ROUNDS; j++) {
-            cv[j] ^= GFMUL(av, SET1(b[(j * O2) + i]));
+            cv[j] = MLOAD(k, &l1_polys[j * O1]);
         }
-    }
 
-    for(size_t j = 0; j < ROUNDS; j++) {
-        MSTORE(&c[j * O1], k, cv[j]);
-    }
-}
+        for(size_t i = 0; i < ELEMS; i++) {
+            const __m512i av = MLOAD(k, &s1[i * ELEMS]);
+            for(size_t j = 0; j < ROUNDS; j++) {
+                cv[j] ^= GFMUL(av, SET1(l2_polys[(j * O2) + i]));
+            }
+        }
 
-void obsfucate_l1_polys(OUT uint8_t *l1_polys,
-                        IN const uint8_t *l2_polys,
-                        IN uint32_t       n_terms,
-                        IN const uint8_t *s1)
-{
-    while(n_terms > ROUNDS) {
-        gfmat_prod_36_16(l1_polys, s1, l2_polys);
+        for(size_t j = 0; j < ROUNDS; j++) {
+            store_pk_term(&out[j * PUB_M], cv[j], &l2_polys[j * O2]);
+        }
+
+        out += (PUB_M * ROUNDS);
         l1_polys += (O1 * ROUNDS);
         l2_polys += (O2 * ROUNDS);
-        n_terms -= ROUNDS;
     }
 
-    while(n_terms--) {
-        gfmat_prod_36(l1_polys, s1, l2_polys);
+    for(; n_terms > 0; n_terms--) {
+        __m512i cv = MLOAD(k, l1_polys);
+
+        for(size_t i = 0; i < ELEMS; i++) {
+            cv ^= GFMUL(MLOAD(k, &s1[i * ELEMS]), SET1(l2_polys[i]));
+        }
+
+        store_pk_term(out, cv, l2_polys);
+
+        out += PUB_M;
         l1_polys += O1;
         l2_polys += O2;
     }
@@ -260,6 +317,43 @@ void multab_trimat_36(uint8_t *      y,
     }
 }
 
+void multab_trimat_36_batch(uint8_t *const       y[MAT_BATCH],
+                            const uint8_t *      trimat,
+                            const uint8_t *const x[MAT_BATCH],
+                            uint32_t             dim)
+{
+    const __mmask64 k    = NINE_ELEMS_MASK;
+    const __m512i   zero = _mm512_setzero_si512();
+    __m512i         yv[MAT_BATCH];
+
+    for(size_t b = 0; b < MAT_BATCH; b++) {
+        yv[b] = zero;
+    }
+
+    for(size_t i = 0; i < dim; i++) {
+        __m512i tmp[MAT_BATCH];
+        for(size_t b = 0; b < MAT_BATCH; b++) {
+            tmp[b] = zero;
+        }
+
+        for(size_t j = i; j < dim; j++) {
+            const __m512i t = MLOAD(k, trimat);
+            for(size_t b = 0; b < MAT_BATCH; b++) {
+                tmp[b] ^= GFMUL(t, SET1(x[b][j]));
+            }
+            trimat += ELEMS;
+        }
+
+        for(size_t b = 0; b < MAT_BATCH; b++) {
+            yv[b] ^= GFMUL(tmp[b], SET1(x[b][i]));
+        }
+    }
+
+    for(size_t b = 0; b < MAT_BATCH; b++) {
+        MSTORE(y[b], k, yv[b]);
+    }
+}
+
 #if((O1 == 36) && (O2 == 36))
 // Here PUB_M=72, ZMM1 holds 64 bytes and ZMM2 holds 8 bytes (mask=0xff)
 #    define ZMM2_BYTES_MASK      (0xffULL)
@@ -442,7 +536,35 @@ _INLINE_ const uint8_t *mul_line(OUT __m512i out[2],
 }
 #endif // SPECIAL_PIPELINING
 
-void mq_gf256_n140_m72(uint8_t *z, const uint8_t *pk_mat, const uint8_t *w)
+// Same as mul_line but |pk_mat| is in the original field. Every row is
+// converted to the GFNI field in registers right after it is loaded.
+_INLINE_ const uint8_t *mul_line_to_gfni(OUT __m512i out[2],
+                                         IN const uint8_t *pk_mat,
+                                         IN const uint8_t *w,
+                                         IN const size_t   line)
+{
+    const __m512i A    = _mm512_set1_epi64(MATRIX_A);
+    const __m512i zero = _mm512_setzero_si512();
+    out[0]             = zero;
+    out[1]             = zero;
+    for(size_t j = line; j < PUB_N; j++) {
+        __m512i b512 = SET1(w[j]);
+        __m512i inp0 = _mm512_gf2p8affine_epi64_epi8(LOAD_ZMM1(pk_mat), A, 0);
+        __m512i inp1 = _mm512_gf2p8affine_epi64_epi8(LOAD_ZMM2(pk_mat), A, 0);
+
+        out[0] ^= GFMUL(inp0, b512);
+        out[1] ^= GFMUL(inp1, b512);
+        pk_mat += PUB_M;
+    }
+    return pk_mat;
+}
+
+// When |pk_to_gfni| is set |pk_mat| is in the original field and it is
+// converted on the fly, otherwise it is already in the GFNI field.
+_INLINE_ void mq_rows(OUT uint8_t *z,
+                      IN const uint8_t *pk_mat,
+                      IN const uint8_t *w,
+                      IN const int      pk_to_gfni)
 {
     const __m512i zero = _mm512_setzero_si512();
     __m512i       r0   = zero;
@@ -455,7 +577,11 @@ void mq_gf256_n140_m72(uint8_t *z, const uint8_t *pk_mat, const uint8_t *w)
         }
         __m512i temp[2];
 
-        pk_mat = mul_line(temp, pk_mat, w, i);
+        if(pk_to_gfni) {
+            pk_mat = mul_line_to_gfni(temp, pk_mat, w, i);
+        } else {
+            pk_mat = mul_line(temp, pk_mat, w, i);
+        }
 
         __m512i b512 = SET1(w[i]);
         r0 ^= GFMUL(temp[0], b512);
@@ -469,6 +595,12 @@ void mq_gf256_n140_m72(uint8_t *z, const uint8_t *pk_mat, const uint8_t *w)
     __m512i inp0 = LOAD_ZMM1(pk_mat);
     __m512i inp1 = LOAD_ZMM2(pk_mat);
 
+    if(pk_to_gfni) {
+        const __m512i A = _mm512_set1_epi64(MATRIX_A);
+        inp0            = _mm512_gf2p8affine_epi64_epi8(inp0, A, 0);
+        inp1            = _mm512_gf2p8affine_epi64_epi8(inp1, A, 0);
+    }
+
     r0 ^= GFMUL(inp0, b512);
     r1 ^= GFMUL(inp1, b512);
 
@@ -476,89 +608,902 @@ void mq_gf256_n140_m72(uint8_t *z, const uint8_t *pk_mat, const uint8_t *w)
     STORE_ZMM2(z, r1);
 }
 
-_INLINE_
-uint32_t _gf256mat_gauss_elim(uint8_t *mat, uint32_t h, uint32_t w_64, uint32_t w)
+void mq_gf256_n140_m72(uint8_t *z, const uint8_t *pk_mat, const uint8_t *w)
 {
-    uint32_t r8 = 1;
+    mq_rows(z, pk_mat, w, 0);
+}
 
-    for(size_t i = 0; i < h; i++) {
-        uint8_t *ai     = &mat[w_64 * i];
-        __m512i  aiv[2] = {LOAD(ai), LOAD(ai + 64)};
+void mq_gf256_n140_m72_to_gfni(OUT uint8_t *z,
+                               IN const uint8_t *pk_mat,
+                               IN const uint8_t *w)
+{
+    mq_rows(z, pk_mat, w, 1);
+}
 
-        for(size_t j = i + 1; j < h; j++) {
-            __m512i ajv[2] = {LOAD(ai), LOAD(ai + 64)};
+// Stores in |m| the PUB_TERMS monomials w[i]*w[j] (i <= j) in the order of the
+// public key terms. The buffer is padded with zeros to MONOMIALS_BYTES.
+_INLINE_ void expand_monomials(OUT uint8_t *m, IN const uint8_t *w)
+{
+    uint8_t *start = m;
 
-            __mmask64 is_madd = CMPZ(aiv[0]) ^ CMPZ(ajv[0]);
-            is_madd           = 0 - (!!(is_madd & (1ULL << i)));
+    for(size_t i = 0; i < PUB_N; i++) {
+        const __m512i   wi = SET1(w[i]);
+        size_t          zmm_num;
+        const __mmask64 k = split_to_zmm_regs(&zmm_num, PUB_N - i);
 
-            aiv[0] = MXOR(aiv[0], is_madd, ajv[0], aiv[0]);
-            aiv[1] = MXOR(aiv[1], is_madd, ajv[1], aiv[1]);
+        const uint8_t *wj = &w[i];
+        for(size_t c = 0; c < zmm_num; c++, wj += ZMM_BYTES, m += ZMM_BYTES) {
+            STORE(m, GFMUL(LOAD(wj), wi));
         }
+        MSTORE(m, k, GFMUL(MLOAD(k, wj), wi));
+        m += (PUB_N - i) & 0x3f;
+    }
 
-        STORE(ai, aiv[0]);
-        STORE(ai + 64, aiv[1]);
+    memset(m, 0, MONOMIALS_BYTES - (m - start));
+}
 
-        // Check if ai[i] is not zero
-        r8 &= !!ai[i];
+// XORs the 8 qwords of |a|
+_INLINE_ __m512i xor_qwords(IN const __m512i a)
+{
+    __m256i a256 =
+        _mm512_castsi512_si256(a) ^ _mm512_extracti64x4_epi64(a, 1);
+    __m128i a128 =
+        _mm256_castsi256_si128(a256) ^ _mm256_extracti128_si256(a256, 1);
+
+    return _mm512_zextsi128_si512(a128 ^ _mm_unpackhi_epi64(a128, a128));
+}
+
+// Byte b of the index selects byte b/8 of a qword
+#define QWORD_BCAST_IDX                                                   \
+    (_mm512_set_epi64(0x0707070707070707, 0x0606060606060606,             \
+                      0x0505050505050505, 0x0404040404040404,             \
+                      0x0303030303030303, 0x0202020202020202,             \
+                      0x0101010101010101, 0x0000000000000000))
+
+// Returns a register where qword k holds 8 copies of in[k] (k=0,...,7)
+_INLINE_ __m512i bcast_bytes_to_qwords(IN const uint8_t *in)
+{
+    uint64_t in8;
+    memcpy(&in8, in, sizeof(in8));
+
+    return _mm512_shuffle_epi8(_mm512_set1_epi64(in8), QWORD_BCAST_IDX);
+}
+
+#define SPLIT_ACCUMULATORS (4)
+
+// Evaluates the public map over the split layout (see gfni.h).
+// The monomials of |w| are computed first. Then, the main plane is processed
+// with 64-byte aligned loads, and every tail line is multiplied by the 8
+// monomials of its terms, each one broadcast to its own qword
+// (see bcast_bytes_to_qwords).
+void mq_gf256_n140_m72_split(OUT uint8_t *z,
+                             IN const uint8_t *main_plane,
+                             IN const uint8_t *tail_plane,
+                             IN const uint8_t *w)
+{
+    ALIGN(64) uint8_t m[MONOMIALS_BYTES];
+    const __m512i     zero = _mm512_setzero_si512();
 
-        uint8_t pivot = ai[i];
-        pivot         = gf256_inv(&pivot);
+    expand_monomials(m, w);
+
+    __m512i acc[SPLIT_ACCUMULATORS] = {zero, zero, zero, zero};
+    size_t  t                       = 0;
+    for(; t + SPLIT_ACCUMULATORS <= PUB_TERMS; t += SPLIT_ACCUMULATORS) {
+        for(size_t u = 0; u < SPLIT_ACCUMULATORS; u++) {
+            const uint8_t *in = &main_plane[(t + u) * SPLIT_MAIN_BYTES];
+            acc[u] ^= GFMUL(_mm512_load_si512(in), SET1(m[t + u]));
+        }
+    }
+    for(; t < PUB_TERMS; t++) {
+        const uint8_t *in = &main_plane[t * SPLIT_MAIN_BYTES];
+        acc[0] ^= GFMUL(_mm512_load_si512(in), SET1(m[t]));
+    }
+
+    __m512i tacc[2] = {zero, zero};
+    for(size_t g = 0; g < SPLIT_TAIL_LINES; g++) {
+        const __m512i  mv = bcast_bytes_to_qwords(&m[g * SPLIT_TAIL_TERMS]);
+        const uint8_t *in = &tail_plane[g * SPLIT_MAIN_BYTES];
+        tacc[g & 1] ^= GFMUL(_mm512_load_si512(in), mv);
+    }
+
+    STORE_ZMM1(z, acc[0] ^ acc[1] ^ acc[2] ^ acc[3]);
+    STORE_ZMM2(z, xor_qwords(tacc[0] ^ tacc[1]));
+}
+
+// Two-phase evaluation of the public map over the pk_t layout:
+// 1) The PUB_TERMS monomials w[i]*w[j] are expanded into a vector.
+// 2) z is computed as the GF(256) matrix-vector product of the public key
+//    (PUB_TERMS rows of PUB_M bytes) and the monomials vector.
+// Unlike mul_line, there is no multiplication by w[i] at the end of a line, so
+// there is no loop-carried dependency other than the accumulating XORs. The
+// 8-byte tails of 8 consecutive rows are gathered into one register and
+// multiplied together.
+void mq_gf256_n140_m72_monomials(OUT uint8_t *z,
+                                 IN const uint8_t *pk_mat,
+                                 IN const uint8_t *w)
+{
+    ALIGN(64) uint8_t m[MONOMIALS_BYTES];
+    const __m512i     zero = _mm512_setzero_si512();
+    const __m512i     tail_idx =
+        _mm512_set_epi64(7 * PUB_M, 6 * PUB_M, 5 * PUB_M, 4 * PUB_M, 3 * PUB_M,
+                         2 * PUB_M, 1 * PUB_M, 0 * PUB_M);
+
+    expand_monomials(m, w);
+
+    __m512i acc[2] = {zero, zero};
+    __m512i tacc   = zero;
+
+    size_t t = 0;
+    for(; t + SPLIT_TAIL_TERMS <= PUB_TERMS; t += SPLIT_TAIL_TERMS) {
+        const uint8_t *rows = &pk_mat[t * PUB_M];
+
+        for(size_t u = 0; u < SPLIT_TAIL_TERMS; u++) {
+            acc[u & 1] ^= GFMUL(LOAD(&rows[u * PUB_M]), SET1(m[t + u]));
+        }
+
+        const __m512i tails =
+            _mm512_i64gather_epi64(tail_idx, (const void *)&rows[ZMM_BYTES], 1);
+        tacc ^= GFMUL(tails, bcast_bytes_to_qwords(&m[t]));
+    }
+
+    for(; t < PUB_TERMS; t++) {
+        const uint8_t *row = &pk_mat[t * PUB_M];
+        const __m512i  b   = SET1(m[t]);
+        acc[0] ^= GFMUL(LOAD_ZMM1(row), b);
+        tacc ^= GFMUL(LOAD_ZMM2(row), b);
+    }
+
+    STORE_ZMM1(z, acc[0] ^ acc[1]);
+    STORE_ZMM2(z, xor_qwords(tacc));
+}
+
+// The batched form of mq_gf256_n140_m72_monomials: a GF(256) matrix-matrix
+// product of the public key and the monomial vectors of MQ_BATCH
+// signatures. Every row of the public key is loaded once per MQ_BATCH
+// signatures. The 64-byte head of a row is multiplied by every signature's
+// monomial separately, while its 8-byte tail is broadcast to all the qwords
+// and multiplied by the MQ_BATCH monomials (one per qword) at once.
+// |w| holds MQ_BATCH consecutive signatures (PUB_N bytes each) and |z|
+// receives MQ_BATCH consecutive results (PUB_M bytes each).
+void mq_gf256_n140_m72_monomials_batch(OUT uint8_t *z,
+                                       IN const uint8_t *pk_mat,
+                                       IN const uint8_t *w)
+{
+    // Signature k's w[j] is stored in wt[j][k]. The extra line stays zero so
+    // the monomials of a line can be computed in chunks of 8 terms.
+    ALIGN(64) uint8_t wt[PUB_N + SPLIT_TAIL_TERMS][MQ_BATCH] = {0};
+    // The monomials of the current line in the same interleaved order.
+    ALIGN(64) uint8_t mt[PUB_N + SPLIT_TAIL_TERMS][MQ_BATCH];
+
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i       acc[MQ_BATCH];
+    __m512i       tacc = zero;
+
+    for(size_t k = 0; k < MQ_BATCH; k++) {
+        for(size_t j = 0; j < PUB_N; j++) {
+            wt[j][k] = w[(k * PUB_N) + j];
+        }
+        acc[k] = zero;
+    }
 
-        // Every line has w_64 elements but in fact only w are not redundant
-        gf256_mul(ai, pivot, w);
+    for(size_t i = 0; i < PUB_N; i++) {
+        uint64_t wi8;
+        memcpy(&wi8, wt[i], sizeof(wi8));
+        const __m512i wi = _mm512_set1_epi64(wi8);
 
-        for(size_t j = 0; j < h; j++) {
-            if(i == j) {
-                continue;
+        for(size_t j = i; j < PUB_N; j += SPLIT_TAIL_TERMS) {
+            STORE(mt[j - i], GFMUL(LOAD(wt[j]), wi));
+        }
+
+        for(size_t j = 0; j < (PUB_N - i); j++, pk_mat += PUB_M) {
+            const __m512i inp = LOAD(pk_mat);
+            for(size_t k = 0; k < MQ_BATCH; k++) {
+                acc[k] ^= GFMUL(inp, SET1(mt[j][k]));
             }
-            uint8_t *aj = &mat[w_64 * j];
-            gf256_madd(aj, ai, aj[i], w);
+
+            uint64_t tail8;
+            memcpy(&tail8, &pk_mat[ZMM_BYTES], sizeof(tail8));
+            tacc ^= GFMUL(_mm512_set1_epi64(tail8), bcast_bytes_to_qwords(mt[j]));
         }
     }
 
-    return r8;
+    uint8_t tails[MQ_BATCH * SPLIT_TAIL_BYTES];
+    STORE(tails, tacc);
+    for(size_t k = 0; k < MQ_BATCH; k++) {
+        STORE_ZMM1(&z[k * PUB_M], acc[k]);
+        memcpy(&z[(k * PUB_M) + ZMM_BYTES], &tails[k * SPLIT_TAIL_BYTES],
+               SPLIT_TAIL_BYTES);
+    }
 }
 
-_INLINE_
-void to_redundant_mat_representation(OUT uint8_t *out,
-                                     IN const uint8_t *in,
-                                     IN const uint32_t h,
-                                     IN const uint32_t w,
-                                     IN const uint32_t w_64)
+// Evaluates the early plane of the early-reject layout (see gfni.h). Every line
+// holds EARLY_EQS equations of EARLY_TERMS terms (one term per 128-bit lane),
+// and is multiplied by the monomials of its terms, each one broadcast to its
+// own lane. The lanes are folded at the end.
+void mq_gf256_n140_m72_early(OUT uint8_t *z,
+                             OUT uint8_t *m,
+                             IN const uint8_t *early_plane,
+                             IN const uint8_t *w)
 {
-    for(size_t i = 0; i < h; i++) {
-        memcpy(&out[(i * w_64)], &in[i * w], w);
+    // Byte b of the index selects byte b/16 of a dword
+    const __m512i idx =
+        _mm512_set_epi64(0x0303030303030303, 0x0303030303030303,
+                         0x0202020202020202, 0x0202020202020202,
+                         0x0101010101010101, 0x0101010101010101,
+                         0x0000000000000000, 0x0000000000000000);
+    const __m512i zero = _mm512_setzero_si512();
+
+    expand_monomials(m, w);
+
+    __m512i acc[2] = {zero, zero};
+    for(size_t g = 0; g < EARLY_LINES; g++) {
+        uint32_t m4;
+        memcpy(&m4, &m[g * EARLY_TERMS], sizeof(m4));
+
+        const __m512i  mv = _mm512_shuffle_epi8(_mm512_set1_epi32(m4), idx);
+        const uint8_t *in = &early_plane[g * SPLIT_MAIN_BYTES];
+        acc[g & 1] ^= GFMUL(_mm512_load_si512(in), mv);
     }
+
+    const __m512i a    = acc[0] ^ acc[1];
+    const __m256i a256 = _mm512_castsi512_si256(a) ^ _mm512_extracti64x4_epi64(a, 1);
+    const __m128i a128 =
+        _mm256_castsi256_si128(a256) ^ _mm256_extracti128_si256(a256, 1);
+
+    _mm_storeu_si128((__m128i *)z, a128);
+}
+
+// Evaluates the late plane of the early-reject layout (see gfni.h) over the
+// monomials |m|.
+void mq_gf256_n140_m72_late(OUT uint8_t *z,
+                            IN const uint8_t *m,
+                            IN const uint8_t *late_plane)
+{
+    const __m512i zero = _mm512_setzero_si512();
+
+    __m512i acc[SPLIT_ACCUMULATORS] = {zero, zero, zero, zero};
+    size_t  t                       = 0;
+    for(; t + SPLIT_ACCUMULATORS <= PUB_TERMS; t += SPLIT_ACCUMULATORS) {
+        for(size_t u = 0; u < SPLIT_ACCUMULATORS; u++) {
+            const uint8_t *in = &late_plane[(t + u) * SPLIT_MAIN_BYTES];
+            acc[u] ^= GFMUL(_mm512_load_si512(in), SET1(m[t + u]));
+        }
+    }
+    for(; t < PUB_TERMS; t++) {
+        const uint8_t *in = &late_plane[t * SPLIT_MAIN_BYTES];
+        acc[0] ^= GFMUL(_mm512_load_si512(in), SET1(m[t]));
+    }
+
+    MSTORE(z, (1ULL << LATE_EQS) - 1, acc[0] ^ acc[1] ^ acc[2] ^ acc[3]);
 }
 
-_INLINE_
-void from_redundant_mat_representation(OUT uint8_t *out,
-                                       IN const uint8_t *in,
-                                       IN const uint32_t h,
-                                       IN const uint32_t w,
-                                       IN const uint32_t w_64)
+void mq_gf256_n140_m72_stream_init(OUT mq_stream_t *st, IN const uint8_t *w)
 {
-    for(size_t i = 0; i < h; i++) {
-        memcpy(&out[i * w], &in[(i * w_64)], w);
+    expand_monomials(st->m, w);
+    STORE(st->acc, _mm512_setzero_si512());
+    STORE(st->tacc, _mm512_setzero_si512());
+    st->term = 0;
+}
+
+// The same evaluation as mq_gf256_n140_m72_monomials, but the accumulators are
+// kept in |st| between calls, so the key does not have to be in memory at once.
+void mq_gf256_n140_m72_stream_update(IN OUT mq_stream_t *st,
+                                     IN const uint8_t *rows,
+                                     IN const size_t   n_rows,
+                                     IN const int      pk_to_gfni)
+{
+    const __m512i A        = _mm512_set1_epi64(MATRIX_A);
+    const __m512i tail_idx = _mm512_set_epi64(7 * PUB_M, 6 * PUB_M, 5 * PUB_M,
+                                              4 * PUB_M, 3 * PUB_M, 2 * PUB_M,
+                                              1 * PUB_M, 0 * PUB_M);
+    const uint8_t *m       = &st->m[st->term];
+    __m512i        acc     = LOAD(st->acc);
+    __m512i        tacc    = LOAD(st->tacc);
+
+    assert(st->term + n_rows <= PUB_TERMS);
+
+    size_t t = 0;
+    for(; t + SPLIT_TAIL_TERMS <= n_rows; t += SPLIT_TAIL_TERMS) {
+        const uint8_t *r = &rows[t * PUB_M];
+
+        for(size_t u = 0; u < SPLIT_TAIL_TERMS; u++) {
+            __m512i inp = LOAD(&r[u * PUB_M]);
+            if(pk_to_gfni) {
+                inp = _mm512_gf2p8affine_epi64_epi8(inp, A, 0);
+            }
+            acc ^= GFMUL(inp, SET1(m[t + u]));
+        }
+
+        __m512i tails =
+            _mm512_i64gather_epi64(tail_idx, (const void *)&r[ZMM_BYTES], 1);
+        if(pk_to_gfni) {
+            tails = _mm512_gf2p8affine_epi64_epi8(tails, A, 0);
+        }
+        tacc ^= GFMUL(tails, bcast_bytes_to_qwords(&m[t]));
+    }
+
+    for(; t < n_rows; t++) {
+        const uint8_t *r    = &rows[t * PUB_M];
+        __m512i        inp0 = LOAD_ZMM1(r);
+        __m512i        inp1 = LOAD_ZMM2(r);
+        if(pk_to_gfni) {
+            inp0 = _mm512_gf2p8affine_epi64_epi8(inp0, A, 0);
+            inp1 = _mm512_gf2p8affine_epi64_epi8(inp1, A, 0);
+        }
+        acc ^= GFMUL(inp0, SET1(m[t]));
+        tacc ^= GFMUL(inp1, SET1(m[t]));
     }
+
+    STORE(st->acc, acc);
+    STORE(st->tacc, tacc);
+    st->term += n_rows;
 }
 
-uint32_t
-gf256mat_gauss_elim(IN OUT uint8_t *mat, IN const uint32_t h, IN const uint32_t w)
+void mq_gf256_n140_m72_stream_final(OUT uint8_t *z, IN const mq_stream_t *st)
 {
-    // This function is optimized for the following parameters
-    assert(h < ZMM_BYTES);
-    assert((w < (2 * ZMM_BYTES)) && (ZMM_BYTES < w));
+    assert(PUB_TERMS == st->term);
+
+    STORE_ZMM1(z, LOAD(st->acc));
+    STORE_ZMM2(z, xor_qwords(LOAD(st->tacc)));
+}
 
-    // The size of _mat is 36 * w_64, where here w_64 = 2*ZMM_BYTES
-    ALIGN(64) uint8_t _mat[(2 * ZMM_BYTES) * O1];
-    const uint32_t    w_64 = ((w + 63) >> 6) << 6;
+// The distance (in bytes) of the software prefetch of the public keys in
+// mq_gf256_n140_m72_multi.
+#define MQ_MULTI_PREFETCH_DIST (8 * PUB_M)
+
+// Evaluates the public maps of MQ_MULTI independent public keys with the
+// two-phase method of mq_gf256_n140_m72_monomials. The keys are walked
+// together, so the loads of the different keys are in flight at the same time.
+// |pk_mat| holds MQ_MULTI pointers to the keys, |w| holds MQ_MULTI consecutive
+// signatures (PUB_N bytes each) and |z| receives MQ_MULTI consecutive results
+// (PUB_M bytes each).
+void mq_gf256_n140_m72_multi(OUT uint8_t *z,
+                             IN const uint8_t *const pk_mat[MQ_MULTI],
+                             IN const uint8_t *      w)
+{
+    ALIGN(64) uint8_t m[MQ_MULTI][MONOMIALS_BYTES];
+    const __m512i     zero = _mm512_setzero_si512();
+    const __m512i     tail_idx =
+        _mm512_set_epi64(7 * PUB_M, 6 * PUB_M, 5 * PUB_M, 4 * PUB_M, 3 * PUB_M,
+                         2 * PUB_M, 1 * PUB_M, 0 * PUB_M);
+    __m512i acc[MQ_MULTI];
+    __m512i tacc[MQ_MULTI];
+
+    for(size_t k = 0; k < MQ_MULTI; k++) {
+        expand_monomials(m[k], &w[k * PUB_N]);
+        acc[k]  = zero;
+        tacc[k] = zero;
+    }
 
-    to_redundant_mat_representation(_mat, mat, h, w, w_64);
+    size_t t = 0;
+    for(; t + SPLIT_TAIL_TERMS <= PUB_TERMS; t += SPLIT_TAIL_TERMS) {
+        for(size_t k = 0; k < MQ_MULTI; k++) {
+            const uint8_t *rows = &pk_mat[k][t * PUB_M];
 
-    uint32_t r = _gf256mat_gauss_elim(_mat, h, w_64, w);
+            _mm_prefetch((const char *)&rows[MQ_MULTI_PREFETCH_DIST],
+                         _MM_HINT_T0);
+            for(size_t u = 0; u < SPLIT_TAIL_TERMS; u++) {
+                acc[k] ^= GFMUL(LOAD(&rows[u * PUB_M]), SET1(m[k][t + u]));
+            }
+
+            const __m512i tails = _mm512_i64gather_epi64(
+                tail_idx, (const void *)&rows[ZMM_BYTES], 1);
+            tacc[k] ^= GFMUL(tails, bcast_bytes_to_qwords(&m[k][t]));
+        }
+    }
+
+    for(; t < PUB_TERMS; t++) {
+        for(size_t k = 0; k < MQ_MULTI; k++) {
+            const uint8_t *row = &pk_mat[k][t * PUB_M];
+            const __m512i  b   = SET1(m[k][t]);
+            acc[k] ^= GFMUL(LOAD_ZMM1(row), b);
+            tacc[k] ^= GFMUL(LOAD_ZMM2(row), b);
+        }
+    }
+
+    for(size_t k = 0; k < MQ_MULTI; k++) {
+        STORE_ZMM1(&z[k * PUB_M], acc[k]);
+        STORE_ZMM2(&z[k * PUB_M], xor_qwords(tacc[k]));
+    }
+}
+
+// The quadratic forms y = sum_{i <= j} trimat[i][j] * x[i] * x[j] are evaluated
+// in two phases, as the public map in mq_gf256_n140_m72_monomials:
+// 1) The N_TRIANGLE_TERMS(dim) products x[i]*x[j] (i <= j) are expanded into a
+//    vector in the order of the triangular matrix.
+// 2) y is the matrix-vector product of the triangular matrix (one row of
+//    coefficients per term) and that vector.
+// Unlike multab_trimat_36, a row of the matrix is not scaled by x[i] at its
+// end, so the only dependencies are the XORs into QUAD_ACCUMULATORS
+// independent accumulators.
+#define QUAD_MAX_DIM      (V1)
+#define QUAD_PAD_BYTES    (8)
+#define QUAD_TERMS_BYTES  (N_TRIANGLE_TERMS(QUAD_MAX_DIM) + QUAD_PAD_BYTES)
+#define QUAD_ACCUMULATORS (4)
+
+// quad_form_36 expands the products in blocks of whole rows of up to
+// QUAD_BLOCK_BYTES, to keep its stack small.
+#define QUAD_BLOCK_BYTES (512)
+
+// Stores the dim - i products x[i]*x[j] (j >= i) in |m|, and returns their
+// number.
+_INLINE_ size_t expand_quad_row(OUT uint8_t *m,
+                                IN const uint8_t *x,
+                                IN const size_t   i,
+                                IN const size_t   dim)
+{
+    const __m512i xi = SET1(x[i]);
+
+    for(size_t j = i; j < dim; j += ZMM_BYTES, m += ZMM_BYTES) {
+        const size_t    len = ((dim - j) < ZMM_BYTES) ? (dim - j) : ZMM_BYTES;
+        const __mmask64 k   = (len == ZMM_BYTES) ? (__mmask64)-1 : ((1ULL << len) - 1);
+
+        MSTORE(m, k, GFMUL(MLOAD(k, &x[j]), xi));
+    }
+
+    return dim - i;
+}
+
+// Stores all the products in |m| followed by QUAD_PAD_BYTES zeros, and
+// returns their number.
+_INLINE_ size_t expand_quad_terms(OUT uint8_t *m, IN const uint8_t *x, IN const size_t dim)
+{
+    size_t t = 0;
+
+    for(size_t i = 0; i < dim; i++) {
+        t += expand_quad_row(&m[t], x, i, dim);
+    }
+
+    memset(&m[t], 0, QUAD_PAD_BYTES);
+    return t;
+}
+
+void quad_form_36(uint8_t *      y,
+                  const uint8_t *trimat,
+                  const uint8_t *x,
+                  uint32_t       dim)
+{
+    assert(dim <= QUAD_MAX_DIM);
+
+    ALIGN(64) uint8_t m[QUAD_BLOCK_BYTES];
+    const __mmask64   k    = NINE_ELEMS_MASK;
+    const __m512i     zero = _mm512_setzero_si512();
+
+    __m512i acc[QUAD_ACCUMULATORS] = {zero, zero, zero, zero};
+
+    for(size_t i = 0; i < dim;) {
+        size_t n = 0;
+        while((i < dim) && ((n + (dim - i)) <= QUAD_BLOCK_BYTES)) {
+            n += expand_quad_row(&m[n], x, i, dim);
+            i++;
+        }
+
+        size_t t = 0;
+        for(; t + QUAD_ACCUMULATORS <= n; t += QUAD_ACCUMULATORS) {
+            for(size_t u = 0; u < QUAD_ACCUMULATORS; u++) {
+                acc[u] ^= GFMUL(MLOAD(k, &trimat[(t + u) * ELEMS]), SET1(m[t + u]));
+            }
+        }
+        for(; t < n; t++) {
+            acc[0] ^= GFMUL(MLOAD(k, &trimat[t * ELEMS]), SET1(m[t]));
+        }
+
+        trimat += n * ELEMS;
+    }
+
+    MSTORE(y, k, acc[0] ^ acc[1] ^ acc[2] ^ acc[3]);
+
+    secure_clean(m, sizeof(m));
+}
+
+// The F1 entries of the two layers form one 72-byte row. The 36 bytes of
+// layer 1 and the first F1_L2_HEAD bytes of layer 2 share one register, and the
+// last 8 bytes of layer 2 of 8 consecutive entries are gathered into the qwords
+// of a second register. In the interleaved layout this is exactly the split of
+// a row into its first 64 bytes and its tail.
+#define F1_L2_HEAD   (ZMM_BYTES - ELEMS)
+#define F1_L2_MASK   ((1ULL << F1_L2_HEAD) - 1)
+#define F1_TAIL_ROWS (8)
+
+// The F1 entries of both layers, either as two separate arrays or as the
+// interleaved rows (when |ilv| is not NULL).
+typedef struct f1_src_st {
+    const uint8_t *l1;
+    const uint8_t *l2;
+    const uint8_t *ilv;
+} f1_src_t;
+
+// The head of entry |e|: layer 1 in bytes 0..35 and layer 2 in bytes 36..63
+_INLINE_ __m512i f1_head(IN const f1_src_t *f1, IN const size_t e)
+{
+    if(NULL != f1->ilv) {
+        return LOAD(&f1->ilv[e * SK_ILV_ROW_BYTES]);
+    }
+
+    // The layer 2 bytes are shifted up by 9 dwords
+    return MLOAD(NINE_ELEMS_MASK, &f1->l1[e * ELEMS]) |
+           _mm512_alignr_epi32(MLOAD(F1_L2_MASK, &f1->l2[e * ELEMS]),
+                               _mm512_setzero_si512(), 7);
+}
+
+// The tails of the |km| entries starting at |e|, one per qword
+_INLINE_ __m512i f1_tails(IN const f1_src_t *f1, IN const size_t e, IN const __mmask8 km)
+{
+    const __m512i zero = _mm512_setzero_si512();
+
+    if(NULL != f1->ilv) {
+        const __m512i idx = _mm512_set_epi64(
+            7 * SK_ILV_ROW_BYTES, 6 * SK_ILV_ROW_BYTES, 5 * SK_ILV_ROW_BYTES,
+            4 * SK_ILV_ROW_BYTES, 3 * SK_ILV_ROW_BYTES, 2 * SK_ILV_ROW_BYTES,
+            1 * SK_ILV_ROW_BYTES, 0 * SK_ILV_ROW_BYTES);
+        return _mm512_mask_i64gather_epi64(
+            zero, km, idx, (const void *)&f1->ilv[(e * SK_ILV_ROW_BYTES) + ZMM_BYTES],
+            1);
+    }
+
+    const __m512i idx = _mm512_set_epi64(7 * ELEMS, 6 * ELEMS, 5 * ELEMS, 4 * ELEMS,
+                                         3 * ELEMS, 2 * ELEMS, 1 * ELEMS, 0 * ELEMS);
+    return _mm512_mask_i64gather_epi64(
+        zero, km, idx, (const void *)&f1->l2[(e * ELEMS) + F1_L2_HEAD], 1);
+}
+
+// The F1 maps of both layers are one quadratic form with 72 outputs. The
+// heads of consecutive terms are accumulated into QUAD_ACCUMULATORS registers,
+// and the tails of 8 consecutive terms are multiplied by their 8 products at
+// once (see bcast_bytes_to_qwords). The terms are not split into the rows of
+// the triangular matrix, so only the last group of tails is partial.
+_INLINE_ void vinegar_f1(OUT uint8_t *r_l1,
+                         OUT uint8_t *r_l2,
+                         IN const f1_src_t *f1,
+                         IN const uint8_t *x)
+{
+    ALIGN(64) uint8_t m[QUAD_TERMS_BYTES];
+    const __m512i     zero = _mm512_setzero_si512();
+
+    const size_t n_terms = expand_quad_terms(m, x, V1);
+
+    __m512i acc[QUAD_ACCUMULATORS] = {zero, zero, zero, zero};
+    __m512i tacc[2]                = {zero, zero};
+    size_t  t                      = 0;
+
+    for(; t + F1_TAIL_ROWS <= n_terms; t += F1_TAIL_ROWS) {
+        for(size_t u = 0; u < F1_TAIL_ROWS; u++) {
+            acc[u % QUAD_ACCUMULATORS] ^= GFMUL(f1_head(f1, t + u), SET1(m[t + u]));
+        }
+        tacc[(t / F1_TAIL_ROWS) & 1] ^=
+            GFMUL(f1_tails(f1, t, 0xff), bcast_bytes_to_qwords(&m[t]));
+    }
+
+    // The last (n_terms - t) < 8 terms
+    const __mmask8 km = (__mmask8)((1U << (n_terms - t)) - 1);
+    tacc[0] ^= GFMUL(f1_tails(f1, t, km), bcast_bytes_to_qwords(&m[t]));
+    for(; t < n_terms; t++) {
+        acc[0] ^= GFMUL(f1_head(f1, t), SET1(m[t]));
+    }
+
+    const __m512i y = acc[0] ^ acc[1] ^ acc[2] ^ acc[3];
+    MSTORE(r_l1, NINE_ELEMS_MASK, y);
+    MSTORE(r_l2, F1_L2_MASK, _mm512_alignr_epi32(zero, y, 9));
+    MSTORE(&r_l2[F1_L2_HEAD], ZMM2_BYTES_MASK, xor_qwords(tacc[0] ^ tacc[1]));
+
+    secure_clean(m, n_terms);
+}
+
+// The number of 64-byte chunks of an output that are accumulated in registers
+// in one pass over the vinegar.
+#define VINEGAR_CHUNKS    (4)
+#define VINEGAR_MAPS      (3)
+#define VINEGAR_MAP_BYTES (ELEMS * ELEMS)
+
+// c[m] = A[m] * x for |n_maps| <= VINEGAR_MAPS maps of V1 columns of |n_bytes| bytes.
+// Every chunk of the outputs is accumulated in a register over all the
+// vinegar, instead of the load/store of gfmat_prod_native per column. The
+// maps share the broadcasts of the vinegar.
+_INLINE_ void vinegar_bilinear(OUT uint8_t *const c[],
+                               IN const uint8_t *const A[],
+                               IN const size_t n_maps,
+                               IN const size_t n_bytes,
+                               IN const uint8_t *x)
+{
+    const size_t    n_full = (n_bytes / ZMM_BYTES) * ZMM_BYTES;
+    const __mmask64 krem   = (1ULL << (n_bytes % ZMM_BYTES)) - 1;
+
+    size_t o = 0;
+    for(; o + (VINEGAR_CHUNKS * ZMM_BYTES) <= n_full; o += VINEGAR_CHUNKS * ZMM_BYTES) {
+        __m512i acc[VINEGAR_MAPS][VINEGAR_CHUNKS] = {0};
+
+        for(size_t i = 0; i < V1; i++) {
+            const __m512i b = SET1(x[i]);
+            for(size_t m = 0; m < n_maps; m++) {
+                const uint8_t *a = &A[m][(i * n_bytes) + o];
+                for(size_t ch = 0; ch < VINEGAR_CHUNKS; ch++) {
+                    acc[m][ch] ^= GFMUL(LOAD(&a[ch * ZMM_BYTES]), b);
+                }
+            }
+        }
+
+        for(size_t m = 0; m < n_maps; m++) {
+            for(size_t ch = 0; ch < VINEGAR_CHUNKS; ch++) {
+                STORE(&c[m][o + (ch * ZMM_BYTES)], acc[m][ch]);
+            }
+        }
+    }
+
+    // The remaining (full or partial) chunks, one at a time
+    for(; o < n_bytes; o += ZMM_BYTES) {
+        const __mmask64 k                 = (o < n_full) ? (__mmask64)-1 : krem;
+        __m512i         acc[VINEGAR_MAPS] = {0};
+
+        for(size_t i = 0; i < V1; i++) {
+            const __m512i b = SET1(x[i]);
+            for(size_t m = 0; m < n_maps; m++) {
+                acc[m] ^= GFMUL(MLOAD(k, &A[m][(i * n_bytes) + o]), b);
+            }
+        }
+
+        for(size_t m = 0; m < n_maps; m++) {
+            MSTORE(&c[m][o], k, acc[m]);
+        }
+    }
+}
+
+void vinegar_maps_36(OUT uint8_t *r_l1_F1,
+                     OUT uint8_t *r_l2_F1,
+                     OUT uint8_t *mat_l1,
+                     OUT uint8_t *mat_l2_F3,
+                     OUT uint8_t *mat_l2_F2,
+                     IN const sk_t *sk,
+                     IN const uint8_t *vinegar)
+{
+    const f1_src_t       f1              = {sk->l1_F1, sk->l2_F1, NULL};
+    uint8_t *const       c[VINEGAR_MAPS] = {mat_l1, mat_l2_F3, mat_l2_F2};
+    const uint8_t *const A[VINEGAR_MAPS] = {sk->l1_F2, sk->l2_F3, sk->l2_F2};
+
+    vinegar_f1(r_l1_F1, r_l2_F1, &f1, vinegar);
+    vinegar_bilinear(c, A, VINEGAR_MAPS, VINEGAR_MAP_BYTES, vinegar);
+}
+
+void vinegar_f1_interleaved_36(OUT uint8_t *r_l1_F1,
+                               OUT uint8_t *r_l2_F1,
+                               IN const sk_interleaved_t *ilv,
+                               IN const uint8_t *vinegar)
+{
+    const f1_src_t f1 = {NULL, NULL, &ilv->F1[0][0]};
+
+    vinegar_f1(r_l1_F1, r_l2_F1, &f1, vinegar);
+}
+
+void vinegar_f2_interleaved_36(OUT uint8_t *mat_l1,
+                               OUT uint8_t *mat_l2_F2,
+                               IN const sk_interleaved_t *ilv,
+                               IN const uint8_t *vinegar)
+{
+    // Row j of mat holds column j of mat_l1 and of mat_l2_F2
+    ALIGN(64) uint8_t    mat[O1][SK_ILV_ROW_BYTES];
+    uint8_t *const       c[1] = {&mat[0][0]};
+    const uint8_t *const A[1] = {&ilv->F2[0][0]};
+
+    vinegar_bilinear(c, A, 1, sizeof(mat), vinegar);
+
+    for(size_t j = 0; j < O1; j++) {
+        memcpy(&mat_l1[j * O1], &mat[j][0], O1);
+        memcpy(&mat_l2_F2[j * O2], &mat[j][O1], O2);
+    }
+
+    secure_clean(&mat[0][0], sizeof(mat));
+}
+
+void vinegar_f3_36(OUT uint8_t *mat_l2_F3,
+                   IN const uint8_t *l2_F3,
+                   IN const uint8_t *vinegar)
+{
+    uint8_t *const       c[1] = {mat_l2_F3};
+    const uint8_t *const A[1] = {l2_F3};
+
+    vinegar_bilinear(c, A, 1, VINEGAR_MAP_BYTES, vinegar);
+}
+
+void vinegar_maps_interleaved_36(OUT uint8_t *r_l1_F1,
+                                 OUT uint8_t *r_l2_F1,
+                                 OUT uint8_t *mat_l1,
+                                 OUT uint8_t *mat_l2_F3,
+                                 OUT uint8_t *mat_l2_F2,
+                                 IN const sk_interleaved_t *ilv,
+                                 IN const uint8_t *l2_F3,
+                                 IN const uint8_t *vinegar)
+{
+    vinegar_f1_interleaved_36(r_l1_F1, r_l2_F1, ilv, vinegar);
+    vinegar_f2_interleaved_36(mat_l1, mat_l2_F2, ilv, vinegar);
+    vinegar_f3_36(mat_l2_F3, l2_F3, vinegar);
+}
+
+// Broadcasts byte |k| of |a| to all the bytes
+#define BCAST_BYTE(kidx, a) (_mm512_permutexvar_epi8(kidx, a))
+
+// The identity permutation of the bytes
+#define PERM_ID                                                          \
+    (_mm512_set_epi64(0x3f3e3d3c3b3a3938, 0x3736353433323130,            \
+                      0x2f2e2d2c2b2a2928, 0x2726252423222120,            \
+                      0x1f1e1d1c1b1a1918, 0x1716151413121110,            \
+                      0x0f0e0d0c0b0a0908, 0x0706050403020100))
+
+// Swaps r0 and rs in constant time if |cond| is 1, and clears |need|.
+_INLINE_ void
+cswap(IN OUT __m512i *r0, IN OUT __m512i *rs, IN OUT uint64_t *need, uint64_t cond)
+{
+    const __mmask64 swap = 0 - cond;
+    const __m512i   t    = *r0;
+
+    *r0 = _mm512_mask_mov_epi8(*r0, swap, *rs);
+    *rs = _mm512_mask_mov_epi8(*rs, swap, t);
+    *need &= ~cond;
+}
+
+// Applies the transposition (k, j) to the values of |perm|
+_INLINE_ __m512i perm_swap(IN const __m512i perm, IN const __m512i kidx, IN const __m512i jidx)
+{
+    const __mmask64 mk = _mm512_cmpeq_epi8_mask(perm, kidx);
+    const __mmask64 mj = _mm512_cmpeq_epi8_mask(perm, jidx);
+
+    return _mm512_mask_mov_epi8(_mm512_mask_mov_epi8(perm, mk, jidx), mj, kidx);
+}
+
+// A Gauss-Jordan step on the column |c| with the pivot column |p|: row k is
+// multiplied by pinv and then eliminated from the other rows.
+_INLINE_ __m512i eliminate(IN const __m512i c,
+                           IN const __m512i p,
+                           IN const __m512i pinv,
+                           IN const __m512i kidx,
+                           IN const __mmask64 kbit)
+{
+    const __m512i t = GFMUL(BCAST_BYTE(kidx, c), pinv);
+    return _mm512_mask_mov_epi8(c ^ GFMUL(p, t), kbit, t);
+}
+
+// In-place Gauss-Jordan inversion of a 36x36 matrix. The 36-byte lines of |a|
+// are held as the columns of the matrix, one zmm register per column. At step
+// k the register r[s] holds the column (k + s) mod 36, so the pivot column is
+// always r[0] and the (unrolled) register indices are fixed across the steps.
+// A zero pivot is swapped with the first unprocessed column that has a
+// non-zero in row k using masked blends, in constant time. The column swaps
+// permute the rows of the inverse, and are undone with a single vpermb per
+// column at the end.
+uint32_t gf256mat_inv_36(OUT uint8_t *inv_a, IN const uint8_t *a)
+{
+    const __m512i   I = _mm512_set1_epi64(MATRIX_I);
+    const __mmask64 m = NINE_ELEMS_MASK;
+
+    __m512i  r[ELEMS];
+    __m512i  perm = PERM_ID;
+    uint64_t r8   = 1;
+
+#pragma GCC unroll 36
+    for(size_t s = 0; s < ELEMS; s++) {
+        r[s] = MLOAD(m, &a[s * ELEMS]);
+    }
+
+    for(uint64_t k = 0; k < ELEMS; k++) {
+        const __mmask64 kbit = 1ULL << k;
+        const __m512i   kidx = SET1((char)k);
+
+        // Pivot search. |need| is 1 as long as r[0] has a zero in row k.
+        uint64_t need = 1 ^ ((_mm512_test_epi8_mask(r[0], r[0]) >> k) & 1);
+        uint64_t sel  = 0;
+
+#pragma GCC unroll 36
+        for(uint64_t s = 1; s < ELEMS; s++) {
+            // Only the columns k + s < 36 are not processed yet
+            const uint64_t valid = ((k + s) - ELEMS) >> 63;
+            const uint64_t nz    = (_mm512_test_epi8_mask(r[s], r[s]) >> k) & 1;
+            const uint64_t cond  = need & nz & valid;
+
+            sel |= (0 - cond) & s;
+            cswap(&r[0], &r[s], &need, cond);
+        }
+        r8 &= 1 ^ need;
+
+        perm = perm_swap(perm, kidx, SET1((char)(k + sel)));
+
+        // pinv = (r[0][k])^{-1} in all the bytes
+        const __m512i pinv =
+            _mm512_gf2p8affineinv_epi64_epi8(BCAST_BYTE(kidx, r[0]), I, 0);
+
+        // Column k is replaced with the respective column of the inverse.
+#pragma GCC unroll 36
+        for(size_t s = 1; s < ELEMS; s++) {
+            r[s] = eliminate(r[s], r[0], pinv, kidx, kbit);
+        }
+        const __m512i c = _mm512_mask_mov_epi8(GFMUL(r[0], pinv), kbit, pinv);
+
+        // Rotate the registers
+#pragma GCC unroll 36
+        for(size_t s = 0; s < ELEMS - 1; s++) {
+            r[s] = r[s + 1];
+        }
+        r[ELEMS - 1] = c;
+    }
+
+#pragma GCC unroll 36
+    for(size_t s = 0; s < ELEMS; s++) {
+        MSTORE(&inv_a[s * ELEMS], m, _mm512_permutexvar_epi8(perm, r[s]));
+    }
+
+    return (uint32_t)r8;
+}
+
+// The solver drops every pivot column once it is processed. The steps are
+// split into phases, so that a phase only runs over the columns that are
+// still alive at its beginning.
+#define SOLVE_PHASE_STEPS (9)
+
+_INLINE_ void solve_phase(IN OUT __m512i *r,
+                          IN OUT __m512i *b,
+                          IN OUT __m512i *perm,
+                          IN OUT uint64_t *r8,
+                          IN const uint64_t k0,
+                          IN const size_t   n)
+{
+    const __m512i I = _mm512_set1_epi64(MATRIX_I);
+
+    for(uint64_t k = k0; k < k0 + SOLVE_PHASE_STEPS; k++) {
+        const __mmask64 kbit = 1ULL << k;
+        const __m512i   kidx = SET1((char)k);
+
+        // The dropped columns are zero and are never selected as pivots
+        uint64_t need = 1 ^ ((_mm512_test_epi8_mask(r[0], r[0]) >> k) & 1);
+        uint64_t sel  = 0;
+
+#pragma GCC unroll 36
+        for(uint64_t s = 1; s < n; s++) {
+            const uint64_t cond =
+                need & (_mm512_test_epi8_mask(r[s], r[s]) >> k) & 1;
+
+            sel |= (0 - cond) & s;
+            cswap(&r[0], &r[s], &need, cond);
+        }
+        *r8 &= 1 ^ need;
+
+        *perm = perm_swap(*perm, kidx, SET1((char)(k + sel)));
+
+        const __m512i pinv =
+            _mm512_gf2p8affineinv_epi64_epi8(BCAST_BYTE(kidx, r[0]), I, 0);
+
+        const __m512i p = r[0];
+
+        *b = eliminate(*b, p, pinv, kidx, kbit);
+
+        // Eliminate and drop the pivot column
+#pragma GCC unroll 36
+        for(size_t s = 1; s < n; s++) {
+            r[s - 1] = eliminate(r[s], p, pinv, kidx, kbit);
+        }
+        r[n - 1] = _mm512_setzero_si512();
+    }
+}
+
+// Solves A * x = b with Gauss-Jordan elimination of the augmented 36x37
+// matrix. The pivoting and the layout of |a| are as in gf256mat_inv_36. The
+// column swaps permute the solution, and are undone at the end.
+uint32_t gf256mat_solve_36(OUT uint8_t *x, IN const uint8_t *a, IN const uint8_t *b)
+{
+    const __mmask64 m = NINE_ELEMS_MASK;
+
+    __m512i  r[ELEMS];
+    __m512i  bv   = MLOAD(m, b);
+    __m512i  perm = PERM_ID;
+    uint64_t r8   = 1;
+
+#pragma GCC unroll 36
+    for(size_t s = 0; s < ELEMS; s++) {
+        r[s] = MLOAD(m, &a[s * ELEMS]);
+    }
+
+#pragma GCC unroll 4
+    for(size_t k0 = 0; k0 < ELEMS; k0 += SOLVE_PHASE_STEPS) {
+        solve_phase(r, &bv, &perm, &r8, k0, ELEMS - k0);
+    }
 
-    from_redundant_mat_representation(mat, _mat, h, w, w_64);
+    MSTORE(x, m, _mm512_permutexvar_epi8(perm, bv));
 
-    return r;
+    return (uint32_t)r8;
 }
@@ -24,6 +24,7 @@
 #pragma once
 
 #include "defs.h"
+#include "rainbow_config.h"
 
 EXTERNC_BEGIN
 
@@ -31,10 +32,14 @@ void to_gfni(uint8_t *out, const uint8_t *in, size_t byte_len);
 
 void from_gfni(uint8_t *out, const uint8_t *in, size_t byte_len);
 
-void obsfucate_l1_polys(uint8_t *      l1_polys,
-                        const uint8_t *l2_polys,
-                        uint32_t       n_terms,
-                        const uint8_t *s1);
+// Stores |n_terms| consecutive terms of the public key at |out| (PUB_M bytes
+// per term). The layer 1 coefficients are obfuscated with S1 (l1 + S1 * l2)
+// and both layers are converted back to the AES field in registers.
+void pk_store_terms_36(uint8_t *      out,
+                       const uint8_t *l1_polys,
+                       const uint8_t *l2_polys,
+                       uint32_t       n_terms,
+                       const uint8_t *s1);
 
 void gfmat_prod_native(uint8_t *      c,
                        const uint8_t *matA,
@@ -64,8 +69,176 @@ void multab_trimat_36(uint8_t *      y,
                       const uint8_t *x,
                       uint32_t       dim);
 
+// Same as multab_trimat_36 (for dim <= V1). The products x[i]*x[j] are
+// computed first, and then multiplied by the triangular matrix as one
+// matrix-vector product.
+void quad_form_36(uint8_t *      y,
+                  const uint8_t *trimat,
+                  const uint8_t *x,
+                  uint32_t       dim);
+
+// The number of vectors that the _batch matrix kernels below process
+// together.
+#define MAT_BATCH (8)
+
+// Same as MAT_BATCH calls to gfmat_prod_native(c[k], matA, ..., b[k]). Every
+// column of |matA| is loaded once for all the vectors.
+void gfmat_prod_native_batch(uint8_t *const       c[MAT_BATCH],
+                             const uint8_t *      matA,
+                             uint32_t             n_A_vec_byte,
+                             uint32_t             n_A_width,
+                             const uint8_t *const b[MAT_BATCH]);
+
+// Same as MAT_BATCH calls to multab_trimat_36(y[k], trimat, x[k], dim).
+void multab_trimat_36_batch(uint8_t *const       y[MAT_BATCH],
+                            const uint8_t *      trimat,
+                            const uint8_t *const x[MAT_BATCH],
+                            uint32_t             dim);
+
+// The interleaved layout of the F1 and F2 maps (see prepared.h)
+typedef struct sk_interleaved_st sk_interleaved_t;
+
+// Evaluates all the vinegar dependent parts of the central map in one pass:
+// the two F1 maps on |vinegar| (as multab_trimat_36), and the products of
+// l1_F2, l2_F3 and l2_F2 with |vinegar| (as gfmat_prod_native).
+void vinegar_maps_36(uint8_t *      r_l1_F1,
+                     uint8_t *      r_l2_F1,
+                     uint8_t *      mat_l1,
+                     uint8_t *      mat_l2_F3,
+                     uint8_t *      mat_l2_F2,
+                     const sk_t *   sk,
+                     const uint8_t *vinegar);
+
+// The three independent parts of vinegar_maps_interleaved_36: the F1 maps of
+// both layers, the F2 maps of both layers, and the layer 2 F3 map.
+void vinegar_f1_interleaved_36(uint8_t *               r_l1_F1,
+                               uint8_t *               r_l2_F1,
+                               const sk_interleaved_t *ilv,
+                               const uint8_t *         vinegar);
+
+void vinegar_f2_interleaved_36(uint8_t *               mat_l1,
+                               uint8_t *               mat_l2_F2,
+                               const sk_interleaved_t *ilv,
+                               const uint8_t *         vinegar);
+
+void vinegar_f3_36(uint8_t *mat_l2_F3, const uint8_t *l2_F3, const uint8_t *vinegar);
+
+// Same as vinegar_maps_36, with the F1 and F2 maps of both layers in the
+// interleaved layout |ilv|.
+void vinegar_maps_interleaved_36(uint8_t *               r_l1_F1,
+                                 uint8_t *               r_l2_F1,
+                                 uint8_t *               mat_l1,
+                                 uint8_t *               mat_l2_F3,
+                                 uint8_t *               mat_l2_F2,
+                                 const sk_interleaved_t *ilv,
+                                 const uint8_t *         l2_F3,
+                                 const uint8_t *         vinegar);
+
 void mq_gf256_n140_m72(uint8_t *z, const uint8_t *pk_mat, const uint8_t *w);
 
-uint32_t gf256mat_gauss_elim(IN OUT uint8_t *mat, IN uint32_t h, IN uint32_t w);
+// Same as mq_gf256_n140_m72 but |pk_mat| is in the original field and |w| is
+// in the GFNI field. The public key rows are converted in registers, so no
+// converted copy of the public key is needed.
+void mq_gf256_n140_m72_to_gfni(uint8_t *z, const uint8_t *pk_mat, const uint8_t *w);
+
+// Two-phase (monomial expansion + matrix-vector product) evaluation of the
+// public map. Same inputs and output as mq_gf256_n140_m72.
+void mq_gf256_n140_m72_monomials(uint8_t *      z,
+                                 const uint8_t *pk_mat,
+                                 const uint8_t *w);
+
+// The number of signatures that mq_gf256_n140_m72_monomials_batch evaluates
+// together. The kernel keeps one signature per qword of a register, so this
+// must be 8.
+#define MQ_BATCH (8)
+
+// Two-phase evaluation of MQ_BATCH signatures (a matrix-matrix product).
+// |w| holds MQ_BATCH consecutive signatures and |z| receives MQ_BATCH
+// consecutive results.
+void mq_gf256_n140_m72_monomials_batch(uint8_t *      z,
+                                       const uint8_t *pk_mat,
+                                       const uint8_t *w);
+
+// The number of independent public keys that mq_gf256_n140_m72_multi
+// evaluates together.
+#define MQ_MULTI (4)
+
+// The split public key layout: SPLIT_MAIN_BYTES equations of every term are
+// stored in the main plane, and the SPLIT_TAIL_BYTES remaining equations of
+// SPLIT_TAIL_TERMS consecutive terms are packed into one line of the tail plane.
+#define SPLIT_MAIN_BYTES (64)
+#define SPLIT_TAIL_BYTES (8)
+#define SPLIT_TAIL_TERMS (SPLIT_MAIN_BYTES / SPLIT_TAIL_BYTES)
+#define SPLIT_TAIL_LINES ((PUB_TERMS + SPLIT_TAIL_TERMS - 1) / SPLIT_TAIL_TERMS)
+
+// |main_plane| and |tail_plane| must be 64-byte aligned.
+void mq_gf256_n140_m72_split(uint8_t *      z,
+                             const uint8_t *main_plane,
+                             const uint8_t *tail_plane,
+                             const uint8_t *w);
+
+// The size of a monomials buffer: PUB_TERMS padded to a multiple of
+// SPLIT_TAIL_TERMS.
+#define MONOMIALS_BYTES (SPLIT_TAIL_LINES * SPLIT_TAIL_TERMS)
+
+// The early-reject layout: the first EARLY_EQS equations of EARLY_TERMS
+// consecutive terms are packed into one 64-byte line of the early plane, and
+// the remaining LATE_EQS equations of every term are stored in a (zero padded)
+// 64-byte line of the late plane.
+#define EARLY_EQS   (16)
+#define LATE_EQS    (PUB_M - EARLY_EQS)
+#define EARLY_TERMS (SPLIT_MAIN_BYTES / EARLY_EQS)
+#define EARLY_LINES ((PUB_TERMS + EARLY_TERMS - 1) / EARLY_TERMS)
+
+// Expands the monomials of |w| into |m| (MONOMIALS_BYTES) and evaluates the
+// first EARLY_EQS equations of the public map into |z|.
+// |early_plane| must be 64-byte aligned.
+void mq_gf256_n140_m72_early(uint8_t *      z,
+                             uint8_t *      m,
+                             const uint8_t *early_plane,
+                             const uint8_t *w);
+
+// Evaluates the last LATE_EQS equations of the public map into |z| given the
+// monomials |m| computed by mq_gf256_n140_m72_early.
+// |late_plane| and |m| must be 64-byte aligned.
+void mq_gf256_n140_m72_late(uint8_t *      z,
+                            const uint8_t *m,
+                            const uint8_t *late_plane);
+
+// The state of a public map evaluation over a public key that is streamed in
+// chunks of rows (see mq_gf256_n140_m72_stream_update).
+typedef struct mq_stream_st {
+    ALIGN(64) uint8_t m[MONOMIALS_BYTES];
+    ALIGN(64) uint8_t acc[64];
+    ALIGN(64) uint8_t tacc[64];
+    size_t term;
+} mq_stream_t;
+
+// Expands the monomials of |w| and resets the accumulators.
+void mq_gf256_n140_m72_stream_init(mq_stream_t *st, const uint8_t *w);
+
+// Accumulates the next |n_rows| rows (terms) of the public key. When
+// |pk_to_gfni| is set the rows are in the original field and are converted in
+// registers.
+void mq_gf256_n140_m72_stream_update(mq_stream_t *  st,
+                                     const uint8_t *rows,
+                                     size_t         n_rows,
+                                     int            pk_to_gfni);
+
+// Stores the result once all the PUB_TERMS rows were accumulated.
+void mq_gf256_n140_m72_stream_final(uint8_t *z, const mq_stream_t *st);
+
+void mq_gf256_n140_m72_multi(uint8_t *            z,
+                             const uint8_t *const pk_mat[MQ_MULTI],
+                             const uint8_t *      w);
+
+// Inverts the 36x36 matrix |a| into |inv_a| (which may alias |a|) in constant
+// time. Returns 1 if |a| is invertible and 0 otherwise.
+uint32_t gf256mat_inv_36(OUT uint8_t *inv_a, IN const uint8_t *a);
+
+// Solves the 36x36 system |a| * x = |b| in constant time, where the 36-byte
+// lines of |a| are its columns (as in gfmat_prod_native). Returns 1 if |a| is
+// invertible and 0 otherwise.
+uint32_t gf256mat_solve_36(OUT uint8_t *x, IN const uint8_t *a, IN const uint8_t *b);
 
 EXTERNC_END
@@ -21,9 +21,14 @@
  * (ndrucker@amazon.com, gueron@amazon.com)
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
 #include "gfni.h"
 #include "keypair_computation.h"
 #include "rainbow_config.h"
+#include "utils_mem.h"
 #include "utils_prng.h"
 
 _INLINE_
@@ -80,30 +85,265 @@ void gen_sk(OUT sk_t *sk, IN const uint8_t *sk_seed)
     memset(&prng0, 0, sizeof(prng_t));
 }
 
-void rainbow_keypair(OUT pk_t *pk, OUT sk_t *sk, IN const uint8_t *sk_seed)
+// Expands |sk_seed| to |sk| in the internal field representation.
+_INLINE_ void sk_begin(OUT sk_t *sk, IN const uint8_t *sk_seed)
 {
     gen_sk(sk, sk_seed);
 
 #ifndef USE_AES_FIELD
     to_gfni((uint8_t *)sk, (uint8_t *)sk, sizeof(*sk));
 #endif
-    ext_cpk_t epk;
+}
 
-    // Compute the public key in ext_cpk_t format.
-    calc_pk(&epk, sk);
+// Completes |sk| after its public key was computed (the public key is
+// computed from T2, which is in the t4 field).
+_INLINE_ void sk_finish(IN OUT sk_t *sk)
+{
     calculate_t4(sk->t4, sk->t1, sk->t3);
 
-    obsfucate_l1_polys(epk.l1_Q1, epk.l2_Q1, N_TRIANGLE_TERMS(V1), sk->s1);
-    obsfucate_l1_polys(epk.l1_Q2, epk.l2_Q2, V1 * O1, sk->s1);
-    obsfucate_l1_polys(epk.l1_Q3, epk.l2_Q3, V1 * O2, sk->s1);
-    obsfucate_l1_polys(epk.l1_Q5, epk.l2_Q5, N_TRIANGLE_TERMS(O1), sk->s1);
-    obsfucate_l1_polys(epk.l1_Q6, epk.l2_Q6, O1 * O2, sk->s1);
-    obsfucate_l1_polys(epk.l1_Q9, epk.l2_Q9, N_TRIANGLE_TERMS(O2), sk->s1);
-
 #ifndef USE_AES_FIELD
     from_gfni((uint8_t *)sk, (uint8_t *)sk, sizeof(*sk));
-    from_gfni((uint8_t *)&epk, (uint8_t *)&epk, sizeof(epk));
 #endif
+}
+
+void keypair_ws(OUT pk_t *pk,
+                OUT sk_t *sk,
+                IN const uint8_t *sk_seed,
+                OUT calc_pk_ws_t *ws,
+                IN rainbow_team_t *team)
+{
+    sk_begin(sk, sk_seed);
+    calc_pk(pk, sk, ws, team);
+    sk_finish(sk);
+}
+
+_INLINE_ int keypair(OUT pk_t *pk,
+                     OUT sk_t *sk,
+                     IN const uint8_t *sk_seed,
+                     IN rainbow_team_t *team)
+{
+    calc_pk_ws_t *ws = aligned_malloc(sizeof(*ws));
+    if(NULL == ws) {
+        return ERROR;
+    }
+
+    keypair_ws(pk, sk, sk_seed, ws, team);
+    aligned_secure_free(ws, sizeof(*ws));
+
+    return SUCCESS;
+}
+
+int rainbow_keypair(OUT pk_t *pk, OUT sk_t *sk, IN const uint8_t *sk_seed)
+{
+    return keypair(pk, sk, sk_seed, NULL);
+}
+
+int rainbow_keypair_team(OUT pk_t *pk,
+                         OUT sk_t *sk,
+                         IN const uint8_t *sk_seed,
+                         IN rainbow_team_t *team)
+{
+    return keypair(pk, sk, sk_seed, team);
+}
+
+int rainbow_keypair_mt(OUT pk_t *pk,
+                       OUT sk_t *sk,
+                       IN const uint8_t *sk_seed,
+                       IN const size_t   n_threads)
+{
+    if(n_threads <= 1) {
+        return keypair(pk, sk, sk_seed, NULL);
+    }
+
+    rainbow_team_t *team = rainbow_team_create(n_threads - 1, -1);
+    if(NULL == team) {
+        return ERROR;
+    }
+
+    const int ret = keypair(pk, sk, sk_seed, team);
+    rainbow_team_release(team);
+
+    return ret;
+}
+
+// The public key is written in chunks of up to PK_STREAM_CHUNK_BYTES bytes.
+// A writer thread writes one chunk buffer while calc_pk_stream fills the other.
+#define PK_STREAM_CHUNK_BYTES (64 * 1024)
+
+typedef struct pk_writer_st {
+    rainbow_pk_write_cb write_cb;
+    void *              ctx;
+    uint8_t *           buf[2];
+    size_t              len[2];
+    uint32_t            full[2];
+    size_t              slot;
+    uint32_t            done;
+    int                 err;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+} pk_writer_t;
+
+_INLINE_ void *pk_writer(IN OUT void *arg)
+{
+    pk_writer_t *w = arg;
+
+    for(size_t c = 0;; c++) {
+        const size_t slot = c & 1;
+
+        pthread_mutex_lock(&w->lock);
+        while(!w->full[slot] && !w->done) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        const uint32_t full = w->full[slot];
+        pthread_mutex_unlock(&w->lock);
+
+        // Done, and all the chunks were written
+        if(!full) {
+            break;
+        }
+
+        const int err = w->write_cb(w->ctx, w->buf[slot], w->len[slot]);
+
+        pthread_mutex_lock(&w->lock);
+        w->full[slot] = 0;
+        w->err |= err;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+
+        if(0 != err) {
+            break;
+        }
+    }
+
+    return NULL;
+}
 
-    extcpk_to_pk(pk, &epk);
+// Passes the current chunk to the writer, and waits until the other buffer
+// is free. Returns the writer error.
+_INLINE_ int pk_writer_flush(IN OUT pk_writer_t *w)
+{
+    const size_t next = w->slot ^ 1;
+
+    pthread_mutex_lock(&w->lock);
+    w->full[w->slot] = 1;
+    pthread_cond_broadcast(&w->cond);
+    while(w->full[next] && !w->err) {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    const int err = w->err;
+    pthread_mutex_unlock(&w->lock);
+
+    w->slot      = next;
+    w->len[next] = 0;
+
+    return err;
+}
+
+_INLINE_ uint8_t *pk_writer_reserve(IN void *ctx, IN const size_t n_terms)
+{
+    pk_writer_t *w     = ctx;
+    const size_t bytes = n_terms * PUB_M;
+
+    // Even an empty chunk cannot hold it
+    if(bytes > PK_STREAM_CHUNK_BYTES) {
+        return NULL;
+    }
+
+    if(((w->len[w->slot] + bytes) > PK_STREAM_CHUNK_BYTES) &&
+       (SUCCESS != pk_writer_flush(w))) {
+        return NULL;
+    }
+
+    uint8_t *out = &w->buf[w->slot][w->len[w->slot]];
+    w->len[w->slot] += bytes;
+    return out;
+}
+
+int rainbow_keypair_stream(OUT sk_t *sk,
+                           IN const uint8_t *sk_seed,
+                           IN rainbow_pk_write_cb write_cb,
+                           IN void *ctx)
+{
+    pk_writer_t          w;
+    pthread_t            writer;
+    calc_pk_stream_ws_t *ws  = NULL;
+    int                  ret = ERROR;
+
+    memset(&w, 0, sizeof(w));
+    w.write_cb = write_cb;
+    w.ctx      = ctx;
+
+    ws       = aligned_malloc(sizeof(*ws));
+    w.buf[0] = aligned_malloc(2 * PK_STREAM_CHUNK_BYTES);
+    if((NULL == ws) || (NULL == w.buf[0])) {
+        goto free_mem;
+    }
+    w.buf[1] = &w.buf[0][PK_STREAM_CHUNK_BYTES];
+
+    if(0 != pthread_mutex_init(&w.lock, NULL)) {
+        goto free_mem;
+    }
+    if(0 != pthread_cond_init(&w.cond, NULL)) {
+        goto destroy_lock;
+    }
+    if(0 != pthread_create(&writer, NULL, pk_writer, &w)) {
+        goto destroy_cond;
+    }
+
+    sk_begin(sk, sk_seed);
+    ret = calc_pk_stream(sk, ws, pk_writer_reserve, &w);
+    sk_finish(sk);
+
+    // Write the last chunk
+    if((SUCCESS == ret) && (0 != w.len[w.slot])) {
+        ret = pk_writer_flush(&w);
+    }
+
+    pthread_mutex_lock(&w.lock);
+    w.done = 1;
+    pthread_cond_broadcast(&w.cond);
+    pthread_mutex_unlock(&w.lock);
+    pthread_join(writer, NULL);
+
+    if(0 != w.err) {
+        ret = ERROR;
+    }
+
+destroy_cond:
+    pthread_cond_destroy(&w.cond);
+destroy_lock:
+    pthread_mutex_destroy(&w.lock);
+free_mem:
+    aligned_secure_free(ws, sizeof(*ws));
+    aligned_free(w.buf[0]);
+
+    // The public key of |sk| was not written as a whole
+    if(SUCCESS != ret) {
+        secure_clean((uint8_t *)sk, sizeof(*sk));
+    }
+    return ret;
+}
+
+_INLINE_ int write_fd(IN void *ctx, IN const uint8_t *buf, IN size_t len)
+{
+    const int fd = *(const int *)ctx;
+
+    while(len > 0) {
+        const ssize_t r = write(fd, buf, len);
+        if(r < 0) {
+            if(EINTR == errno) {
+                continue;
+            }
+            return ERROR;
+        }
+        buf += r;
+        len -= (size_t)r;
+    }
+
+    return SUCCESS;
+}
+
+int rainbow_keypair_stream_fd(OUT sk_t *sk, IN const uint8_t *sk_seed, IN int fd)
+{
+    return rainbow_keypair_stream(sk, sk_seed, write_fd, &fd);
 }
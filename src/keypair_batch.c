@@ -0,0 +1,155 @@
+/*
+ * Copyright 2020 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ * The license is detailed in the file LICENSE.md, and applies to this file.
+ *
+ * The code was written by Nir Drucker and Shay Gueron
+ * AWS Cryptographic Algorithms Group.
+ * (ndrucker@amazon.com, gueron@amazon.com)
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "api.h"
+#include "keypair_computation.h"
+#include "utils_mem.h"
+
+// The memory of one worker: the keypair it generates and the work memory of
+// calc_pk. It is reused for all the keys of the worker.
+typedef struct keygen_slot_st {
+    pk_t         pk;
+    sk_t         sk;
+    calc_pk_ws_t ws;
+} keygen_slot_t;
+
+// Every worker takes the next seed index from |next|, generates its keypair,
+// and waits until |emitted| reaches its index to pass the keypair to the sink.
+// So the sink sees the keys in order, and every worker holds a single key.
+typedef struct keygen_batch_st {
+    const uint8_t *const *  seeds;
+    size_t                  n;
+    rainbow_keypair_sink_cb sink;
+    void *                  ctx;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    size_t          next;
+    size_t          emitted;
+    int             failed;
+} keygen_batch_t;
+
+_INLINE_ void batch_fail(IN OUT keygen_batch_t *batch)
+{
+    pthread_mutex_lock(&batch->lock);
+    batch->failed = 1;
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+_INLINE_ void *batch_worker(IN OUT void *arg)
+{
+    keygen_batch_t *batch = arg;
+
+    keygen_slot_t *slot = aligned_malloc(sizeof(*slot));
+    if(NULL == slot) {
+        batch_fail(batch);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    while(!batch->failed && (batch->next < batch->n)) {
+        const size_t i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+
+        keypair_ws(&slot->pk, &slot->sk, batch->seeds[i], &slot->ws, NULL);
+
+        pthread_mutex_lock(&batch->lock);
+        while(!batch->failed && (batch->emitted != i)) {
+            pthread_cond_wait(&batch->cond, &batch->lock);
+        }
+        if(batch->failed) {
+            break;
+        }
+
+        // The other workers wait for |emitted|, so the sink is called by one
+        // worker at a time without the lock.
+        pthread_mutex_unlock(&batch->lock);
+        const int ret = batch->sink(batch->ctx, i, &slot->pk, &slot->sk);
+        pthread_mutex_lock(&batch->lock);
+
+        if(0 != ret) {
+            batch->failed = 1;
+        }
+        batch->emitted++;
+        pthread_cond_broadcast(&batch->cond);
+    }
+    pthread_mutex_unlock(&batch->lock);
+
+    aligned_secure_free(slot, sizeof(*slot));
+
+    return NULL;
+}
+
+int rainbow_keypair_batch(IN const uint8_t *const   seeds[],
+                          IN const size_t           n,
+                          IN const size_t           n_threads,
+                          IN rainbow_keypair_sink_cb sink,
+                          IN void *                  ctx)
+{
+    keygen_batch_t batch;
+    pthread_t *    workers   = NULL;
+    size_t         n_workers = 0;
+
+    // The size of |workers| below must not overflow
+    if((n_threads > 1) && ((n_threads - 1) > (SIZE_MAX / sizeof(pthread_t)))) {
+        return ERROR;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.seeds = seeds;
+    batch.n     = n;
+    batch.sink  = sink;
+    batch.ctx   = ctx;
+
+    if(0 != pthread_mutex_init(&batch.lock, NULL)) {
+        return ERROR;
+    }
+    if(0 != pthread_cond_init(&batch.cond, NULL)) {
+        pthread_mutex_destroy(&batch.lock);
+        return ERROR;
+    }
+
+    // The caller is a worker too
+    if(n_threads > 1) {
+        workers = malloc((n_threads - 1) * sizeof(pthread_t));
+    }
+    for(; (NULL != workers) && (n_workers < (n_threads - 1)); n_workers++) {
+        if(0 != pthread_create(&workers[n_workers], NULL, batch_worker, &batch)) {
+            break;
+        }
+    }
+
+    batch_worker(&batch);
+
+    for(size_t i = 0; i < n_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    pthread_cond_destroy(&batch.cond);
+    pthread_mutex_destroy(&batch.lock);
+
+    return (batch.failed || (batch.emitted != n)) ? ERROR : SUCCESS;
+}
@@ -21,11 +21,13 @@
  * (ndrucker@amazon.com, gueron@amazon.com)
  */
 
+#include <assert.h>
 #include <immintrin.h>
 #include <stdlib.h>
 
 #include "gfni.h"
 #include "keypair_computation.h"
+#include "team.h"
 
 // Calculate the corresponding index in an array for an upper-triangle(UT)
 // matrix.
@@ -36,53 +38,48 @@ _INLINE_ uint32_t idx_of_trimat(IN const uint32_t i_row,
     return (dim + dim - i_row + 1) * i_row / 2 + j_col - i_row;
 }
 
+// Stores the rows row_from <= r < row_to of a Q block of the terms (i, j),
+// outer_from <= i, inner_from <= j < inner_to, where i = outer_from + r.
+// The terms of one i are consecutive in the pk.
 _INLINE_
-void convert_type1(OUT pk_t *pk,
-                   IN const uint8_t *idx_l1,
-                   IN const uint8_t *idx_l2,
-                   IN const size_t   outer_from,
-                   IN const size_t   outer_to,
-                   IN const size_t   inner_from,
-                   IN const size_t   inner_to)
-{
-    for(uint32_t i = outer_from; i < outer_to; i++) {
-        for(uint32_t j = inner_from; j < inner_to; j++) {
-            uint32_t pub_idx = idx_of_trimat(i, j, PUB_N);
-            memcpy(&pk->pk[PUB_M * pub_idx], idx_l1, O1);
-            memcpy((&pk->pk[PUB_M * pub_idx]) + O1, idx_l2, O2);
-            idx_l1 += O1;
-            idx_l2 += O2;
-        }
-    }
-}
+void store_type1(OUT pk_t *pk,
+                 IN const uint8_t *idx_l1,
+                 IN const uint8_t *idx_l2,
+                 IN const size_t   outer_from,
+                 IN const size_t   inner_from,
+                 IN const size_t   inner_to,
+                 IN const size_t   row_from,
+                 IN const size_t   row_to,
+                 IN const uint8_t *s1)
+{
+    const uint32_t n = inner_to - inner_from;
 
-_INLINE_
-void convert_type2(OUT pk_t *pk,
-                   IN const uint8_t *idx_l1,
-                   IN const uint8_t *idx_l2,
-                   IN const size_t   outer_from,
-                   IN const size_t   to)
-{
-    for(uint32_t i = outer_from; i < to; i++) {
-        for(uint32_t j = i; j < to; j++) {
-            uint32_t pub_idx = idx_of_trimat(i, j, PUB_N);
-            memcpy(&pk->pk[PUB_M * pub_idx], idx_l1, O1);
-            memcpy((&pk->pk[PUB_M * pub_idx]) + O1, idx_l2, O2);
-            idx_l1 += O1;
-            idx_l2 += O2;
-        }
+    for(uint32_t r = row_from; r < row_to; r++) {
+        uint32_t pub_idx = idx_of_trimat(outer_from + r, inner_from, PUB_N);
+        pk_store_terms_36(&pk->pk[PUB_M * pub_idx], &idx_l1[O1 * n * r],
+                          &idx_l2[O2 * n * r], n, s1);
     }
 }
 
-void extcpk_to_pk(OUT pk_t *pk, IN const ext_cpk_t *cpk)
+// Stores the rows row_from <= r < row_to of an upper triangular Q block of
+// the terms (i, j), from <= i <= j < to, where i = from + r.
+_INLINE_
+void store_type2(OUT pk_t *pk,
+                 IN const uint8_t *idx_l1,
+                 IN const uint8_t *idx_l2,
+                 IN const size_t   from,
+                 IN const size_t   to,
+                 IN const size_t   row_from,
+                 IN const size_t   row_to,
+                 IN const uint8_t *s1)
 {
-    convert_type1(pk, cpk->l1_Q2, cpk->l2_Q2, 0, V1, V1, V1 + O1);
-    convert_type1(pk, cpk->l1_Q3, cpk->l2_Q3, 0, V1, V1 + O1, PUB_N);
-    convert_type1(pk, cpk->l1_Q6, cpk->l2_Q6, V1, V1 + O1, V1 + O1, PUB_N);
-
-    convert_type2(pk, cpk->l1_Q1, cpk->l2_Q1, 0, V1);
-    convert_type2(pk, cpk->l1_Q5, cpk->l2_Q5, V1, V1 + O1);
-    convert_type2(pk, cpk->l1_Q9, cpk->l2_Q9, V1 + O1, PUB_N);
+    for(uint32_t r = row_from; r < row_to; r++) {
+        const uint32_t i       = from + r;
+        const uint32_t blk_idx = idx_of_trimat(r, r, to - from);
+        uint32_t       pub_idx = idx_of_trimat(i, i, PUB_N);
+        pk_store_terms_36(&pk->pk[PUB_M * pub_idx], &idx_l1[O1 * blk_idx],
+                          &idx_l2[O2 * blk_idx], to - i, s1);
+    }
 }
 
 _INLINE_
@@ -105,38 +102,154 @@ void UpperTrianglize(uint8_t *      btriC,
     }
 }
 
-_INLINE_
-void madd_upto_512(uint8_t *accu_c, const uint8_t *a, uint8_t b, size_t byte_len)
+// The products of calc_pk are over "batches": vectors of size_batch (<= 64)
+// bytes that hold one coefficient of all the equations of a layer. The
+// kernels below are GEMM-style: GEMM_J output batches (or GEMM_CHUNKS 64-byte
+// chunks of an output row) stay in ZMM registers across the whole k loop, so
+// every output is loaded and stored once instead of once per coefficient.
+#define GEMM_J      (12)
+#define GEMM_CHUNKS (8)
+#define ZMM_BYTES   (64)
+
+#define GEMM_MLOAD(k, in)        (_mm512_maskz_loadu_epi8(k, (const void *)(in)))
+#define GEMM_MSTORE(mem, k, reg) (_mm512_mask_storeu_epi8((void *)(mem), k, reg))
+#define GEMM_MUL(a, b)           (_mm512_gf2p8mul_epi8(a, _mm512_set1_epi8(b)))
+
+// c[j] += sum_{k0 <= k < k1} a_k * b[j * size_Bcolvec + k] for j < nj, where
+// c[j] and a_k are batches. a_k0 = a, and a_{k+1} = a_k + step_k batches,
+// where step_{k+1} = step_k - step_dec. step_dec is 0 when a_k walk a row of a
+// matrix, and 1 when they walk a column of an upper-triangular matrix.
+_INLINE_ void gemm_block(OUT uint8_t *c,
+                         IN const uint8_t *a,
+                         IN size_t         step,
+                         IN const size_t   step_dec,
+                         IN const uint8_t *b,
+                         IN const size_t   size_Bcolvec,
+                         IN const size_t   k0,
+                         IN const size_t   k1,
+                         IN const size_t   size_batch,
+                         IN const size_t   nj)
 {
-    const __mmask64 k0 = (1ULL << byte_len) - 1;
-    const __m512i   bv = _mm512_set1_epi8(b);
-    const __m512i   av = _mm512_maskz_loadu_epi8(k0, &a[0]);
-    __m512i         cv = _mm512_maskz_loadu_epi8(k0, &accu_c[0]);
+    const __mmask64 km = (1ULL << size_batch) - 1;
+    __m512i         acc[GEMM_J];
 
-    cv ^= _mm512_gf2p8mul_epi8(av, bv);
-    _mm512_mask_storeu_epi8(&accu_c[0], k0, cv);
+    for(size_t j = 0; j < nj; j++) {
+        acc[j] = GEMM_MLOAD(km, &c[j * size_batch]);
+    }
+
+    for(size_t k = k0; k < k1; k++) {
+        const __m512i av = GEMM_MLOAD(km, a);
+        for(size_t j = 0; j < nj; j++) {
+            acc[j] ^= GEMM_MUL(av, b[(j * size_Bcolvec) + k]);
+        }
+        a += step * size_batch;
+        step -= step_dec;
+    }
+
+    for(size_t j = 0; j < nj; j++) {
+        GEMM_MSTORE(&c[j * size_batch], km, acc[j]);
+    }
+}
+
+// One row of C += A * B, where the row of A is given as in gemm_block and B
+// is a Bwidth-column matrix of scalars (column j starts at b + j * size_Bcolvec).
+_INLINE_ void gemm_row(OUT uint8_t *c,
+                       IN const uint8_t *a,
+                       IN const size_t   step,
+                       IN const size_t   step_dec,
+                       IN const uint8_t *b,
+                       IN const size_t   size_Bcolvec,
+                       IN const size_t   Bwidth,
+                       IN const size_t   k0,
+                       IN const size_t   k1,
+                       IN const size_t   size_batch)
+{
+    assert(size_batch < ZMM_BYTES);
+
+    const size_t n_full = Bwidth - (Bwidth % GEMM_J);
+
+    for(size_t j = 0; j < n_full; j += GEMM_J) {
+        gemm_block(&c[j * size_batch], a, step, step_dec, &b[j * size_Bcolvec],
+                   size_Bcolvec, k0, k1, size_batch, GEMM_J);
+    }
+    if(n_full < Bwidth) {
+        gemm_block(&c[n_full * size_batch], a, step, step_dec,
+                   &b[n_full * size_Bcolvec], size_Bcolvec, k0, k1, size_batch,
+                   Bwidth - n_full);
+    }
 }
 
+// c += sum_{k < n} s[k] * b_k for the len-byte vectors c and b_k = b + k * len.
+// Every k broadcasts s[k] once for GEMM_CHUNKS chunks of c.
+_INLINE_ void gemm_scalar_row(OUT uint8_t *c,
+                              IN const uint8_t *s,
+                              IN const size_t   n,
+                              IN const uint8_t *b,
+                              IN const size_t   len)
+{
+    size_t o = 0;
+    for(; o + (GEMM_CHUNKS * ZMM_BYTES) <= len; o += GEMM_CHUNKS * ZMM_BYTES) {
+        __m512i acc[GEMM_CHUNKS];
+
+        for(size_t ch = 0; ch < GEMM_CHUNKS; ch++) {
+            acc[ch] = _mm512_loadu_si512(&c[o + (ch * ZMM_BYTES)]);
+        }
+
+        const uint8_t *bk = &b[o];
+        for(size_t k = 0; k < n; k++, bk += len) {
+            const __m512i sv = _mm512_set1_epi8(s[k]);
+            for(size_t ch = 0; ch < GEMM_CHUNKS; ch++) {
+                acc[ch] ^= _mm512_gf2p8mul_epi8(
+                    _mm512_loadu_si512(&bk[ch * ZMM_BYTES]), sv);
+            }
+        }
+
+        for(size_t ch = 0; ch < GEMM_CHUNKS; ch++) {
+            _mm512_storeu_si512(&c[o + (ch * ZMM_BYTES)], acc[ch]);
+        }
+    }
+
+    // The remaining (full or partial) chunks, one at a time
+    for(; o < len; o += ZMM_BYTES) {
+        const __mmask64 k =
+            ((len - o) >= ZMM_BYTES) ? (__mmask64)-1 : ((1ULL << (len - o)) - 1);
+        __m512i acc = GEMM_MLOAD(k, &c[o]);
+
+        for(size_t i = 0; i < n; i++) {
+            acc ^= GEMM_MUL(GEMM_MLOAD(k, &b[(i * len) + o]), s[i]);
+        }
+
+        GEMM_MSTORE(&c[o], k, acc);
+    }
+}
+
+// The products below update the rows row_from <= i < row_to of C, and bC
+// points at row row_from. The rows are independent, so a product can be split
+// across threads by rows.
+
+// bC += A' * bB, where A is a scalar Aheight x Awidth matrix (column i starts
+// at A_to_tr + i * size_Acolvec) and bB is a batched Aheight x Bwidth matrix.
+// bC has Awidth rows.
+_INLINE_
 void madd_matTr(uint8_t *      bC,
                 const uint8_t *A_to_tr,
                 uint32_t       Aheight,
                 uint32_t       size_Acolvec,
-                uint32_t       Awidth,
                 const uint8_t *bB,
                 uint32_t       Bwidth,
-                size_t         size_batch)
-{
-    uint32_t Atr_height = Awidth;
-    uint32_t Atr_width  = Aheight;
-    for(uint32_t i = 0; i < Atr_height; i++) {
-        for(uint32_t j = 0; j < Atr_width; j++) {
-            gf256_madd(bC, &bB[j * Bwidth * size_batch],
-                       (&A_to_tr[size_Acolvec * i])[j], size_batch * Bwidth);
-        }
-        bC += size_batch * Bwidth;
+                size_t         size_batch,
+                size_t         row_from,
+                size_t         row_to)
+{
+    const size_t len = size_batch * Bwidth;
+
+    for(size_t i = row_from; i < row_to; i++) {
+        gemm_scalar_row(&bC[(i - row_from) * len], &A_to_tr[size_Acolvec * i],
+                        Aheight, bB, len);
     }
 }
 
+// bC += A * B, where A is an upper-triangular Bheight x Bheight batched matrix
 _INLINE_
 void madd_trimat(uint8_t *      bC,
                  const uint8_t *btriA,
@@ -144,70 +257,59 @@ void madd_trimat(uint8_t *      bC,
                  uint32_t       Bheight,
                  uint32_t       size_Bcolvec,
                  uint32_t       Bwidth,
-                 size_t         size_batch)
+                 size_t         size_batch,
+                 size_t         row_from,
+                 size_t         row_to)
 {
-    uint32_t Awidth  = Bheight;
-    uint32_t Aheight = Awidth;
-    for(uint32_t i = 0; i < Aheight; i++) {
-        for(uint32_t j = 0; j < Bwidth; j++) {
-            for(uint32_t k = 0; k < Bheight; k++) {
-                if(k < i) {
-                    continue;
-                }
-                madd_upto_512(bC, &btriA[(k - i) * size_batch],
-                              (&B[j * size_Bcolvec])[k], size_batch);
-            }
-            bC += size_batch;
-        }
-        btriA += (Aheight - i) * size_batch;
+    for(size_t i = row_from; i < row_to; i++) {
+        gemm_row(&bC[(i - row_from) * Bwidth * size_batch],
+                 &btriA[idx_of_trimat(i, i, Bheight) * size_batch], 1, 0, B,
+                 size_Bcolvec, Bwidth, i, Bheight, size_batch);
     }
 }
+
+// bC += A' * B, where A is an upper-triangular Bheight x Bheight batched matrix
+_INLINE_
 void madd_trimatTr(uint8_t *      bC,
                    const uint8_t *btriA,
                    const uint8_t *B,
                    uint32_t       Bheight,
                    uint32_t       size_Bcolvec,
                    uint32_t       Bwidth,
-                   size_t         size_batch)
+                   size_t         size_batch,
+                   size_t         row_from,
+                   size_t         row_to)
 {
-    uint32_t Aheight = Bheight;
-    for(uint32_t i = 0; i < Aheight; i++) {
-        for(uint32_t j = 0; j < Bwidth; j++) {
-            for(uint32_t k = 0; k < Bheight; k++) {
-                if(i < k) {
-                    continue;
-                }
-                gf256_madd(bC,
-                           &btriA[size_batch * (idx_of_trimat(k, i, Aheight))],
-                           (&B[j * size_Bcolvec])[k], size_batch);
-            }
-            bC += size_batch;
-        }
+    // Column i of A starts at A[0][i] and the distance between A[k][i] and
+    // A[k + 1][i] is Bheight - k - 1 batches.
+    for(size_t i = row_from; i < row_to; i++) {
+        gemm_row(&bC[(i - row_from) * Bwidth * size_batch],
+                 &btriA[i * size_batch], Bheight - 1, 1, B, size_Bcolvec, Bwidth,
+                 0, i + 1, size_batch);
     }
 }
 
+// bC += A * B, where A is a batched Aheight x Bheight matrix
+_INLINE_
 void madd_mat(uint8_t *      bC,
               const uint8_t *bA,
-              uint32_t       Aheight,
               const uint8_t *B,
               uint32_t       Bheight,
               uint32_t       size_Bcolvec,
               uint32_t       Bwidth,
-              size_t         size_batch)
+              size_t         size_batch,
+              size_t         row_from,
+              size_t         row_to)
 {
-    uint32_t Awidth = Bheight;
-    for(uint32_t i = 0; i < Aheight; i++) {
-        for(uint32_t j = 0; j < Bwidth; j++) {
-            for(uint32_t k = 0; k < Bheight; k++) {
-                gf256_madd(bC, &bA[k * size_batch], (&B[j * size_Bcolvec])[k],
-                           size_batch);
-            }
-            bC += size_batch;
-        }
-        bA += (Awidth)*size_batch;
+    for(size_t i = row_from; i < row_to; i++) {
+        gemm_row(&bC[(i - row_from) * Bwidth * size_batch],
+                 &bA[i * Bheight * size_batch], 1, 0, B, size_Bcolvec, Bwidth, 0,
+                 Bheight, size_batch);
     }
 }
 
+// bC += A' * B, where A is a batched Bheight x Awidth_before_tr matrix
+_INLINE_
 void madd_bmatTr(uint8_t *      bC,
                  const uint8_t *bA_to_tr,
                  uint32_t       Awidth_before_tr,
@@ -215,105 +317,486 @@ void madd_bmatTr(uint8_t *      bC,
                  uint32_t       Bheight,
                  uint32_t       size_Bcolvec,
                  uint32_t       Bwidth,
-                 size_t         size_batch)
+                 size_t         size_batch,
+                 size_t         row_from,
+                 size_t         row_to)
 {
-    const uint8_t *bA      = bA_to_tr;
-    uint32_t       Aheight = Awidth_before_tr;
-    for(uint32_t i = 0; i < Aheight; i++) {
-        for(uint32_t j = 0; j < Bwidth; j++) {
-            for(uint32_t k = 0; k < Bheight; k++) {
-                gf256_madd(bC, &bA[size_batch * (i + k * Aheight)],
-                           (&B[j * size_Bcolvec])[k], size_batch);
+    for(size_t i = row_from; i < row_to; i++) {
+        gemm_row(&bC[(i - row_from) * Bwidth * size_batch],
+                 &bA_to_tr[i * size_batch], Awidth_before_tr, 0, B, size_Bcolvec,
+                 Bwidth, 0, Bheight, size_batch);
+    }
+}
+
+// calc_pk is a graph of tasks. A task updates the rows [from, to) of its
+// output block, and its rows are independent. The tasks of a level depend only
+// on the tasks of the previous levels, so they are all run together.
+// The Q2 and Q3 blocks hold the vinegar rows from |row0| on. In calc_pk they
+// hold all the rows (and share the storage of |ws|), and calc_pk_stream runs
+// their tasks on PK_STREAM_ROWS rows at a time.
+typedef struct calc_pk_ctx_st {
+    pk_t *        pk;
+    const sk_t *  sk;
+    calc_pk_ws_t *ws;
+    size_t        row0;
+    uint8_t *     l1_q2;
+    uint8_t *     l2_q2;
+    uint8_t *     l1_q3;
+    uint8_t *     l2_q3;
+} calc_pk_ctx_t;
+
+typedef void (*calc_pk_task_fn_t)(IN const calc_pk_ctx_t *c,
+                                  IN size_t               from,
+                                  IN size_t               to);
+
+typedef struct calc_pk_task_st {
+    calc_pk_task_fn_t fn;
+    size_t            n_rows;
+} calc_pk_task_t;
+
+// Q1 = F1
+_INLINE_ void store_q1(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    store_type2(c->pk, c->sk->l1_F1, c->sk->l2_F1, 0, V1, from, to, c->sk->s1);
+}
+
+// Layer 1
+// 1) Q2    = (F1 * T1) + F2
+// 2) tempQ = T1' * Q2 = T1' + (F1 * T1 + F2)
+// 3) Q2    = (F1' * T1) + Q2 = (F1' * T1) + ((F1 * T1) + F2)
+// 4) Q5    = UT(T1' * (F1 * T1 + F2))
+//
+// Layer 2
+// 1) Q2 = (F1 * T1) + F2
+// 2) tempQ = T1' * ((F1 * T1) + F2)
+// 3) Q5 = UT(tempQ) = UT(T1' * ((F1 * T1) + F2))
+// 4) Q2 = Q2 + F1*T1 = (F1 * T1) + F2 + F1*T1
+_INLINE_ void l1_q2_trimat(IN const calc_pk_ctx_t *c,
+                           IN size_t               from,
+                           IN size_t               to)
+{
+    const size_t row = O1 * O1;
+    uint8_t *    dst = &c->l1_q2[(from - c->row0) * row];
+    memcpy(dst, &c->sk->l1_F2[from * row], (to - from) * row);
+    madd_trimat(dst, c->sk->l1_F1, c->sk->t1, V1, V1, O1, O1, from, to);
+}
+
+_INLINE_ void l2_q2_trimat(IN const calc_pk_ctx_t *c,
+                           IN size_t               from,
+                           IN size_t               to)
+{
+    const size_t row = O1 * O2;
+    uint8_t *    dst = &c->l2_q2[(from - c->row0) * row];
+    memcpy(dst, &c->sk->l2_F2[from * row], (to - from) * row);
+    madd_trimat(dst, c->sk->l2_F1, c->sk->t1, V1, V1, O1, O2, from, to);
+}
+
+_INLINE_ void l1_q5_tempq(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    const size_t row = O1 * O1;
+    uint8_t *    dst = &c->ws->l1_tempQ[from * row];
+    memset(dst, 0, (to - from) * row);
+    madd_matTr(dst, c->sk->t1, V1, V1, c->l1_q2, O1, O1, from, to);
+}
+
+_INLINE_ void l2_q5_tempq(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    const size_t row = O1 * O2;
+    uint8_t *    dst = &c->ws->l2_tempQ[from * row];
+    memset(dst, 0, (to - from) * row);
+    madd_matTr(dst, c->sk->t1, V1, V1, c->l2_q2, O1, O2, from, to);
+}
+
+_INLINE_ void l1_q2_trimattr(IN const calc_pk_ctx_t *c,
+                             IN size_t               from,
+                             IN size_t               to)
+{
+    const size_t row = O1 * O1;
+    uint8_t *    dst = &c->l1_q2[(from - c->row0) * row];
+    madd_trimatTr(dst, c->sk->l1_F1, c->sk->t1, V1, V1, O1, O1, from, to);
+}
+
+_INLINE_ void l2_q2_trimattr(IN const calc_pk_ctx_t *c,
+                             IN size_t               from,
+                             IN size_t               to)
+{
+    const size_t row = O1 * O2;
+    uint8_t *    dst = &c->l2_q2[(from - c->row0) * row];
+    madd_trimatTr(dst, c->sk->l2_F1, c->sk->t1, V1, V1, O1, O2, from, to);
+}
+
+_INLINE_ void l1_q5_ut(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    (void)from;
+    (void)to;
+    memset(c->ws->l1_tri.q5, 0, L1_Q5_BYTE_LEN);
+    UpperTrianglize(c->ws->l1_tri.q5, c->ws->l1_tempQ, O1, O1);
+}
+
+_INLINE_ void l2_q5_ut(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    (void)from;
+    (void)to;
+    memcpy(c->ws->l2_tri.q5, c->sk->l2_F5, L2_Q5_BYTE_LEN);
+    UpperTrianglize(c->ws->l2_tri.q5, c->ws->l2_tempQ, O1, O2);
+}
+
+_INLINE_ void store_q2(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    store_type1(c->pk, c->l1_q2, c->l2_q2, 0, V1, V1 + O1, from, to, c->sk->s1);
+}
+
+_INLINE_ void store_q5(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    store_type2(c->pk, c->ws->l1_tri.q5, c->ws->l2_tri.q5, V1, V1 + O1, from,
+                to, c->sk->s1);
+}
+
+// Layer 1
+// 5) Q3 = F1 * T2 = F1 * T4
+// 6) Q3 = (F1 * T2) + (F2 * T3)
+// 7) Q9 = T2' * Q3 = UT(T2' * ( F1 * T2 + F2 * T3 ))
+// 8) Q3 = F1' * T2 + Q3 = (F1' * T2) + (F1 * T2) + (F2 * T3)
+// 9) Q6 = (T1 * Q3) + F2' * T2
+//
+// Layer 2
+// 5) Q3 = (F1 * T4) + F3
+// 6) Q3 = Q3 + (F2 * T3) = (F1 * T4) + (F2 * T3) + F3
+// 7) tempQ = T2' * Q3 = T2' ((F1 * T4) + (F2 * T3) + F3)
+// 8) Q6 = F5*T3 + F6
+// 9) tempQ = tempQ + T3' * Q6
+// 10) Q9 = UT(tempQ)
+// 11) Q3 = F1*T2 + Q3 = F1' * T2 + (F1 * T4) + (F2 * T3) + F3
+// 12) Q6 = F2' * T4 + Q6 = (F2' * T4) + (F5 * T3) + F6
+// 13) Q6 = Q6 + F5' * T3
+// 14) Q6 = Q6 + (T1'*Q3)
+_INLINE_ void l1_q3_mat(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    const size_t row = O2 * O1;
+    uint8_t *    dst = &c->l1_q3[(from - c->row0) * row];
+    memset(dst, 0, (to - from) * row);
+    madd_trimat(dst, c->sk->l1_F1, c->sk->t4, V1, V1, O2, O1, from, to);
+    madd_mat(dst, c->sk->l1_F2, c->sk->t3, O1, O1, O2, O1, from, to);
+}
+
+_INLINE_ void l2_q3_mat(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    const size_t row = O2 * O2;
+    uint8_t *    dst = &c->l2_q3[(from - c->row0) * row];
+    memcpy(dst, &c->sk->l2_F3[from * row], (to - from) * row);
+    madd_trimat(dst, c->sk->l2_F1, c->sk->t4, V1, V1, O2, O2, from, to);
+    madd_mat(dst, c->sk->l2_F2, c->sk->t3, O1, O1, O2, O2, from, to);
+}
+
+_INLINE_ void l2_q6_f5(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    const size_t row = O2 * O2;
+    uint8_t *    dst = &c->ws->l2_q6[from * row];
+    memcpy(dst, &c->sk->l2_F6[from * row], (to - from) * row);
+    madd_trimat(dst, c->sk->l2_F5, c->sk->t3, O1, O1, O2, O2, from, to);
+}
+
+_INLINE_ void l1_q9_tempq(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    const size_t row = O2 * O1;
+    uint8_t *    dst = &c->ws->l1_tempQ[from * row];
+    memset(dst, 0, (to - from) * row);
+    madd_matTr(dst, c->sk->t4, V1, V1, c->l1_q3, O2, O1, from, to);
+}
+
+_INLINE_ void l2_q9_tempq(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    const size_t row = O2 * O2;
+    uint8_t *    dst = &c->ws->l2_tempQ[from * row];
+    memset(dst, 0, (to - from) * row);
+    madd_matTr(dst, c->sk->t4, V1, V1, c->l2_q3, O2, O2, from, to);
+    madd_matTr(dst, c->sk->t3, O1, O1, c->ws->l2_q6, O2, O2, from, to);
+}
+
+_INLINE_ void l1_q9_ut(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    (void)from;
+    (void)to;
+    memset(c->ws->l1_tri.q9, 0, L1_Q9_BYTE_LEN);
+    UpperTrianglize(c->ws->l1_tri.q9, c->ws->l1_tempQ, O2, O1);
+}
+
+_INLINE_ void l2_q9_ut(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    (void)from;
+    (void)to;
+    memset(c->ws->l2_tri.q9, 0, L2_Q9_BYTE_LEN);
+    UpperTrianglize(c->ws->l2_tri.q9, c->ws->l2_tempQ, O2, O2);
+}
+
+_INLINE_ void l1_q3_trimattr(IN const calc_pk_ctx_t *c,
+                             IN size_t               from,
+                             IN size_t               to)
+{
+    const size_t row = O2 * O1;
+    uint8_t *    dst = &c->l1_q3[(from - c->row0) * row];
+    madd_trimatTr(dst, c->sk->l1_F1, c->sk->t4, V1, V1, O2, O1, from, to);
+}
+
+_INLINE_ void l2_q3_trimattr(IN const calc_pk_ctx_t *c,
+                             IN size_t               from,
+                             IN size_t               to)
+{
+    const size_t row = O2 * O2;
+    uint8_t *    dst = &c->l2_q3[(from - c->row0) * row];
+    madd_trimatTr(dst, c->sk->l2_F1, c->sk->t4, V1, V1, O2, O2, from, to);
+}
+
+_INLINE_ void l1_q6_bmattr(IN const calc_pk_ctx_t *c,
+                           IN size_t               from,
+                           IN size_t               to)
+{
+    const size_t row = O2 * O1;
+    uint8_t *    dst = &c->ws->l1_q6[from * row];
+    memset(dst, 0, (to - from) * row);
+    madd_bmatTr(dst, c->sk->l1_F2, O1, c->sk->t4, V1, V1, O2, O1, from, to);
+}
+
+_INLINE_ void l2_q6_bmattr(IN const calc_pk_ctx_t *c,
+                           IN size_t               from,
+                           IN size_t               to)
+{
+    const size_t row = O2 * O2;
+    uint8_t *    dst = &c->ws->l2_q6[from * row];
+    madd_bmatTr(dst, c->sk->l2_F2, O1, c->sk->t4, V1, V1, O2, O2, from, to);
+    madd_trimatTr(dst, c->sk->l2_F5, c->sk->t3, O1, O1, O2, O2, from, to);
+}
+
+_INLINE_ void l1_q6_t1(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    const size_t row = O2 * O1;
+    uint8_t *    dst = &c->ws->l1_q6[from * row];
+    madd_matTr(dst, c->sk->t1, V1, V1, c->l1_q3, O2, O1, from, to);
+}
+
+_INLINE_ void l2_q6_t1(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    const size_t row = O2 * O2;
+    uint8_t *    dst = &c->ws->l2_q6[from * row];
+    madd_matTr(dst, c->sk->t1, V1, V1, c->l2_q3, O2, O2, from, to);
+}
+
+_INLINE_ void store_q3(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    store_type1(c->pk, c->l1_q3, c->l2_q3, 0, V1 + O1, PUB_N, from, to,
+                c->sk->s1);
+}
+
+_INLINE_ void store_q6(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    store_type1(c->pk, c->ws->l1_q6, c->ws->l2_q6, V1, V1 + O1, PUB_N, from, to,
+                c->sk->s1);
+}
+
+_INLINE_ void store_q9(IN const calc_pk_ctx_t *c, IN size_t from, IN size_t to)
+{
+    store_type2(c->pk, c->ws->l1_tri.q9, c->ws->l2_tri.q9, V1 + O1, PUB_N, from,
+                to, c->sk->s1);
+}
+
+// The Q2 blocks share their storage with the Q3 blocks, so Q2 is stored
+// before Q3 is computed.
+static const calc_pk_task_t level0[] = {
+    {store_q1, V1}, {l1_q2_trimat, V1}, {l2_q2_trimat, V1}};
+static const calc_pk_task_t level1[] = {
+    {l1_q5_tempq, O1}, {l2_q5_tempq, O1}};
+static const calc_pk_task_t level2[] = {
+    {l1_q5_ut, 1}, {l2_q5_ut, 1}, {l1_q2_trimattr, V1}, {l2_q2_trimattr, V1}};
+static const calc_pk_task_t level3[] = {
+    {store_q2, V1}, {store_q5, O1}};
+static const calc_pk_task_t level4[] = {
+    {l1_q3_mat, V1}, {l2_q3_mat, V1}, {l2_q6_f5, O1}};
+static const calc_pk_task_t level5[] = {
+    {l1_q9_tempq, O2}, {l2_q9_tempq, O2}};
+static const calc_pk_task_t level6[] = {
+    {l1_q9_ut, 1},       {l2_q9_ut, 1},       {l1_q3_trimattr, V1},
+    {l2_q3_trimattr, V1}, {l1_q6_bmattr, O1}, {l2_q6_bmattr, O1}};
+static const calc_pk_task_t level7[] = {
+    {l1_q6_t1, O1}, {l2_q6_t1, O1}, {store_q3, V1}, {store_q9, O2}};
+static const calc_pk_task_t level8[] = {
+    {store_q6, O1}};
+
+typedef struct calc_pk_level_st {
+    const calc_pk_task_t *tasks;
+    size_t                n_tasks;
+} calc_pk_level_t;
+
+#define LEVEL(t) {t, sizeof(t) / sizeof(t[0])}
+
+static const calc_pk_level_t calc_pk_graph[] = {
+    LEVEL(level0), LEVEL(level1), LEVEL(level2), LEVEL(level3), LEVEL(level4),
+    LEVEL(level5), LEVEL(level6), LEVEL(level7), LEVEL(level8)};
+
+// The rows of a task are split into parts of CALC_PK_PART_ROWS rows.
+#define CALC_PK_PART_ROWS (4)
+
+typedef struct calc_pk_job_st {
+    const calc_pk_ctx_t *  c;
+    const calc_pk_level_t *level;
+} calc_pk_job_t;
+
+_INLINE_ size_t n_parts_of(IN const calc_pk_task_t *task)
+{
+    return (task->n_rows + CALC_PK_PART_ROWS - 1) / CALC_PK_PART_ROWS;
+}
+
+_INLINE_ void calc_pk_part(IN void *ctx, IN size_t part)
+{
+    const calc_pk_job_t * job  = ctx;
+    const calc_pk_task_t *task = job->level->tasks;
+
+    while(part >= n_parts_of(task)) {
+        part -= n_parts_of(task);
+        task++;
+    }
+
+    const size_t from = part * CALC_PK_PART_ROWS;
+    const size_t end  = from + CALC_PK_PART_ROWS;
+    const size_t to   = (end < task->n_rows) ? end : task->n_rows;
+    task->fn(job->c, from, to);
+}
+
+void calc_pk(OUT pk_t *pk,
+             IN const sk_t *sk,
+             OUT calc_pk_ws_t *ws,
+             IN rainbow_team_t *team)
+{
+    const calc_pk_ctx_t c = {pk,        sk,        ws,        0,
+                             ws->l1.q2, ws->l2.q2, ws->l1.q3, ws->l2.q3};
+
+    for(size_t l = 0; l < sizeof(calc_pk_graph) / sizeof(calc_pk_graph[0]); l++) {
+        const calc_pk_level_t *level = &calc_pk_graph[l];
+
+        if(NULL == team) {
+            for(size_t t = 0; t < level->n_tasks; t++) {
+                level->tasks[t].fn(&c, 0, level->tasks[t].n_rows);
             }
-            bC += size_batch;
+            continue;
+        }
+
+        calc_pk_job_t job     = {&c, level};
+        size_t        n_parts = 0;
+        for(size_t t = 0; t < level->n_tasks; t++) {
+            n_parts += n_parts_of(&level->tasks[t]);
         }
+        team_run(team, calc_pk_part, &job, n_parts);
+    }
+}
+
+// Reserves the next |n| terms of the public key and stores them there.
+_INLINE_ int emit_terms(IN pk_reserve_fn_t reserve,
+                        IN void *          ctx,
+                        IN const uint8_t *l1_polys,
+                        IN const uint8_t *l2_polys,
+                        IN const size_t   n,
+                        IN const uint8_t *s1)
+{
+    uint8_t *out = reserve(ctx, n);
+    if(NULL == out) {
+        return ERROR;
     }
+
+    pk_store_terms_36(out, l1_polys, l2_polys, n, s1);
+    return SUCCESS;
 }
 
-#if O1 == O2
-#    define TEMP_SIZE (O1 * O1 * O1)
-#else
-#    define MAX(a, b) ((a > b) ? a : b)
-#    define TEMP_SIZE                                                            \
-        (MAX(O1 * O1 * O1, MAX(O2 * O1 * O1, MAX(O2 * O2 * O1, O2 * O2 * O2))) + \
-         32)
-#endif
-
-void calc_pk(OUT ext_cpk_t *epk, IN const sk_t *sk)
-{
-    uint8_t tempQ[TEMP_SIZE] = {0};
-
-    // Layer 1
-    memcpy(epk->l1_Q1, sk->l1_F1, L1_F1_BYTE_LEN);
-    memcpy(epk->l1_Q2, sk->l1_F2, L1_F2_BYTE_LEN);
-    memset(epk->l1_Q3, 0, L1_Q3_BYTE_LEN);
-    memset(epk->l1_Q5, 0, L1_Q5_BYTE_LEN);
-    memset(epk->l1_Q6, 0, L1_Q6_BYTE_LEN);
-    memset(epk->l1_Q9, 0, L1_Q9_BYTE_LEN);
-
-    // 1) Q2    = (F1 * T1) + F2
-    // 2) tempQ = T1' * Q2 = T1' + (F1 * T1 + F2)
-    // 3) Q2    = (F1' * T1) + Q2 = (F1' * T1) + ((F1 * T1) + F2)
-    // 4) Q5    = UT(T1' * (F1 * T1 + F2))
-    madd_trimat(epk->l1_Q2, sk->l1_F1, sk->t1, V1, V1, O1, O1);
-    madd_matTr(tempQ, sk->t1, V1, V1, O1, epk->l1_Q2, O1, O1);
-    madd_trimatTr(epk->l1_Q2, sk->l1_F1, sk->t1, V1, V1, O1, O1);
-    UpperTrianglize(epk->l1_Q5, tempQ, O1, O1);
-
-    // 5) Q3 = F1 * T2 = F1 * T4
-    // 6) Q3 = (F1 * T2) + (F2 * T3)
-    // 7) Q9 = T2' * Q3 = UT(T2' * ( F1 * T2 + F2 * T3 ))
-    // 8) Q3 = F1' * T2 + Q3 = (F1' * T2) + (F1 * T2) + (F2 * T3)
-    // 9) Q6 = (T1 * Q3) + F2' * T2
-    madd_trimat(epk->l1_Q3, sk->l1_F1, sk->t4, V1, V1, O2, O1);
-    madd_mat(epk->l1_Q3, sk->l1_F2, V1, sk->t3, O1, O1, O2, O1);
-    memset(tempQ, 0, O1 * O2 * O2);
-    madd_matTr(tempQ, sk->t4, V1, V1, O2, epk->l1_Q3, O2, O1);
-    UpperTrianglize(epk->l1_Q9, tempQ, O2, O1);
-    madd_trimatTr(epk->l1_Q3, sk->l1_F1, sk->t4, V1, V1, O2, O1);
-    madd_bmatTr(epk->l1_Q6, sk->l1_F2, O1, sk->t4, V1, V1, O2, O1);
-    madd_matTr(epk->l1_Q6, sk->t1, V1, V1, O1, epk->l1_Q3, O2, O1);
-
-    // Layer 2
-
-    memset(tempQ, 0, O2 * O1 * O1);
-    memcpy(epk->l2_Q1, sk->l2_F1, L2_Q1_BYTE_LEN);
-    memcpy(epk->l2_Q2, sk->l2_F2, L2_Q2_BYTE_LEN);
-    memcpy(epk->l2_Q3, sk->l2_F3, L2_Q3_BYTE_LEN);
-    memcpy(epk->l2_Q5, sk->l2_F5, L2_Q5_BYTE_LEN);
-    memcpy(epk->l2_Q6, sk->l2_F6, L2_Q6_BYTE_LEN);
-    memset(epk->l2_Q9, 0, L2_Q9_BYTE_LEN);
-
-    // 1) Q2 = (F1 * T1) + F2
-    // 2) tempQ = T1' * ((F1 * T1) + F2)
-    // 3) Q5 = UT(tempQ) = UT(T1' * ((F1 * T1) + F2))
-    // 4) Q2 = Q2 + F1*T1 = (F1 * T1) + F2 + F1*T1
-    madd_trimat(epk->l2_Q2, sk->l2_F1, sk->t1, V1, V1, O1, O2);
-    madd_matTr(tempQ, sk->t1, V1, V1, O1, epk->l2_Q2, O1, O2);
-    UpperTrianglize(epk->l2_Q5, tempQ, O1, O2);
-    madd_trimatTr(epk->l2_Q2, sk->l2_F1, sk->t1, V1, V1, O1, O2);
-
-    // 5) Q3 = (F1 * T4) + F3
-    // 6) Q3 = Q3 + (F2 * T3) = (F1 * T4) + (F2 * T3) + F3
-    // 7) tempQ = T2' * Q3 = T2' ((F1 * T4) + (F2 * T3) + F3)
-    // 8) Q6 = F5*T3 + F6
-    // 9) tempQ = tempQ + T3' * Q6
-    // 10) Q9 = UT(tempQ)
-    // 11) Q3 = F1*T2 + Q3 = F1' * T2 + (F1 * T4) + (F2 * T3) + F3
-    // 12) Q6 = F2' * T4 + Q6 = (F2' * T4) + (F5 * T3) + F6
-    // 13) Q6 = Q6 + F5' * T3
-    // 14) Q6 = Q6 + (T1'*Q3)
-    memset(tempQ, 0, O2 * O2 * O2);
-    madd_trimat(epk->l2_Q3, sk->l2_F1, sk->t4, V1, V1, O2, O2);
-    madd_mat(epk->l2_Q3, sk->l2_F2, V1, sk->t3, O1, O1, O2, O2);
-    madd_matTr(tempQ, sk->t4, V1, V1, O2, epk->l2_Q3, O2, O2);
-    madd_trimat(epk->l2_Q6, sk->l2_F5, sk->t3, O1, O1, O2, O2);
-    madd_matTr(tempQ, sk->t3, O1, O1, O2, epk->l2_Q6, O2, O2);
-    UpperTrianglize(epk->l2_Q9, tempQ, O2, O2);
-    madd_trimatTr(epk->l2_Q3, sk->l2_F1, sk->t4, V1, V1, O2, O2);
-    madd_bmatTr(epk->l2_Q6, sk->l2_F2, O1, sk->t4, V1, V1, O2, O2);
-    madd_trimatTr(epk->l2_Q6, sk->l2_F5, sk->t3, O1, O1, O2, O2);
-    madd_matTr(epk->l2_Q6, sk->t1, V1, V1, O1, epk->l2_Q3, O2, O2);
-
-    memset(tempQ, 0, sizeof(tempQ));
+int calc_pk_stream(IN const sk_t *sk,
+                   OUT calc_pk_stream_ws_t *ws,
+                   IN pk_reserve_fn_t reserve,
+                   IN void *          ctx)
+{
+    const uint8_t *s1 = sk->s1;
+
+    // The Q2 and Q3 tasks of calc_pk, on PK_STREAM_ROWS rows at a time. They
+    // do not use the work memory of calc_pk.
+    calc_pk_ctx_t c = {NULL,      sk,        NULL,      0,
+                       ws->l1_q2, ws->l2_q2, ws->l1_q3, ws->l2_q3};
+
+    memset(ws->l1_tempQ5, 0, O1 * O1 * O1);
+    memset(ws->l2_tempQ5, 0, O2 * O1 * O1);
+    memset(ws->l1_tempQ9, 0, O1 * O2 * O2);
+    memset(ws->l2_tempQ9, 0, O2 * O2 * O2);
+    memset(ws->l1_q6, 0, L1_Q6_BYTE_LEN);
+
+    // Layer 2: Q6 = F5*T3 + F6 and tempQ = T3' * Q6
+    memcpy(ws->l2_q6, sk->l2_F6, L2_Q6_BYTE_LEN);
+    madd_trimat(ws->l2_q6, sk->l2_F5, sk->t3, O1, O1, O2, O2, 0, O1);
+    madd_matTr(ws->l2_tempQ9, sk->t3, O1, O1, ws->l2_q6, O2, O2, 0, O2);
+
+    for(size_t r0 = 0; r0 < V1; r0 += PK_STREAM_ROWS) {
+        const size_t rem = V1 - r0;
+        const size_t n   = (rem < PK_STREAM_ROWS) ? rem : PK_STREAM_ROWS;
+        const size_t r1  = r0 + n;
+
+        c.row0 = r0;
+
+        // Q2 = (F1 * T1) + F2, tempQ += T1' * Q2, Q2 += (F1' * T1)
+        l1_q2_trimat(&c, r0, r1);
+        l2_q2_trimat(&c, r0, r1);
+        madd_matTr(ws->l1_tempQ5, &sk->t1[r0], n, V1, ws->l1_q2, O1, O1, 0, O1);
+        madd_matTr(ws->l2_tempQ5, &sk->t1[r0], n, V1, ws->l2_q2, O1, O2, 0, O1);
+        l1_q2_trimattr(&c, r0, r1);
+        l2_q2_trimattr(&c, r0, r1);
+
+        // Q3 = (F1 * T2) + (F2 * T3) (+ F3), tempQ += T2' * Q3,
+        // Q3 += (F1' * T2), Q6 += T1' * Q3
+        l1_q3_mat(&c, r0, r1);
+        l2_q3_mat(&c, r0, r1);
+        madd_matTr(ws->l1_tempQ9, &sk->t4[r0], n, V1, ws->l1_q3, O2, O1, 0, O2);
+        madd_matTr(ws->l2_tempQ9, &sk->t4[r0], n, V1, ws->l2_q3, O2, O2, 0, O2);
+        l1_q3_trimattr(&c, r0, r1);
+        l2_q3_trimattr(&c, r0, r1);
+        madd_matTr(ws->l1_q6, &sk->t1[r0], n, V1, ws->l1_q3, O2, O1, 0, O1);
+        madd_matTr(ws->l2_q6, &sk->t1[r0], n, V1, ws->l2_q3, O2, O2, 0, O1);
+
+        for(size_t i = r0; i < r1; i++) {
+            const size_t t = idx_of_trimat(i, i, V1);
+            const size_t r = i - r0;
+
+            GUARD(emit_terms(reserve, ctx, &sk->l1_F1[O1 * t], &sk->l2_F1[O2 * t],
+                             V1 - i, s1));
+            GUARD(emit_terms(reserve, ctx, &ws->l1_q2[r * O1 * O1],
+                             &ws->l2_q2[r * O1 * O2], O1, s1));
+            GUARD(emit_terms(reserve, ctx, &ws->l1_q3[r * O2 * O1],
+                             &ws->l2_q3[r * O2 * O2], O2, s1));
+        }
+    }
+
+    // Q6 += F2' * T2 (+ F5' * T3)
+    madd_bmatTr(ws->l1_q6, sk->l1_F2, O1, sk->t4, V1, V1, O2, O1, 0, O1);
+    madd_bmatTr(ws->l2_q6, sk->l2_F2, O1, sk->t4, V1, V1, O2, O2, 0, O1);
+    madd_trimatTr(ws->l2_q6, sk->l2_F5, sk->t3, O1, O1, O2, O2, 0, O1);
+
+    memset(ws->l1_tri.q5, 0, L1_Q5_BYTE_LEN);
+    memcpy(ws->l2_tri.q5, sk->l2_F5, L2_Q5_BYTE_LEN);
+    UpperTrianglize(ws->l1_tri.q5, ws->l1_tempQ5, O1, O1);
+    UpperTrianglize(ws->l2_tri.q5, ws->l2_tempQ5, O1, O2);
+
+    for(size_t i = 0; i < O1; i++) {
+        const size_t t = idx_of_trimat(i, i, O1);
+
+        GUARD(emit_terms(reserve, ctx, &ws->l1_tri.q5[O1 * t],
+                         &ws->l2_tri.q5[O2 * t], O1 - i, s1));
+        GUARD(emit_terms(reserve, ctx, &ws->l1_q6[i * O2 * O1],
+                         &ws->l2_q6[i * O2 * O2], O2, s1));
+    }
+
+    memset(ws->l1_tri.q9, 0, L1_Q9_BYTE_LEN);
+    memset(ws->l2_tri.q9, 0, L2_Q9_BYTE_LEN);
+    UpperTrianglize(ws->l1_tri.q9, ws->l1_tempQ9, O2, O1);
+    UpperTrianglize(ws->l2_tri.q9, ws->l2_tempQ9, O2, O2);
+
+    for(size_t i = 0; i < O2; i++) {
+        const size_t t = idx_of_trimat(i, i, O2);
+
+        GUARD(emit_terms(reserve, ctx, &ws->l1_tri.q9[O1 * t],
+                         &ws->l2_tri.q9[O2 * t], O2 - i, s1));
+    }
+
+    return SUCCESS;
 }
@@ -23,6 +23,7 @@
 
 #pragma once
 
+#include "api.h"
 #include "rainbow_config.h"
 
 EXTERNC_BEGIN
@@ -41,24 +42,98 @@ EXTERNC_BEGIN
 #define L2_Q6_BYTE_LEN (O2 * O1 * O2)
 #define L2_Q9_BYTE_LEN (O2 * N_TRIANGLE_TERMS(O2))
 
-// Internal public key structure
-typedef struct rainbow_extend_publickey {
-    uint8_t l1_Q1[L1_Q1_BYTE_LEN];
-    uint8_t l1_Q2[L1_Q2_BYTE_LEN];
-    uint8_t l1_Q3[L1_Q3_BYTE_LEN];
-    uint8_t l1_Q5[L1_Q5_BYTE_LEN];
-    uint8_t l1_Q6[L1_Q6_BYTE_LEN];
-    uint8_t l1_Q9[L1_Q9_BYTE_LEN];
+#if O1 == O2
+#    define TEMP_SIZE (O1 * O1 * O1)
+#else
+#    define MAX(a, b) ((a > b) ? a : b)
+#    define TEMP_SIZE                                                            \
+        (MAX(O1 * O1 * O1, MAX(O2 * O1 * O1, MAX(O2 * O2 * O1, O2 * O2 * O2))) + \
+         32)
+#endif
 
-    uint8_t l2_Q1[L1_Q1_BYTE_LEN];
-    uint8_t l2_Q2[L2_Q2_BYTE_LEN];
-    uint8_t l2_Q3[L2_Q3_BYTE_LEN];
-    uint8_t l2_Q5[L2_Q5_BYTE_LEN];
-    uint8_t l2_Q6[L2_Q6_BYTE_LEN];
-    uint8_t l2_Q9[L2_Q9_BYTE_LEN];
-} ext_cpk_t;
+// The Q blocks of both layers that are in flight while calc_pk computes the
+// public key. The blocks of one stage share their storage with those of the
+// other stage.
+typedef struct calc_pk_ws_st {
+    union {
+        uint8_t q2[L1_Q2_BYTE_LEN];
+        uint8_t q3[L1_Q3_BYTE_LEN];
+    } l1;
+    union {
+        uint8_t q2[L2_Q2_BYTE_LEN];
+        uint8_t q3[L2_Q3_BYTE_LEN];
+    } l2;
+    union {
+        uint8_t q5[L1_Q5_BYTE_LEN];
+        uint8_t q9[L1_Q9_BYTE_LEN];
+    } l1_tri;
+    union {
+        uint8_t q5[L2_Q5_BYTE_LEN];
+        uint8_t q9[L2_Q9_BYTE_LEN];
+    } l2_tri;
+    uint8_t l1_q6[L1_Q6_BYTE_LEN];
+    uint8_t l2_q6[L2_Q6_BYTE_LEN];
+    uint8_t l1_tempQ[TEMP_SIZE];
+    uint8_t l2_tempQ[TEMP_SIZE];
+} calc_pk_ws_t;
 
-void calc_pk(OUT ext_cpk_t *epk, IN const sk_t *sk);
-void extcpk_to_pk(OUT pk_t *pk, IN const ext_cpk_t *cpk);
+// Computes the public key of |sk| (in the internal field representation)
+// block by block. Every Q block is obfuscated, converted to the AES field and
+// stored at its final position in |pk| while it is still in the cache.
+// The t4 field of |sk| must still hold T2. If |team| is not NULL, the blocks
+// are computed by the caller and the helpers of |team| together. The output
+// does not depend on |team|.
+void calc_pk(OUT pk_t *pk,
+             IN const sk_t *sk,
+             OUT calc_pk_ws_t *ws,
+             IN rainbow_team_t *team);
+
+// The vinegar rows of Q2 and Q3 that calc_pk_stream computes at a time.
+#define PK_STREAM_ROWS (4)
+
+// The working set of calc_pk_stream. Only PK_STREAM_ROWS rows of Q2 and Q3
+// are held. Q5, Q6 and Q9 are accumulated over the rows and emitted last.
+typedef struct calc_pk_stream_ws_st {
+    uint8_t l1_q2[PK_STREAM_ROWS * O1 * O1];
+    uint8_t l2_q2[PK_STREAM_ROWS * O1 * O2];
+    uint8_t l1_q3[PK_STREAM_ROWS * O2 * O1];
+    uint8_t l2_q3[PK_STREAM_ROWS * O2 * O2];
+    uint8_t l1_tempQ5[TEMP_SIZE];
+    uint8_t l2_tempQ5[TEMP_SIZE];
+    uint8_t l1_tempQ9[TEMP_SIZE];
+    uint8_t l2_tempQ9[TEMP_SIZE];
+    uint8_t l1_q6[L1_Q6_BYTE_LEN];
+    uint8_t l2_q6[L2_Q6_BYTE_LEN];
+    union {
+        uint8_t q5[L1_Q5_BYTE_LEN];
+        uint8_t q9[L1_Q9_BYTE_LEN];
+    } l1_tri;
+    union {
+        uint8_t q5[L2_Q5_BYTE_LEN];
+        uint8_t q9[L2_Q9_BYTE_LEN];
+    } l2_tri;
+} calc_pk_stream_ws_t;
+
+// Returns the memory of the next |n_terms| terms of the public key
+// (n_terms * PUB_M bytes), or NULL on failure.
+typedef uint8_t *(*pk_reserve_fn_t)(void *ctx, size_t n_terms);
+
+// Same as calc_pk, but the terms of the public key are stored in their pk_t
+// order in the memory returned by |reserve|, and the public key is never
+// held as a whole. The Q2 and Q3 rows are computed by the tasks of calc_pk,
+// PK_STREAM_ROWS vinegar rows at a time, and are emitted as soon as they are
+// final. Returns 0 on success.
+int calc_pk_stream(IN const sk_t *sk,
+                   OUT calc_pk_stream_ws_t *ws,
+                   IN pk_reserve_fn_t reserve,
+                   IN void *          ctx);
+
+// Generates the keypair of |sk_seed| (as rainbow_keypair) with the work memory
+// |ws| of the caller.
+void keypair_ws(OUT pk_t *pk,
+                OUT sk_t *sk,
+                IN const uint8_t *sk_seed,
+                OUT calc_pk_ws_t *ws,
+                IN rainbow_team_t *team);
 
 EXTERNC_END
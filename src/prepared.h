@@ -0,0 +1,96 @@
+/*
+ * Copyright 2020 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ * The license is detailed in the file LICENSE.md, and applies to this file.
+ *
+ * Written by Nir Drucker and Shay Gueron
+ * AWS Cryptographic Algorithms Group.
+ * (ndrucker@amazon.com, gueron@amazon.com)
+ */
+
+#pragma once
+
+#include "api.h"
+#include "gfni.h"
+#include "rainbow_config.h"
+
+EXTERNC_BEGIN
+
+// The split layout (RAINBOW_PK_LAYOUT_SPLIT) of the public key.
+// main[t] holds the first 64 equations of term t. tail[g] holds the remaining
+// 8 equations of the terms 8g,...,8g+7 (8 bytes per term).
+typedef struct pk_split_st {
+    uint8_t main[PUB_TERMS][SPLIT_MAIN_BYTES];
+    uint8_t tail[SPLIT_TAIL_LINES][SPLIT_MAIN_BYTES];
+} pk_split_t;
+
+// The early-reject layout (RAINBOW_PK_LAYOUT_EARLY_REJECT) of the public key.
+// early[g] holds the first EARLY_EQS equations of the terms
+// EARLY_TERMS*g,...,EARLY_TERMS*g+EARLY_TERMS-1 (EARLY_EQS bytes per term).
+// late[t] holds the remaining LATE_EQS equations of term t.
+typedef struct pk_early_st {
+    uint8_t early[EARLY_LINES][SPLIT_MAIN_BYTES];
+    uint8_t late[PUB_TERMS][SPLIT_MAIN_BYTES];
+} pk_early_t;
+
+#define PK_FINGERPRINT_BYTES (32)
+
+// Internal representation of a prepared public key.
+// The key is stored in the GFNI field (unless USE_AES_FIELD is defined), so
+// it can be passed directly to the mq_gf256_n140_m72 kernels.
+struct rainbow_pk_prepared_st {
+    union {
+        pk_t       rows;
+        pk_split_t split;
+        pk_early_t early;
+    } ALIGN(64) u;
+
+    rainbow_pk_layout_t layout;
+
+    // H(pk), identifies the key in the verified-signature cache.
+    uint8_t fingerprint[PK_FINGERPRINT_BYTES];
+};
+
+// The interleaved layout of the F1 and F2 maps of the two layers. The layer 1
+// and layer 2 coefficients of the same monomial form one (O1 + O2)-byte row,
+// the shape of a public key row.
+#define SK_ILV_ROW_BYTES (O1 + O2)
+
+struct sk_interleaved_st {
+    uint8_t F1[N_TRIANGLE_TERMS(V1)][SK_ILV_ROW_BYTES]; // l1_F1 || l2_F1
+    uint8_t F2[V1 * O1][SK_ILV_ROW_BYTES];              // l1_F2 || l2_F2
+};
+
+// Internal representation of a prepared secret key.
+// The field elements of the key are stored in the GFNI field (unless
+// USE_AES_FIELD is defined). The sk_seed is kept in its original form because
+// it seeds the signing prng. The F1 and F2 maps are held only in the
+// interleaved layout |ilv|, and the other parts of the key as in sk_t.
+// The object is zeroized when it is released.
+struct rainbow_sk_prepared_st {
+    ALIGN(64) sk_interleaved_t ilv;
+
+    uint8_t sk_seed[SKSEED_BYTE_LEN];
+    uint8_t s1[S1_BYTE_LEN];
+    uint8_t t1[T1_BYTE_LEN];
+    uint8_t t4[T4_BYTE_LEN];
+    uint8_t t3[T3_BYTE_LEN];
+    uint8_t l2_F3[L2_F3_BYTE_LEN];
+    uint8_t l2_F5[L2_F5_BYTE_LEN];
+    uint8_t l2_F6[L2_F6_BYTE_LEN];
+
+    // The fault check mode, set by rainbow_sk_set_fault_check
+    uint32_t fault_check;
+};
+
+EXTERNC_END
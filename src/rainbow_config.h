@@ -42,6 +42,9 @@ EXTERNC_BEGIN
 
 #define N_TRIANGLE_TERMS(n_var) ((n_var) * ((n_var) + 1) / 2)
 
+// The number of terms (monomials) in every equation of the public key.
+#define PUB_TERMS N_TRIANGLE_TERMS(PUB_N)
+
 #define S1_BYTE_LEN (O1 * O2)
 #define T1_BYTE_LEN (V1 * O1)
 #define T4_BYTE_LEN (V1 * O2)
@@ -56,7 +59,7 @@ EXTERNC_BEGIN
 #define L2_F6_BYTE_LEN (O2 * O1 * O2)
 
 typedef struct pk_st {
-    uint8_t pk[(PUB_M)*N_TRIANGLE_TERMS(PUB_N)];
+    uint8_t pk[(PUB_M)*PUB_TERMS];
 } pk_t;
 
 typedef struct sk_st {
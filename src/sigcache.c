@@ -0,0 +1,237 @@
+/*
+ * Copyright 2020 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ * The license is detailed in the file LICENSE.md, and applies to this file.
+ *
+ * The code was written by Nir Drucker and Shay Gueron
+ * AWS Cryptographic Algorithms Group.
+ * (ndrucker@amazon.com, gueron@amazon.com)
+ */
+
+#include <pthread.h>
+
+#include "api.h"
+#include "prepared.h"
+#include "utils_hash.h"
+#include "utils_mem.h"
+
+// The cache is split into SIGCACHE_SHARDS independently locked shards. Every
+// shard is a set-associative table of SIGCACHE_WAYS entries per set. An entry
+// is the key H(fingerprint || digest || sig) of a signature that was verified
+// successfully. When a set is full, a random entry of the set is evicted.
+#define SIGCACHE_SHARDS    (16)
+#define SIGCACHE_WAYS      (8)
+#define SIGCACHE_KEY_BYTES (32)
+
+typedef struct sigcache_set_st {
+    uint8_t key[SIGCACHE_WAYS][SIGCACHE_KEY_BYTES];
+    uint8_t used;
+} sigcache_set_t;
+
+typedef struct sigcache_shard_st {
+    pthread_mutex_t lock;
+    sigcache_set_t *sets;
+    size_t          sets_mask;
+    uint64_t        rnd;
+    uint64_t        hits;
+    uint64_t        misses;
+} ALIGN(64) sigcache_shard_t;
+
+struct rainbow_sigcache_st {
+    sigcache_shard_t shards[SIGCACHE_SHARDS];
+};
+
+typedef struct sigcache_input_st {
+    uint8_t fingerprint[PK_FINGERPRINT_BYTES];
+    uint8_t digest[HASH_BYTE_LEN];
+    uint8_t sig[SIG_BYTE_LEN];
+} sigcache_input_t;
+
+_INLINE_ uint64_t load64(IN const uint8_t *in)
+{
+    uint64_t ret;
+    memcpy(&ret, in, sizeof(ret));
+    return ret;
+}
+
+// xorshift64
+_INLINE_ uint64_t next_rnd(IN OUT uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+// The key is a hash, so its first qword selects the shard and its second
+// qword selects the set.
+_INLINE_ sigcache_set_t *find_set(OUT sigcache_shard_t **shard,
+                                  IN rainbow_sigcache_t *cache,
+                                  IN const uint8_t *key)
+{
+    *shard = &cache->shards[load64(key) % SIGCACHE_SHARDS];
+    return &(*shard)->sets[load64(&key[8]) & (*shard)->sets_mask];
+}
+
+_INLINE_ uint32_t set_lookup(IN const sigcache_set_t *set, IN const uint8_t *key)
+{
+    for(size_t w = 0; w < SIGCACHE_WAYS; w++) {
+        if(((set->used >> w) & 1) &&
+           (0 == memcmp(set->key[w], key, SIGCACHE_KEY_BYTES))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+_INLINE_ void set_insert(IN OUT sigcache_set_t *set,
+                         IN OUT uint64_t *rnd,
+                         IN const uint8_t *key)
+{
+    if(set_lookup(set, key)) {
+        return;
+    }
+
+    size_t w = 0;
+    while((w < SIGCACHE_WAYS) && ((set->used >> w) & 1)) {
+        w++;
+    }
+
+    // The set is full, evict a random entry.
+    if(SIGCACHE_WAYS == w) {
+        w = next_rnd(rnd) % SIGCACHE_WAYS;
+    }
+
+    memcpy(set->key[w], key, SIGCACHE_KEY_BYTES);
+    set->used |= (uint8_t)(1U << w);
+}
+
+rainbow_sigcache_t *rainbow_sigcache_create(IN const size_t capacity)
+{
+    const size_t per_set = SIGCACHE_SHARDS * SIGCACHE_WAYS;
+    size_t       n_sets  = 1;
+    while((n_sets * per_set) < capacity) {
+        n_sets <<= 1;
+    }
+
+    rainbow_sigcache_t *cache = aligned_malloc(sizeof(*cache));
+    if(NULL == cache) {
+        return NULL;
+    }
+
+    size_t i = 0;
+    for(; i < SIGCACHE_SHARDS; i++) {
+        sigcache_shard_t *shard = &cache->shards[i];
+
+        shard->sets = aligned_malloc(n_sets * sizeof(sigcache_set_t));
+        if(NULL == shard->sets) {
+            break;
+        }
+        if(0 != pthread_mutex_init(&shard->lock, NULL)) {
+            aligned_free(shard->sets);
+            break;
+        }
+
+        memset(shard->sets, 0, n_sets * sizeof(sigcache_set_t));
+        shard->sets_mask = n_sets - 1;
+        shard->rnd       = 0x9e3779b97f4a7c15ULL * (i + 1);
+        shard->hits      = 0;
+        shard->misses    = 0;
+    }
+
+    if(SIGCACHE_SHARDS != i) {
+        while(i-- > 0) {
+            pthread_mutex_destroy(&cache->shards[i].lock);
+            aligned_free(cache->shards[i].sets);
+        }
+        aligned_free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+void rainbow_sigcache_release(IN rainbow_sigcache_t *cache)
+{
+    if(NULL == cache) {
+        return;
+    }
+
+    for(size_t i = 0; i < SIGCACHE_SHARDS; i++) {
+        pthread_mutex_destroy(&cache->shards[i].lock);
+        aligned_free(cache->shards[i].sets);
+    }
+    aligned_free(cache);
+}
+
+void rainbow_sigcache_stats(IN rainbow_sigcache_t *cache,
+                            OUT uint64_t *hits,
+                            OUT uint64_t *misses)
+{
+    *hits   = 0;
+    *misses = 0;
+
+    for(size_t i = 0; i < SIGCACHE_SHARDS; i++) {
+        sigcache_shard_t *shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        *hits += shard->hits;
+        *misses += shard->misses;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+int rainbow_verify_cached(IN rainbow_sigcache_t *cache,
+                          IN const uint8_t *digest,
+                          IN const uint8_t *sig,
+                          IN const rainbow_pk_prepared_t *ppk)
+{
+    sigcache_input_t  in;
+    uint8_t           key[SIGCACHE_KEY_BYTES];
+    sigcache_shard_t *shard;
+
+    memcpy(in.fingerprint, ppk->fingerprint, sizeof(in.fingerprint));
+    memcpy(in.digest, digest, sizeof(in.digest));
+    memcpy(in.sig, sig, sizeof(in.sig));
+
+    // Without a key the cache cannot be used.
+    if(SUCCESS != hash_msg(key, sizeof(key), (const uint8_t *)&in, sizeof(in))) {
+        return rainbow_verify_prepared(digest, sig, ppk);
+    }
+
+    sigcache_set_t *set = find_set(&shard, cache, key);
+
+    pthread_mutex_lock(&shard->lock);
+    const uint32_t hit = set_lookup(set, key);
+    if(hit) {
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if(hit) {
+        return 0;
+    }
+
+    const int ret = rainbow_verify_prepared(digest, sig, ppk);
+
+    // Only valid signatures are cached.
+    if(0 == ret) {
+        pthread_mutex_lock(&shard->lock);
+        set_insert(set, &shard->rnd, key);
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    return ret;
+}
@@ -23,8 +23,13 @@
 
 #include <stdlib.h>
 
+#include "api.h"
 #include "gfni.h"
+#include "prepared.h"
 #include "rainbow_config.h"
+#include "sign_internal.h"
+#include "team.h"
+#include "utils_mem.h"
 #include "utils_prng.h"
 
 #define MAX_ATTEMPT_FRMAT 128
@@ -34,14 +39,15 @@
 #    define MAX_O ((O1 > O2) ? O1 : O2)
 #endif
 
-_INLINE_ void
-setup_prng(OUT prng_t *prng_sign, IN const sk_t *sk, IN const uint8_t *_digest)
+_INLINE_ void setup_prng(OUT prng_t *prng_sign,
+                         IN const uint8_t *sk_seed,
+                         IN const uint8_t *_digest)
 {
     uint8_t prng_preseed[SKSEED_BYTE_LEN + HASH_BYTE_LEN];
     uint8_t prng_seed[HASH_BYTE_LEN];
 
     // prng_preseed = sk_seed || digest
-    memcpy(prng_preseed, sk->sk_seed, SKSEED_BYTE_LEN);
+    memcpy(prng_preseed, sk_seed, SKSEED_BYTE_LEN);
     memcpy(prng_preseed + SKSEED_BYTE_LEN, _digest, HASH_BYTE_LEN);
     hash_msg(prng_seed, HASH_BYTE_LEN, prng_preseed,
              HASH_BYTE_LEN + SKSEED_BYTE_LEN);
@@ -53,38 +59,16 @@ setup_prng(OUT prng_t *prng_sign, IN const sk_t *sk, IN const uint8_t *_digest)
     secure_clean(prng_seed, sizeof(prng_seed));
 }
 
-_INLINE_
-void gf256mat_submat(uint8_t *      mat2,
-                     uint32_t       w2,
-                     uint32_t       st,
-                     const uint8_t *mat,
-                     uint32_t       w,
-                     uint32_t       h)
+_INLINE_ void gen_vinegar(IN OUT prng_t *prng_sign, OUT uint8_t *vinegar)
 {
-    for(size_t i = 0; i < h; i++) {
-        memcpy(&mat2[i * w2], &mat[i * w + st], w2);
-    }
-}
-
-_INLINE_
-uint32_t gf256mat_inv(OUT uint8_t *inv_a, IN const uint8_t *a, IN uint32_t H)
-{
-    uint8_t mat_buffer[2 * MAX_O * MAX_O];
-
-    for(uint32_t i = 0; i < H; i++) {
-        uint8_t *ai = &mat_buffer[i * 2 * H];
-        memset(ai, 0, 2ULL * H);
-        gf256_add(ai, &a[i * H], H);
-        ai[H + i] = 1;
-    }
+    prng_gen(prng_sign, vinegar, V1);
 
-    uint8_t r8 = gf256mat_gauss_elim(mat_buffer, H, 2 * H);
-
-    gf256mat_submat(inv_a, H, H, mat_buffer, 2 * H, H);
-
-    secure_clean(mat_buffer, sizeof(mat_buffer));
-
-    return r8;
+#ifndef USE_AES_FIELD
+    // In order to match the official KATs the vinegar must be transformed to
+    // the AES field Note that in any other case this is not required because
+    // the vinegar are random and are only used for signing.
+    to_gfni(vinegar, vinegar, V1);
+#endif
 }
 
 // Generate vinegars and the linear equations for layer 1
@@ -94,69 +78,210 @@ uint32_t gf256mat_inv(OUT uint8_t *inv_a, IN const uint8_t *a, IN uint32_t H)
 _INLINE_ uint32_t roll_vinegars(IN OUT prng_t *prng_sign,
                                 OUT uint8_t *vinegar,
                                 OUT uint8_t *mat_l1,
+                                OUT uint8_t *mat_l1_sys,
                                 IN const sk_t *sk)
 {
     uint32_t attempts = 0;
     uint32_t l1_succ  = 0;
 
     for(; (!l1_succ) && (attempts < MAX_ATTEMPT_FRMAT); attempts++) {
-        prng_gen(prng_sign, vinegar, V1);
+        gen_vinegar(prng_sign, vinegar);
+        gfmat_prod_native(mat_l1_sys, sk->l1_F2, O1 * O1, V1, vinegar);
+        l1_succ = gf256mat_inv_36(mat_l1, mat_l1_sys);
+    }
 
-#ifndef USE_AES_FIELD
-        // In order to match the official KATs the vinegar must be transformed to
-        // the AES field Note that in any other case this is not required because
-        // the vinegar are random and are only used for signing.
-        to_gfni(vinegar, vinegar, V1);
-#endif
+    return attempts;
+}
+
+// The vinegar maps of the interleaved key, split into parts for team_run
+typedef struct maps_job_st {
+    vinegar_bundle_t *b;
+    const sk_maps_t * _sk;
+} maps_job_t;
+
+#define MAPS_JOB_PARTS (3)
 
-        gfmat_prod_native(mat_l1, sk->l1_F2, O1 * O1, V1, vinegar);
-        l1_succ = gf256mat_inv(mat_l1, mat_l1, O1);
+_INLINE_ void maps_job_part(IN void *ctx, IN const size_t part)
+{
+    const maps_job_t *job = ctx;
+    vinegar_bundle_t *b   = job->b;
+
+    switch(part) {
+        case 0:
+            vinegar_f1_interleaved_36(b->r_l1_F1, b->r_l2_F1, job->_sk->ilv,
+                                      b->vinegar);
+            break;
+        case 1:
+            vinegar_f2_interleaved_36(b->mat_l1_sys, b->mat_l2_F2, job->_sk->ilv,
+                                      b->vinegar);
+            break;
+        default: vinegar_f3_36(b->mat_l2_F3, job->_sk->l2_F3, b->vinegar);
     }
+}
 
-    return attempts;
+// vinegar_bundle_compute, where the vinegar maps are spread over |team| if it
+// is not NULL and has helpers (the maps must then be interleaved).
+_INLINE_ void bundle_compute(OUT vinegar_bundle_t *b,
+                             IN OUT prng_t *prng,
+                             IN const sk_maps_t *_sk,
+                             IN rainbow_team_t *team)
+{
+    maps_job_t job     = {b, _sk};
+    uint32_t   l1_succ = 0;
+
+    // As roll_vinegars, but all the vinegar maps are evaluated in one pass.
+    // The layer 1 system is singular rarely, so the extra maps of a failed
+    // roll cost less than a second pass over the secret key.
+    for(b->attempts = 0; (!l1_succ) && (b->attempts < MAX_ATTEMPT_FRMAT);
+        b->attempts++) {
+        gen_vinegar(prng, b->vinegar);
+        if((NULL != team) && (0 != rainbow_team_size(team))) {
+            team_run(team, maps_job_part, &job, MAPS_JOB_PARTS);
+        } else if(NULL != _sk->ilv) {
+            vinegar_maps_interleaved_36(b->r_l1_F1, b->r_l2_F1, b->mat_l1_sys,
+                                        b->mat_l2_F3, b->mat_l2_F2, _sk->ilv,
+                                        _sk->l2_F3, b->vinegar);
+        } else {
+            vinegar_maps_36(b->r_l1_F1, b->r_l2_F1, b->mat_l1_sys, b->mat_l2_F3,
+                            b->mat_l2_F2, _sk->sk, b->vinegar);
+        }
+        l1_succ = gf256mat_inv_36(b->mat_l1, b->mat_l1_sys);
+    }
 }
 
-int rainbow_sign(uint8_t *signature, const sk_t *sk, const uint8_t *_digest)
+void vinegar_bundle_compute(OUT vinegar_bundle_t *b,
+                            IN OUT prng_t *prng,
+                            IN const sk_maps_t *_sk)
 {
-    uint8_t           mat_l1[O1 * O1];
-    uint8_t           mat_l2[O2 * O2];
-    ALIGN(32) uint8_t vinegar[V1];
-    prng_t            prng_sign;
+    bundle_compute(b, prng, _sk, NULL);
+}
 
-    // Pre-compute variables needed for layer 2
-    uint8_t r_l1_F1[O1] = {0};
-    uint8_t r_l2_F1[O2] = {0};
-    uint8_t mat_l2_F3[O2 * O2];
-    uint8_t mat_l2_F2[O1 * O2];
+// Adds to |y| (both layers) the F2 maps of |_sk| on the vinegar |v| and the
+// oil |x_o1|. The products are taken per vinegar variable, so no O1 * O1
+// matrix is materialized on the stack.
+_INLINE_ void check_f2(IN OUT uint8_t *y,
+                       IN const sk_maps_t *_sk,
+                       IN const uint8_t *v,
+                       IN const uint8_t *x_o1)
+{
+    uint8_t u[O1];
+    uint8_t t[O1 + O2];
+
+    for(size_t i = 0; i < V1; i++) {
+        memcpy(u, x_o1, O1);
+        gf256_mul(u, v[i], O1);
+
+        if(NULL != _sk->ilv) {
+            gfmat_prod_native(t, &_sk->ilv->F2[i * O1][0], O1 + O2, O1, u);
+        } else {
+            gfmat_prod_native(t, &_sk->sk->l1_F2[i * O1 * O1], O1, O1, u);
+            gfmat_prod_native(&t[O1], &_sk->sk->l2_F2[i * O1 * O2], O2, O1, u);
+        }
+        gf256_add(y, t, O1 + O2);
+    }
 
-    digest_salt_t ds;
-    memcpy(ds.digest, _digest, sizeof(ds.digest));
+    secure_clean(u, sizeof(u));
+    secure_clean(t, sizeof(t));
+}
 
-    // Must set the prng before converting to the GFNI because the original
-    // sk->sk_seed should be used.
-    setup_prng(&prng_sign, sk, _digest);
+// Maps the signature |w| (in the internal field representation) forward to
+// the message hash with the secret key only: x = T * w, y = F(x) and z = S * y.
+// The vinegar products of F are taken from |b| (the layer 1 system before its
+// inversion), unless the mode of |_sk| is RAINBOW_FAULT_CHECK_FULL. Then they
+// are evaluated again from the secret key on x, and nothing of |b| but its
+// vinegar is trusted. Returns 1 if z equals |_z| and the vinegar part of x is
+// the vinegar of |b|, and 0 otherwise. |mat_l2| is O2 * O2 bytes of scratch
+// memory.
+_INLINE_ uint32_t fault_check(IN const uint8_t *w,
+                              IN const uint8_t *_z,
+                              IN const sk_maps_t *_sk,
+                              IN const vinegar_bundle_t *b,
+                              OUT uint8_t *mat_l2)
+{
+    uint8_t x[PUB_N];
+    uint8_t z[PUB_M];
+    uint8_t temp[V1];
+
+    uint8_t *x_v1 = x;
+    uint8_t *x_o1 = &x[V1];
+    uint8_t *x_o2 = &x[V2];
+
+    // x = T * w
+    memcpy(x, w, PUB_N);
+    gfmat_prod_native(temp, _sk->t3, O1, O2, x_o2);
+    gf256_add(x_o1, temp, O1);
+    gfmat_prod_native(temp, _sk->t1, V1, O1, x_o1);
+    gf256_add(x_v1, temp, V1);
+    gfmat_prod_native(temp, _sk->t4, V1, O2, x_o2);
+    gf256_add(x_v1, temp, V1);
+
+    // Both layers: y = F1 + F2, and the F3 matrix of layer 2
+    uint8_t *      y2 = &z[O1];
+    const uint8_t *f3 = mat_l2;
+    if(RAINBOW_FAULT_CHECK_FULL == _sk->fault_check) {
+        if(NULL != _sk->ilv) {
+            vinegar_f1_interleaved_36(z, y2, _sk->ilv, x_v1);
+        } else {
+            multab_trimat_36(z, _sk->sk->l1_F1, x_v1, V1);
+            multab_trimat_36(y2, _sk->sk->l2_F1, x_v1, V1);
+        }
+        check_f2(z, _sk, x_v1, x_o1);
+        vinegar_f3_36(mat_l2, _sk->l2_F3, x_v1);
+    } else {
+        gfmat_prod_native(z, b->mat_l1_sys, O1, O1, x_o1);
+        gf256_add(z, b->r_l1_F1, O1);
+        gfmat_prod_native(y2, b->mat_l2_F2, O2, O1, x_o1);
+        gf256_add(y2, b->r_l2_F1, O2);
+        f3 = b->mat_l2_F3;
+    }
 
-#ifdef USE_AES_FIELD
-    const sk_t *_sk = sk;
-#else
-    sk_t  sk_tmp;
-    sk_t *_sk = &sk_tmp;
-    to_gfni((uint8_t *)_sk, (const uint8_t *)sk, sizeof(*sk));
-#endif // USE_AES_FIELD
+    // Layer 2: y2 += F5 + (F3 + F6) * x_o2
+    quad_form_36(temp, _sk->l2_F5, x_o1, O1);
+    gf256_add(y2, temp, O2);
+    gfmat_prod_native(temp, f3, O2, O2, x_o2);
+    gf256_add(y2, temp, O2);
+    gfmat_prod_native(mat_l2, _sk->l2_F6, O2 * O2, O1, x_o1);
+    gfmat_prod_native(temp, mat_l2, O2, O2, x_o2);
+    gf256_add(y2, temp, O2);
+
+    // z = S * y, the identity part of S is already in place
+    gfmat_prod_native(temp, _sk->s1, O1, O2, y2);
+    gf256_add(z, temp, O1);
+
+    uint8_t diff = 0;
+    for(size_t i = 0; i < PUB_M; i++) {
+        diff |= z[i] ^ _z[i];
+    }
+    for(size_t i = 0; i < V1; i++) {
+        diff |= x_v1[i] ^ b->vinegar[i];
+    }
 
-    uint32_t attempts = roll_vinegars(&prng_sign, vinegar, mat_l1, _sk);
+    secure_clean(x, sizeof(x));
+    secure_clean(z, sizeof(z));
+    secure_clean(temp, sizeof(temp));
 
-    multab_trimat_36(r_l1_F1, _sk->l1_F1, vinegar, V1);
-    multab_trimat_36(r_l2_F1, _sk->l2_F1, vinegar, V1);
-    gfmat_prod_native(mat_l2_F3, _sk->l2_F3, O2 * O2, V1, vinegar);
-    gfmat_prod_native(mat_l2_F2, _sk->l2_F2, O1 * O2, V1, vinegar);
+    return (0 == diff);
+}
+
+int sign_with_bundle(OUT uint8_t *signature,
+                     IN OUT prng_t *prng_sign,
+                     IN const sk_maps_t *_sk,
+                     IN const vinegar_bundle_t *b,
+                     IN const uint8_t *_digest)
+{
+    uint8_t mat_l2[O2 * O2];
+
+    digest_salt_t ds;
+    memcpy(ds.digest, _digest, sizeof(ds.digest));
+
+    uint32_t attempts = b->attempts;
 
     // Some local variables.
-    uint8_t  _z[PUB_M];
-    uint8_t  y[PUB_M];
-    uint8_t *x_v1 = vinegar;
-    uint8_t  x_o1[O1];
-    uint8_t  x_o2[O1];
+    uint8_t        _z[PUB_M];
+    uint8_t        y[PUB_M];
+    const uint8_t *x_v1 = b->vinegar;
+    uint8_t        x_o1[O1] = {0};
+    uint8_t        x_o2[O1] = {0};
 
     uint8_t  temp_o[MAX_O] = {0};
     uint32_t succ          = 0;
@@ -168,7 +293,7 @@ int rainbow_sign(uint8_t *signature, const sk_t *sk, const uint8_t *_digest)
         // --T-->   w
 
         // Roll the salt
-        prng_gen(&prng_sign, ds.salt, sizeof(ds.salt));
+        prng_gen(prng_sign, ds.salt, sizeof(ds.salt));
 
         hash_msg(_z, PUB_M, (const uint8_t *)&ds, sizeof(ds));
 
@@ -184,30 +309,29 @@ int rainbow_sign(uint8_t *signature, const sk_t *sk, const uint8_t *_digest)
 
         // Central Map:
         // Layer 1: calculate x_o1
-        memcpy(temp_o, r_l1_F1, O1);
+        memcpy(temp_o, b->r_l1_F1, O1);
         gf256_add(temp_o, y, O1);
-        gfmat_prod_native(x_o1, mat_l1, O1, O1, temp_o);
+        gfmat_prod_native(x_o1, b->mat_l1, O1, O1, temp_o);
 
         // Layer 2: calculate x_o2
         memset(temp_o, 0, O2);
         // F2
-        gfmat_prod_native(temp_o, mat_l2_F2, O2, O1, x_o1);
+        gfmat_prod_native(temp_o, b->mat_l2_F2, O2, O1, x_o1);
         // F5
-        multab_trimat_36(mat_l2, _sk->l2_F5, x_o1, O1);
+        quad_form_36(mat_l2, _sk->l2_F5, x_o1, O1);
         gf256_add(temp_o, mat_l2, O2);
         // F1
-        gf256_add(temp_o, r_l2_F1, O2);
+        gf256_add(temp_o, b->r_l2_F1, O2);
         gf256_add(temp_o, y + O1, O2);
 
-        // Generate inv_mat
+        // Generate the l2 system
         // F6
         gfmat_prod_native(mat_l2, _sk->l2_F6, O2 * O2, O1, x_o1);
         // F3
-        gf256_add(mat_l2, mat_l2_F3, O2 * O2);
-        succ = gf256mat_inv(mat_l2, mat_l2, O2);
+        gf256_add(mat_l2, b->mat_l2_F3, O2 * O2);
 
         // Solve l2 eqs
-        gfmat_prod_native(x_o2, mat_l2, O2, O2, temp_o);
+        succ = gf256mat_solve_36(x_o2, mat_l2, temp_o);
 
         attempts++;
     };
@@ -230,14 +354,14 @@ int rainbow_sign(uint8_t *signature, const sk_t *sk, const uint8_t *_digest)
     gfmat_prod_native(y, _sk->t3, O1, O2, x_o2);
     gf256_add(&w[V1], y, O1);
 
-    prng_clear(&prng_sign);
-    secure_clean(mat_l1, sizeof(mat_l1));
+    // A signature that fails the fault check is treated as a failed attempt
+    if((MAX_ATTEMPT_FRMAT > attempts) &&
+       _sk->fault_check &&
+       !fault_check(w, _z, _sk, b, mat_l2)) {
+        attempts = MAX_ATTEMPT_FRMAT;
+    }
+
     secure_clean(mat_l2, sizeof(mat_l2));
-    secure_clean(vinegar, sizeof(vinegar));
-    secure_clean(r_l1_F1, sizeof(r_l1_F1));
-    secure_clean(r_l2_F1, sizeof(r_l2_F1));
-    secure_clean(mat_l2_F3, sizeof(mat_l2_F3));
-    secure_clean(mat_l2_F2, sizeof(mat_l2_F2));
     secure_clean(_z, sizeof(_z));
     secure_clean(y, sizeof(y));
     secure_clean(x_o1, sizeof(x_o1));
@@ -259,3 +383,385 @@ int rainbow_sign(uint8_t *signature, const sk_t *sk, const uint8_t *_digest)
 
     return 0;
 }
+
+// |prng_sign| must be initialized with setup_prng. |team| is as in
+// bundle_compute. |b| is scratch memory, it is zeroized on return.
+_INLINE_ int sign_internal(OUT uint8_t *signature,
+                           IN OUT prng_t *prng_sign,
+                           IN const sk_maps_t *_sk,
+                           IN rainbow_team_t *team,
+                           OUT vinegar_bundle_t *b,
+                           IN const uint8_t *_digest)
+{
+    bundle_compute(b, prng_sign, _sk, team);
+    const int ret = sign_with_bundle(signature, prng_sign, _sk, b, _digest);
+
+    prng_clear(prng_sign);
+    secure_clean((uint8_t *)b, sizeof(*b));
+
+    return ret;
+}
+
+// The batched form of vinegar_bundle_compute for MAT_BATCH signatures. The
+// first vinegar of every signature is rolled and the secret key matrices are
+// multiplied by the MAT_BATCH vinegars together. A signature whose layer 1
+// system is singular rolls again alone, as in roll_vinegars, so the bundles
+// are identical to the ones of vinegar_bundle_compute.
+_INLINE_ void vinegar_bundles_compute(OUT vinegar_bundle_t b[MAT_BATCH],
+                                      IN OUT prng_t prng[MAT_BATCH],
+                                      IN const sk_t *_sk)
+{
+    uint8_t *      mat_l1[MAT_BATCH];
+    uint8_t *      r_l1_F1[MAT_BATCH];
+    uint8_t *      r_l2_F1[MAT_BATCH];
+    uint8_t *      mat_l2_F3[MAT_BATCH];
+    uint8_t *      mat_l2_F2[MAT_BATCH];
+    const uint8_t *vinegar[MAT_BATCH];
+
+    for(size_t k = 0; k < MAT_BATCH; k++) {
+        gen_vinegar(&prng[k], b[k].vinegar);
+        vinegar[k]   = b[k].vinegar;
+        mat_l1[k]    = b[k].mat_l1_sys;
+        r_l1_F1[k]   = b[k].r_l1_F1;
+        r_l2_F1[k]   = b[k].r_l2_F1;
+        mat_l2_F3[k] = b[k].mat_l2_F3;
+        mat_l2_F2[k] = b[k].mat_l2_F2;
+    }
+
+    gfmat_prod_native_batch(mat_l1, _sk->l1_F2, O1 * O1, V1, vinegar);
+
+    for(size_t k = 0; k < MAT_BATCH; k++) {
+        b[k].attempts = 1;
+        if(!gf256mat_inv_36(b[k].mat_l1, b[k].mat_l1_sys)) {
+            b[k].attempts += roll_vinegars(&prng[k], b[k].vinegar, b[k].mat_l1,
+                                           b[k].mat_l1_sys, _sk);
+        }
+    }
+
+    multab_trimat_36_batch(r_l1_F1, _sk->l1_F1, vinegar, V1);
+    multab_trimat_36_batch(r_l2_F1, _sk->l2_F1, vinegar, V1);
+    gfmat_prod_native_batch(mat_l2_F3, _sk->l2_F3, O2 * O2, V1, vinegar);
+    gfmat_prod_native_batch(mat_l2_F2, _sk->l2_F2, O1 * O2, V1, vinegar);
+}
+
+// Signs the |n| digests in groups of MAT_BATCH. An incomplete group is padded
+// with the last digest, and the padding signatures are discarded.
+// |_sk| must be in the internal field representation, |sk| is the original key
+// (its sk_seed seeds the prngs).
+_INLINE_ int sign_batch_internal(OUT uint8_t *const sigs[],
+                                 IN const sk_t *sk,
+                                 IN const sk_t *_sk,
+                                 IN const uint8_t *const digests[],
+                                 IN const size_t         n)
+{
+    vinegar_bundle_t b[MAT_BATCH];
+    prng_t           prng[MAT_BATCH];
+    sk_maps_t        m;
+    int              ret = 0;
+
+    sk_maps_of_sk(&m, _sk);
+
+    for(size_t i = 0; i < n; i += MAT_BATCH) {
+        const size_t cnt = ((n - i) < MAT_BATCH) ? (n - i) : MAT_BATCH;
+
+        for(size_t k = 0; k < MAT_BATCH; k++) {
+            setup_prng(&prng[k], sk->sk_seed,
+                       digests[i + ((k < cnt) ? k : (cnt - 1))]);
+        }
+
+        vinegar_bundles_compute(b, prng, _sk);
+
+        for(size_t k = 0; k < cnt; k++) {
+            ret |= sign_with_bundle(sigs[i + k], &prng[k], &m, &b[k],
+                                    digests[i + k]);
+        }
+
+        for(size_t k = 0; k < MAT_BATCH; k++) {
+            prng_clear(&prng[k]);
+        }
+    }
+
+    secure_clean((uint8_t *)b, sizeof(b));
+
+    return ret;
+}
+
+int rainbow_sign(uint8_t *signature, const sk_t *sk, const uint8_t *_digest)
+{
+    prng_t    prng_sign;
+    sk_maps_t m;
+
+    // Must set the prng before converting to the GFNI because the original
+    // sk->sk_seed should be used.
+    setup_prng(&prng_sign, sk->sk_seed, _digest);
+
+    vinegar_bundle_t b;
+
+#ifdef USE_AES_FIELD
+    sk_maps_of_sk(&m, sk);
+    return sign_internal(signature, &prng_sign, &m, NULL, &b, _digest);
+#else
+    sk_t sk_tmp;
+    to_gfni((uint8_t *)&sk_tmp, (const uint8_t *)sk, sizeof(*sk));
+
+    sk_maps_of_sk(&m, &sk_tmp);
+    return sign_internal(signature, &prng_sign, &m, NULL, &b, _digest);
+#endif // USE_AES_FIELD
+}
+
+// The workspace of rainbow_sign_ws holds everything that rainbow_sign keeps
+// on the stack.
+typedef struct sign_ws_st {
+#ifndef USE_AES_FIELD
+    ALIGN(64) sk_t _sk; // The key in the internal field representation
+#endif
+    ALIGN(64) vinegar_bundle_t b;
+} sign_ws_t;
+
+size_t rainbow_workspace_size(void) { return sizeof(sign_ws_t); }
+
+// Returns the fault check mode of sk_maps_t for the API |mode|
+_INLINE_ uint32_t fault_check_mode(IN const int mode)
+{
+    if(RAINBOW_FAULT_CHECK_OFF == mode) {
+        return RAINBOW_FAULT_CHECK_OFF;
+    }
+
+    return (RAINBOW_FAULT_CHECK_FULL == mode) ? RAINBOW_FAULT_CHECK_FULL
+                                              : RAINBOW_FAULT_CHECK;
+}
+
+_INLINE_ int sign_ws(OUT uint8_t *signature,
+                     IN const sk_t *sk,
+                     IN const uint8_t *_digest,
+                     IN OUT void *ws,
+                     IN const uint32_t fault_check)
+{
+    sign_ws_t *w = ws;
+    prng_t     prng_sign;
+    sk_maps_t  m;
+
+    setup_prng(&prng_sign, sk->sk_seed, _digest);
+
+#ifdef USE_AES_FIELD
+    sk_maps_of_sk(&m, sk);
+    m.fault_check = fault_check;
+    return sign_internal(signature, &prng_sign, &m, NULL, &w->b, _digest);
+#else
+    to_gfni((uint8_t *)&w->_sk, (const uint8_t *)sk, sizeof(*sk));
+
+    sk_maps_of_sk(&m, &w->_sk);
+    m.fault_check = fault_check;
+    const int ret =
+        sign_internal(signature, &prng_sign, &m, NULL, &w->b, _digest);
+
+    secure_clean((uint8_t *)&w->_sk, sizeof(w->_sk));
+    return ret;
+#endif // USE_AES_FIELD
+}
+
+int rainbow_sign_ws(OUT uint8_t *signature,
+                    IN const sk_t *sk,
+                    IN const uint8_t *_digest,
+                    IN OUT void *ws)
+{
+    return sign_ws(signature, sk, _digest, ws, RAINBOW_FAULT_CHECK_OFF);
+}
+
+int rainbow_sign_ws_checked(OUT uint8_t *signature,
+                            IN const sk_t *sk,
+                            IN const uint8_t *_digest,
+                            IN OUT void *ws,
+                            IN const int mode)
+{
+    return sign_ws(signature, sk, _digest, ws, fault_check_mode(mode));
+}
+
+void sk_maps_of_sk(OUT sk_maps_t *m, IN const sk_t *_sk)
+{
+    m->s1    = _sk->s1;
+    m->t1    = _sk->t1;
+    m->t4    = _sk->t4;
+    m->t3    = _sk->t3;
+    m->l2_F3 = _sk->l2_F3;
+    m->l2_F5 = _sk->l2_F5;
+    m->l2_F6 = _sk->l2_F6;
+    m->sk    = _sk;
+    m->ilv   = NULL;
+
+    m->fault_check = RAINBOW_FAULT_CHECK_OFF;
+}
+
+void sk_maps_of_prepared(OUT sk_maps_t *m, IN const rainbow_sk_prepared_t *psk)
+{
+    m->s1    = psk->s1;
+    m->t1    = psk->t1;
+    m->t4    = psk->t4;
+    m->t3    = psk->t3;
+    m->l2_F3 = psk->l2_F3;
+    m->l2_F5 = psk->l2_F5;
+    m->l2_F6 = psk->l2_F6;
+    m->sk    = NULL;
+    m->ilv   = &psk->ilv;
+
+    m->fault_check = psk->fault_check;
+}
+
+// Copies a part of a key to the internal field representation
+_INLINE_ void
+part_to_internal(OUT uint8_t *out, IN const uint8_t *in, IN const size_t len)
+{
+#ifdef USE_AES_FIELD
+    memcpy(out, in, len);
+#else
+    to_gfni(out, in, len);
+#endif
+}
+
+// Copies a part of a key from the internal field representation
+_INLINE_ void
+part_from_internal(OUT uint8_t *out, IN const uint8_t *in, IN const size_t len)
+{
+#ifdef USE_AES_FIELD
+    memcpy(out, in, len);
+#else
+    from_gfni(out, in, len);
+#endif
+}
+
+// Copies the F1 and F2 maps of |sk| into the interleaved layout
+_INLINE_ void sk_interleave(OUT sk_interleaved_t *ilv, IN const sk_t *sk)
+{
+    for(size_t e = 0; e < N_TRIANGLE_TERMS(V1); e++) {
+        memcpy(&ilv->F1[e][0], &sk->l1_F1[e * O1], O1);
+        memcpy(&ilv->F1[e][O1], &sk->l2_F1[e * O2], O2);
+    }
+
+    for(size_t e = 0; e < V1 * O1; e++) {
+        memcpy(&ilv->F2[e][0], &sk->l1_F2[e * O1], O1);
+        memcpy(&ilv->F2[e][O1], &sk->l2_F2[e * O2], O2);
+    }
+}
+
+_INLINE_ void sk_deinterleave(OUT sk_t *sk, IN const sk_interleaved_t *ilv)
+{
+    for(size_t e = 0; e < N_TRIANGLE_TERMS(V1); e++) {
+        memcpy(&sk->l1_F1[e * O1], &ilv->F1[e][0], O1);
+        memcpy(&sk->l2_F1[e * O2], &ilv->F1[e][O1], O2);
+    }
+
+    for(size_t e = 0; e < V1 * O1; e++) {
+        memcpy(&sk->l1_F2[e * O1], &ilv->F2[e][0], O1);
+        memcpy(&sk->l2_F2[e * O2], &ilv->F2[e][O1], O2);
+    }
+}
+
+rainbow_sk_prepared_t *rainbow_sk_prepare(IN const sk_t *sk)
+{
+    rainbow_sk_prepared_t *psk = aligned_malloc(sizeof(*psk));
+    if(NULL == psk) {
+        return NULL;
+    }
+
+    // The seed is not a field element. It is only used to seed the prng and
+    // therefore is kept in its original form.
+    memcpy(psk->sk_seed, sk->sk_seed, sizeof(psk->sk_seed));
+
+    part_to_internal(psk->s1, sk->s1, sizeof(psk->s1));
+    part_to_internal(psk->t1, sk->t1, sizeof(psk->t1));
+    part_to_internal(psk->t4, sk->t4, sizeof(psk->t4));
+    part_to_internal(psk->t3, sk->t3, sizeof(psk->t3));
+    part_to_internal(psk->l2_F3, sk->l2_F3, sizeof(psk->l2_F3));
+    part_to_internal(psk->l2_F5, sk->l2_F5, sizeof(psk->l2_F5));
+    part_to_internal(psk->l2_F6, sk->l2_F6, sizeof(psk->l2_F6));
+
+    // The conversion is per element, so it is applied after the interleaving
+    sk_interleave(&psk->ilv, sk);
+    part_to_internal((uint8_t *)&psk->ilv, (const uint8_t *)&psk->ilv,
+                     sizeof(psk->ilv));
+
+    psk->fault_check = RAINBOW_FAULT_CHECK_OFF;
+
+    return psk;
+}
+
+void rainbow_sk_export(OUT sk_t *sk, IN const rainbow_sk_prepared_t *psk)
+{
+    memcpy(sk->sk_seed, psk->sk_seed, sizeof(sk->sk_seed));
+
+    part_from_internal(sk->s1, psk->s1, sizeof(sk->s1));
+    part_from_internal(sk->t1, psk->t1, sizeof(sk->t1));
+    part_from_internal(sk->t4, psk->t4, sizeof(sk->t4));
+    part_from_internal(sk->t3, psk->t3, sizeof(sk->t3));
+    part_from_internal(sk->l2_F3, psk->l2_F3, sizeof(sk->l2_F3));
+    part_from_internal(sk->l2_F5, psk->l2_F5, sizeof(sk->l2_F5));
+    part_from_internal(sk->l2_F6, psk->l2_F6, sizeof(sk->l2_F6));
+
+    sk_deinterleave(sk, &psk->ilv);
+    part_from_internal(sk->l1_F1, sk->l1_F1, sizeof(sk->l1_F1));
+    part_from_internal(sk->l1_F2, sk->l1_F2, sizeof(sk->l1_F2));
+    part_from_internal(sk->l2_F1, sk->l2_F1, sizeof(sk->l2_F1));
+    part_from_internal(sk->l2_F2, sk->l2_F2, sizeof(sk->l2_F2));
+}
+
+void rainbow_sk_release(IN rainbow_sk_prepared_t *psk)
+{
+    aligned_secure_free(psk, sizeof(*psk));
+}
+
+void rainbow_sk_set_fault_check(IN OUT rainbow_sk_prepared_t *psk,
+                                IN const int            mode)
+{
+    psk->fault_check = fault_check_mode(mode);
+}
+
+int rainbow_sign_prepared(OUT uint8_t *signature,
+                          IN const rainbow_sk_prepared_t *psk,
+                          IN const uint8_t *_digest)
+{
+    prng_t           prng_sign;
+    vinegar_bundle_t b;
+    sk_maps_t        m;
+
+    setup_prng(&prng_sign, psk->sk_seed, _digest);
+    sk_maps_of_prepared(&m, psk);
+
+    return sign_internal(signature, &prng_sign, &m, NULL, &b, _digest);
+}
+
+int rainbow_sign_prepared_team(OUT uint8_t *signature,
+                               IN const rainbow_sk_prepared_t *psk,
+                               IN const uint8_t *_digest,
+                               IN rainbow_team_t *team)
+{
+    prng_t           prng_sign;
+    vinegar_bundle_t b;
+    sk_maps_t        m;
+
+    setup_prng(&prng_sign, psk->sk_seed, _digest);
+    sk_maps_of_prepared(&m, psk);
+
+    return sign_internal(signature, &prng_sign, &m, team, &b, _digest);
+}
+
+int rainbow_sign_batch(OUT uint8_t *const sigs[],
+                       IN const sk_t *sk,
+                       IN const uint8_t *const digests[],
+                       IN const size_t         n)
+{
+#ifdef USE_AES_FIELD
+    return sign_batch_internal(sigs, sk, sk, digests, n);
+#else
+    sk_t *sk_tmp = aligned_malloc(sizeof(*sk_tmp));
+    if(NULL == sk_tmp) {
+        return -1;
+    }
+
+    to_gfni((uint8_t *)sk_tmp, (const uint8_t *)sk, sizeof(*sk_tmp));
+
+    const int ret = sign_batch_internal(sigs, sk, sk_tmp, digests, n);
+
+    aligned_secure_free(sk_tmp, sizeof(*sk_tmp));
+    return ret;
+#endif // USE_AES_FIELD
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2020 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ * The license is detailed in the file LICENSE.md, and applies to this file.
+ *
+ * The code was written by Nir Drucker and Shay Gueron
+ * AWS Cryptographic Algorithms Group.
+ * (ndrucker@amazon.com, gueron@amazon.com)
+ */
+
+#pragma once
+
+#include "api.h"
+#include "prepared.h"
+#include "rainbow_config.h"
+#include "utils_prng.h"
+
+EXTERNC_BEGIN
+
+// The secret key maps that signing reads, in the internal field
+// representation. They point either into an sk_t, or into a prepared key,
+// which holds the F1 and F2 maps of both layers only in the layout |ilv|.
+typedef struct sk_maps_st {
+    const uint8_t *s1;
+    const uint8_t *t1;
+    const uint8_t *t4;
+    const uint8_t *t3;
+    const uint8_t *l2_F3;
+    const uint8_t *l2_F5;
+    const uint8_t *l2_F6;
+
+    // Exactly one of them is not NULL
+    const sk_t *            sk;
+    const sk_interleaved_t *ilv;
+
+    // The fault check mode of the signatures (see rainbow_sk_set_fault_check)
+    uint32_t fault_check;
+} sk_maps_t;
+
+// Sets |m| to the maps of |_sk| (without the fault check) or of |psk| (with
+// the fault check setting of |psk|).
+void sk_maps_of_sk(OUT sk_maps_t *m, IN const sk_t *_sk);
+void sk_maps_of_prepared(OUT sk_maps_t *m, IN const rainbow_sk_prepared_t *psk);
+
+// Everything in a signature that depends only on the vinegar (and not on the
+// message). All the field elements are in the internal field representation.
+typedef struct vinegar_bundle_st {
+    ALIGN(32) uint8_t vinegar[V1];
+    uint8_t mat_l1[O1 * O1];     // The inverse of the layer 1 linear system
+    uint8_t mat_l1_sys[O1 * O1]; // The layer 1 linear system, before inversion
+    uint8_t r_l1_F1[O1];
+    uint8_t r_l2_F1[O2];
+    uint8_t mat_l2_F3[O2 * O2];
+    uint8_t mat_l2_F2[O1 * O2];
+
+    // The number of vinegar rolls, counted against the signing attempts limit
+    uint32_t attempts;
+} vinegar_bundle_t;
+
+// Rolls the vinegar from |prng| until the layer 1 system is invertible and
+// computes the rest of the bundle.
+void vinegar_bundle_compute(OUT vinegar_bundle_t *b,
+                            IN OUT prng_t *prng,
+                            IN const sk_maps_t *_sk);
+
+// Completes a signature of |_digest| with the bundle |b|. The salts are drawn
+// from |prng|. Returns 0 on success. When the fault check of |_sk| is enabled,
+// a signature that fails it is not released.
+int sign_with_bundle(OUT uint8_t *signature,
+                     IN OUT prng_t *prng,
+                     IN const sk_maps_t *_sk,
+                     IN const vinegar_bundle_t *b,
+                     IN const uint8_t *_digest);
+
+EXTERNC_END
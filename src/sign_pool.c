@@ -0,0 +1,288 @@
+/*
+ * Copyright 2020 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ * The license is detailed in the file LICENSE.md, and applies to this file.
+ *
+ * The code was written by Nir Drucker and Shay Gueron
+ * AWS Cryptographic Algorithms Group.
+ * (ndrucker@amazon.com, gueron@amazon.com)
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/random.h>
+
+#include "api.h"
+#include "prepared.h"
+#include "sign_internal.h"
+#include "utils_mem.h"
+#include "utils_prng.h"
+
+// The number of bundles a worker computes before it reseeds its DRBG.
+#define POOL_RESEED_INTERVAL (1024)
+
+// A vinegar bundle and the seed of the prng that rolls its salts.
+typedef struct pool_bundle_st {
+    vinegar_bundle_t b;
+    uint8_t          salt_seed[HASH_BYTE_LEN];
+} pool_bundle_t;
+
+// |bundles| is a stack of |count| ready bundles. The workers sleep until
+// |count| drops to |low_watermark|, and then refill the pool up to |depth|.
+// Every worker takes one of the |prngs|, which are seeded before the workers
+// start.
+struct rainbow_sign_pool_st {
+    sk_maps_t maps; // The maps of the prepared key
+
+    prng_t *prngs;
+    size_t  n_prngs;
+    size_t  n_running;
+    int     reseed_failed;
+
+    pool_bundle_t *bundles;
+    size_t         depth;
+    size_t         low_watermark;
+    size_t         count;
+    size_t         in_progress;
+    uint32_t       refilling;
+    uint32_t       stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    pthread_t *     workers;
+    size_t          n_workers;
+};
+
+// Seeds |prng| with fresh entropy from the OS.
+_INLINE_ int prng_set_fresh(OUT prng_t *prng)
+{
+    uint8_t seed[HASH_BYTE_LEN];
+
+    if((ssize_t)sizeof(seed) != getrandom(seed, sizeof(seed), 0)) {
+        return ERROR;
+    }
+
+    prng_set(prng, seed, sizeof(seed));
+    secure_clean(seed, sizeof(seed));
+
+    return SUCCESS;
+}
+
+_INLINE_ void pool_bundle_compute(OUT pool_bundle_t *pb,
+                                  IN OUT prng_t *prng,
+                                  IN const sk_maps_t *maps)
+{
+    vinegar_bundle_compute(&pb->b, prng, maps);
+    prng_gen(prng, pb->salt_seed, sizeof(pb->salt_seed));
+}
+
+_INLINE_ void *pool_worker(IN OUT void *arg)
+{
+    rainbow_sign_pool_t *pool = arg;
+    pool_bundle_t        pb;
+    size_t               generated = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    prng_t *prng = &pool->prngs[pool->n_running++];
+    while(!pool->stop) {
+        if(!pool->refilling ||
+           ((pool->count + pool->in_progress) >= pool->depth)) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
+
+        pool->in_progress++;
+        pthread_mutex_unlock(&pool->lock);
+
+        // A worker that cannot reseed its DRBG stops, rather than use the same
+        // stream for more than POOL_RESEED_INTERVAL bundles.
+        if(POOL_RESEED_INTERVAL == generated) {
+            if(SUCCESS != prng_set_fresh(prng)) {
+                pthread_mutex_lock(&pool->lock);
+                pool->in_progress--;
+                pool->reseed_failed = 1;
+                break;
+            }
+            generated = 0;
+        }
+        pool_bundle_compute(&pb, prng, &pool->maps);
+        generated++;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->in_progress--;
+        memcpy(&pool->bundles[pool->count], &pb, sizeof(pb));
+        secure_clean((uint8_t *)&pb, sizeof(pb));
+        pool->count++;
+        if(pool->depth == pool->count) {
+            pool->refilling = 0;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    prng_clear(prng);
+
+    return NULL;
+}
+
+rainbow_sign_pool_t *rainbow_sign_pool_create(IN const rainbow_sk_prepared_t *psk,
+                                              IN const size_t depth,
+                                              IN const size_t low_watermark,
+                                              IN const size_t n_threads)
+{
+    if((0 == depth) || (low_watermark > depth) || (0 == n_threads)) {
+        return NULL;
+    }
+
+    // The sizes of the arrays below must not overflow
+    if((depth > (SIZE_MAX / sizeof(pool_bundle_t))) ||
+       (n_threads > (SIZE_MAX / sizeof(prng_t))) ||
+       (n_threads > (SIZE_MAX / sizeof(pthread_t)))) {
+        return NULL;
+    }
+
+    rainbow_sign_pool_t *pool = aligned_malloc(sizeof(*pool));
+    if(NULL == pool) {
+        return NULL;
+    }
+
+    memset(pool, 0, sizeof(*pool));
+    sk_maps_of_prepared(&pool->maps, psk);
+    pool->depth         = depth;
+    pool->low_watermark = low_watermark;
+    pool->refilling     = 1;
+
+    pool->bundles = aligned_malloc(depth * sizeof(pool_bundle_t));
+    pool->workers = malloc(n_threads * sizeof(pthread_t));
+    pool->prngs   = aligned_malloc(n_threads * sizeof(prng_t));
+    if((NULL == pool->bundles) || (NULL == pool->workers) ||
+       (NULL == pool->prngs)) {
+        goto err;
+    }
+
+    // A pool is not started with fewer workers than requested
+    for(; pool->n_prngs < n_threads; pool->n_prngs++) {
+        if(SUCCESS != prng_set_fresh(&pool->prngs[pool->n_prngs])) {
+            goto err;
+        }
+    }
+
+    if(0 != pthread_mutex_init(&pool->lock, NULL)) {
+        goto err;
+    }
+    if(0 != pthread_cond_init(&pool->cond, NULL)) {
+        pthread_mutex_destroy(&pool->lock);
+        goto err;
+    }
+
+    for(; pool->n_workers < n_threads; pool->n_workers++) {
+        if(0 != pthread_create(&pool->workers[pool->n_workers], NULL, pool_worker,
+                               pool)) {
+            rainbow_sign_pool_release(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+
+err:
+    aligned_secure_free(pool->prngs, n_threads * sizeof(prng_t));
+    aligned_free(pool->bundles);
+    free(pool->workers);
+    aligned_free(pool);
+    return NULL;
+}
+
+void rainbow_sign_pool_release(IN rainbow_sign_pool_t *pool)
+{
+    if(NULL == pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(size_t i = 0; i < pool->n_workers; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+
+    aligned_secure_free(pool->bundles, pool->depth * sizeof(pool_bundle_t));
+    aligned_secure_free(pool->prngs, pool->n_prngs * sizeof(prng_t));
+    free(pool->workers);
+    aligned_free(pool);
+}
+
+size_t rainbow_sign_pool_available(IN rainbow_sign_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    const size_t count = pool->count;
+    pthread_mutex_unlock(&pool->lock);
+
+    return count;
+}
+
+int rainbow_sign_pool_status(IN rainbow_sign_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    const int failed = pool->reseed_failed;
+    pthread_mutex_unlock(&pool->lock);
+
+    return failed ? ERROR : SUCCESS;
+}
+
+int rainbow_sign_online(OUT uint8_t *signature,
+                        IN rainbow_sign_pool_t *pool,
+                        IN const uint8_t *_digest)
+{
+    pool_bundle_t pb;
+    prng_t        prng;
+    uint32_t      taken = 0;
+
+    // Take a bundle, and zeroize its slot so it cannot be used again.
+    pthread_mutex_lock(&pool->lock);
+    if(pool->count > 0) {
+        pool->count--;
+        memcpy(&pb, &pool->bundles[pool->count], sizeof(pb));
+        secure_clean((uint8_t *)&pool->bundles[pool->count], sizeof(pb));
+        taken = 1;
+    }
+    if((pool->count <= pool->low_watermark) && !pool->refilling) {
+        pool->refilling = 1;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    // The pool is empty, compute the bundle here.
+    if(!taken) {
+        if(SUCCESS != prng_set_fresh(&prng)) {
+            memset(signature, 0, SIG_BYTE_LEN);
+            return ERROR;
+        }
+        pool_bundle_compute(&pb, &prng, &pool->maps);
+        prng_clear(&prng);
+    }
+
+    prng_set(&prng, pb.salt_seed, sizeof(pb.salt_seed));
+    const int ret =
+        sign_with_bundle(signature, &prng, &pool->maps, &pb.b, _digest);
+
+    prng_clear(&prng);
+    secure_clean((uint8_t *)&pb, sizeof(pb));
+
+    return ret;
+}
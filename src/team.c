@@ -0,0 +1,295 @@
+/*
+ * Copyright 2020 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ * The license is detailed in the file LICENSE.md, and applies to this file.
+ *
+ * The code was written by Nir Drucker and Shay Gueron
+ * AWS Cryptographic Algorithms Group.
+ * (ndrucker@amazon.com, gueron@amazon.com)
+ */
+
+// For pthread_attr_setaffinity_np, sched_getaffinity and syscall
+#define _GNU_SOURCE
+
+#include <immintrin.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "api.h"
+#include "team.h"
+#include "utils_mem.h"
+
+// The number of pause iterations a thread spins on a flag before it sleeps
+// on the futex. A handoff within one job takes far less than that.
+#define TEAM_SPIN_ITERS (2048)
+
+// |seq| is incremented for every job, and the helpers run the job of the
+// last |seq| they observed. |done| counts the helpers that finished the
+// current job. A thread that sleeps on one of them first increments the
+// respective |*_sleepers|, so the other side only calls futex_wake when needed.
+struct rainbow_team_st {
+    ALIGN(64) uint32_t seq;
+    uint32_t           seq_sleepers;
+    uint32_t           stop;
+
+    team_fn_t fn;
+    void *    ctx;
+    size_t    n_parts;
+
+    ALIGN(64) uint32_t done;
+    uint32_t           done_sleepers;
+
+    pthread_t *threads;
+    // The helpers that run, not more than the other online CPUs
+    size_t     n_helpers;
+    size_t     n_started;
+    size_t     spin_iters;
+    int        first_cpu;
+};
+
+typedef struct helper_arg_st {
+    rainbow_team_t *team;
+    size_t          id;
+} helper_arg_t;
+
+_INLINE_ uint32_t load_acquire(IN const uint32_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+_INLINE_ void futex_wait(IN uint32_t *p, IN const uint32_t val)
+{
+    syscall(SYS_futex, p, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+_INLINE_ void futex_wake(IN uint32_t *p)
+{
+    syscall(SYS_futex, p, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Waits until *p != val. Spins first, and then sleeps on the futex.
+_INLINE_ void wait_change(IN const rainbow_team_t *team,
+                          IN uint32_t *p,
+                          IN uint32_t *sleepers,
+                          IN const uint32_t val)
+{
+    for(size_t i = 0; i < team->spin_iters; i++) {
+        if(load_acquire(p) != val) {
+            return;
+        }
+        _mm_pause();
+    }
+
+    __atomic_fetch_add(sleepers, 1, __ATOMIC_SEQ_CST);
+    while(load_acquire(p) == val) {
+        futex_wait(p, val);
+    }
+    __atomic_fetch_sub(sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+// Wakes the sleepers on |p| after it was changed.
+_INLINE_ void notify(IN uint32_t *p, IN const uint32_t *sleepers)
+{
+    if(0 != __atomic_load_n(sleepers, __ATOMIC_SEQ_CST)) {
+        futex_wake(p);
+    }
+}
+
+// Worker |w| of the |n_workers| runs the parts w, w + n_workers, ...
+_INLINE_ void run_parts(IN const rainbow_team_t *team,
+                        IN const size_t w,
+                        IN const size_t n_workers)
+{
+    for(size_t part = w; part < team->n_parts; part += n_workers) {
+        team->fn(team->ctx, part);
+    }
+}
+
+_INLINE_ void *helper(IN OUT void *varg)
+{
+    helper_arg_t *  arg  = varg;
+    rainbow_team_t *team = arg->team;
+    const size_t    id   = arg->id;
+    uint32_t        seq  = 0;
+
+    free(arg);
+
+    while(1) {
+        wait_change(team, &team->seq, &team->seq_sleepers, seq);
+        seq = load_acquire(&team->seq);
+        if(__atomic_load_n(&team->stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        // The caller is worker 0
+        run_parts(team, id + 1, team->n_helpers + 1);
+
+        __atomic_fetch_add(&team->done, 1, __ATOMIC_RELEASE);
+        notify(&team->done, &team->done_sleepers);
+    }
+
+    return NULL;
+}
+
+void team_run(IN rainbow_team_t *team,
+              IN team_fn_t fn,
+              IN void *ctx,
+              IN size_t n_parts)
+{
+    team->fn      = fn;
+    team->ctx     = ctx;
+    team->n_parts = n_parts;
+
+    if(0 == team->n_helpers) {
+        run_parts(team, 0, 1);
+        return;
+    }
+
+    __atomic_store_n(&team->done, 0, __ATOMIC_RELAXED);
+
+    // Publish the job
+    __atomic_fetch_add(&team->seq, 1, __ATOMIC_SEQ_CST);
+    notify(&team->seq, &team->seq_sleepers);
+
+    run_parts(team, 0, team->n_helpers + 1);
+
+    uint32_t done;
+    while((done = load_acquire(&team->done)) != team->n_helpers) {
+        wait_change(team, &team->done, &team->done_sleepers, done);
+    }
+}
+
+// Starts helper |team->n_started|, pinned if |team->first_cpu| is not negative
+_INLINE_ int start_helper(IN OUT rainbow_team_t *team)
+{
+    const size_t   id  = team->n_started;
+    pthread_attr_t attr;
+    int            ret = ERROR;
+
+    if(0 != pthread_attr_init(&attr)) {
+        return ERROR;
+    }
+
+    if(team->first_cpu >= 0) {
+        const size_t cpu = (size_t)team->first_cpu + id;
+        cpu_set_t    set;
+
+        CPU_ZERO(&set);
+        if(cpu >= CPU_SETSIZE) {
+            goto out;
+        }
+        CPU_SET(cpu, &set);
+        if(0 != pthread_attr_setaffinity_np(&attr, sizeof(set), &set)) {
+            goto out;
+        }
+    }
+
+    helper_arg_t *arg = malloc(sizeof(*arg));
+    if(NULL == arg) {
+        goto out;
+    }
+
+    arg->team = team;
+    arg->id   = id;
+    if(0 != pthread_create(&team->threads[id], &attr, helper, arg)) {
+        free(arg);
+        goto out;
+    }
+
+    team->n_started++;
+    ret = SUCCESS;
+
+out:
+    pthread_attr_destroy(&attr);
+    return ret;
+}
+
+size_t team_allowed_cpus(void)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    if(0 != sched_getaffinity(0, sizeof(set), &set)) {
+        return 0;
+    }
+
+    return (size_t)CPU_COUNT(&set);
+}
+
+rainbow_team_t *rainbow_team_create(IN const size_t n_helpers,
+                                    IN const int    first_cpu)
+{
+    rainbow_team_t *team = aligned_malloc(sizeof(*team));
+    if(NULL == team) {
+        return NULL;
+    }
+
+    memset(team, 0, sizeof(*team));
+    team->first_cpu = first_cpu;
+
+    // A helper without a CPU of its own only delays the thread that waits
+    // for it, so the caller runs its parts instead.
+    const size_t n_cpus = team_allowed_cpus();
+    team->n_helpers     = n_helpers;
+    if((n_cpus > 0) && (n_cpus <= n_helpers)) {
+        team->n_helpers = n_cpus - 1;
+    }
+    team->spin_iters = TEAM_SPIN_ITERS;
+
+    if(0 == team->n_helpers) {
+        return team;
+    }
+
+    team->threads = malloc(team->n_helpers * sizeof(pthread_t));
+    if(NULL == team->threads) {
+        aligned_free(team);
+        return NULL;
+    }
+
+    while(team->n_started < team->n_helpers) {
+        if(SUCCESS != start_helper(team)) {
+            rainbow_team_release(team);
+            return NULL;
+        }
+    }
+
+    return team;
+}
+
+size_t rainbow_team_size(IN const rainbow_team_t *team)
+{
+    return team->n_helpers;
+}
+
+void rainbow_team_release(IN rainbow_team_t *team)
+{
+    if(NULL == team) {
+        return;
+    }
+
+    __atomic_store_n(&team->stop, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&team->seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&team->seq);
+
+    for(size_t i = 0; i < team->n_started; i++) {
+        pthread_join(team->threads[i], NULL);
+    }
+
+    free(team->threads);
+    aligned_free(team);
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright 2020 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ * The license is detailed in the file LICENSE.md, and applies to this file.
+ *
+ * The code was written by Nir Drucker and Shay Gueron
+ * AWS Cryptographic Algorithms Group.
+ * (ndrucker@amazon.com, gueron@amazon.com)
+ */
+
+#pragma once
+
+#include "api.h"
+#include "defs.h"
+
+EXTERNC_BEGIN
+
+// A job of team_run. The parts of a job are independent.
+typedef void (*team_fn_t)(void *ctx, size_t part);
+
+// Runs fn(ctx, part) for part = 0, ..., n_parts - 1 on the caller and the
+// helpers of |team|, and returns when all the parts are done.
+void team_run(rainbow_team_t *team, team_fn_t fn, void *ctx, size_t n_parts);
+
+// Returns the number of CPUs the caller may run on, or 0 if it is unknown.
+// Unlike the online CPUs, this count respects the affinity mask (taskset,
+// cpusets), which is what extra threads are scheduled on.
+size_t team_allowed_cpus(void);
+
+EXTERNC_END
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2020 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ * The license is detailed in the file LICENSE.md, and applies to this file.
+ *
+ * Written by Nir Drucker and Shay Gueron
+ * AWS Cryptographic Algorithms Group.
+ * (ndrucker@amazon.com, gueron@amazon.com)
+ */
+
+#pragma once
+
+#include <mm_malloc.h>
+
+#include "defs.h"
+
+EXTERNC_BEGIN
+
+// Heap objects that are streamed by the ZMM kernels are aligned to a cache
+// line (and to a ZMM register).
+#define MEM_ALIGN (64)
+
+_INLINE_ void *aligned_malloc(IN const size_t size)
+{
+    return _mm_malloc(size, MEM_ALIGN);
+}
+
+_INLINE_ void aligned_free(IN void *p) { _mm_free(p); }
+
+// Zeroize |size| bytes before releasing the memory.
+_INLINE_ void aligned_secure_free(IN void *p, IN const size_t size)
+{
+    if(NULL == p) {
+        return;
+    }
+
+    secure_clean((uint8_t *)p, size);
+    _mm_free(p);
+}
+
+EXTERNC_END
@@ -21,46 +21,530 @@
  * (ndrucker@amazon.com, gueron@amazon.com)
  */
 
+// For posix_fadvise
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "api.h"
 #include "gfni.h"
+#include "prepared.h"
 #include "rainbow_config.h"
+#include "team.h"
 #include "utils_hash.h"
+#include "utils_mem.h"
 
-int rainbow_verify(IN const uint8_t *digest,
-                   IN const uint8_t *sig,
-                   IN const pk_t *pk)
+// Converts a signature to the internal field representation.
+_INLINE_ void sig_to_internal(OUT uint8_t *_sig, IN const uint8_t *sig)
 {
-    uint8_t digest_ck[PUB_M];
-
 #ifdef USE_AES_FIELD
-    const uint8_t *_sig = sig;
-    const pk_t *   _pk  = pk;
+    memcpy(_sig, sig, PUB_N);
 #else
-    uint8_t _sig[PUB_N];
-    pk_t    pk_tmp;
-    pk_t *  _pk = &pk_tmp;
-
-    to_gfni((uint8_t *)_pk, (const uint8_t *)pk, sizeof(*_pk));
-    to_gfni(_sig, sig, sizeof(_sig));
-#endif
-
-    mq_gf256_n140_m72(digest_ck, _pk->pk, _sig);
-
-#ifndef USE_AES_FIELD
-    from_gfni(digest_ck, digest_ck, PUB_M);
+    to_gfni(_sig, sig, PUB_N);
 #endif
+}
 
-    uint8_t       correct[PUB_M];
+// Computes H(digest||salt) into |correct| (PUB_M bytes).
+_INLINE_ void hash_digest_salt(OUT uint8_t *correct,
+                               IN const uint8_t *digest,
+                               IN const uint8_t *sig)
+{
     digest_salt_t ds;
     memcpy(ds.digest, digest, sizeof(ds.digest));
     memcpy(ds.salt, sig + PUB_N, sizeof(ds.salt));
 
     // H( digest || salt )
     hash_msg(correct, PUB_M, (uint8_t *)&ds, sizeof(ds));
+}
+
+// Converts |len| bytes of the evaluated public map |digest_ck| (in the internal
+// field representation) and compares them against |correct|.
+_INLINE_ int cmp_digest(IN OUT uint8_t *digest_ck,
+                        IN const uint8_t *correct,
+                        IN const size_t   len)
+{
+#ifndef USE_AES_FIELD
+    from_gfni(digest_ck, digest_ck, len);
+#endif
 
     // Check consistancy.
     uint8_t cc = 0;
-    for(size_t i = 0; i < PUB_M; i++) {
+    for(size_t i = 0; i < len; i++) {
         cc |= (digest_ck[i] ^ correct[i]);
     }
     return (0 == cc) ? 0 : -1;
 }
+
+// Converts the evaluated public map |digest_ck| (in the internal field
+// representation) and compares it against H(digest||salt).
+_INLINE_ int check_digest(IN OUT uint8_t *digest_ck,
+                          IN const uint8_t *digest,
+                          IN const uint8_t *sig)
+{
+    uint8_t correct[PUB_M];
+    hash_digest_salt(correct, digest, sig);
+
+    return cmp_digest(digest_ck, correct, PUB_M);
+}
+
+// Verifies with the early-reject layout: the first EARLY_EQS equations are
+// evaluated and compared first, and the signature is rejected on a mismatch.
+// |_sig| must be in the internal field representation.
+_INLINE_ int verify_early_reject(IN const uint8_t *digest,
+                                 IN const uint8_t *sig,
+                                 IN const uint8_t *_sig,
+                                 IN const pk_early_t *pk)
+{
+    ALIGN(64) uint8_t m[MONOMIALS_BYTES];
+    uint8_t           digest_ck[PUB_M];
+    uint8_t           correct[PUB_M];
+
+    hash_digest_salt(correct, digest, sig);
+
+    mq_gf256_n140_m72_early(digest_ck, m, pk->early[0], _sig);
+    if(0 != cmp_digest(digest_ck, correct, EARLY_EQS)) {
+        return -1;
+    }
+
+    mq_gf256_n140_m72_late(&digest_ck[EARLY_EQS], m, pk->late[0]);
+    return cmp_digest(&digest_ck[EARLY_EQS], &correct[EARLY_EQS], LATE_EQS);
+}
+
+// Evaluates the public map of a prepared key according to its layout.
+// |_sig| must be in the internal field representation.
+_INLINE_ void eval_prepared(OUT uint8_t *digest_ck,
+                            IN const rainbow_pk_prepared_t *ppk,
+                            IN const uint8_t *_sig)
+{
+    switch(ppk->layout) {
+        case RAINBOW_PK_LAYOUT_SPLIT:
+            mq_gf256_n140_m72_split(digest_ck, ppk->u.split.main[0],
+                                    ppk->u.split.tail[0], _sig);
+            break;
+        default:
+            mq_gf256_n140_m72_monomials(digest_ck, ppk->u.rows.pk, _sig);
+            break;
+    }
+}
+
+int rainbow_verify(IN const uint8_t *digest,
+                   IN const uint8_t *sig,
+                   IN const pk_t *pk)
+{
+    uint8_t digest_ck[PUB_M];
+    uint8_t _sig[PUB_N];
+
+    sig_to_internal(_sig, sig);
+
+#ifdef USE_AES_FIELD
+    mq_gf256_n140_m72(digest_ck, pk->pk, _sig);
+#else
+    // The public key is converted to the GFNI field while it is evaluated.
+    mq_gf256_n140_m72_to_gfni(digest_ck, pk->pk, _sig);
+#endif
+
+    return check_digest(digest_ck, digest, sig);
+}
+
+// Scatters the 72-byte rows of |pk| into the early and late planes of the
+// early-reject layout.
+_INLINE_ void pk_to_early(OUT pk_early_t *early, IN const pk_t *pk)
+{
+    const uint8_t *row = pk->pk;
+
+    memset(early, 0, sizeof(*early));
+    for(size_t t = 0; t < PUB_TERMS; t++, row += PUB_M) {
+        memcpy(&early->early[t / EARLY_TERMS][(t % EARLY_TERMS) * EARLY_EQS], row,
+               EARLY_EQS);
+        memcpy(early->late[t], &row[EARLY_EQS], LATE_EQS);
+    }
+}
+
+// Scatters the 72-byte rows of |pk| into a 64-byte main plane and a tail plane
+// that packs the last 8 bytes of 8 consecutive rows into one 64-byte line.
+_INLINE_ void pk_to_split(OUT pk_split_t *split, IN const pk_t *pk)
+{
+    const uint8_t *row = pk->pk;
+
+    memset(split->tail, 0, sizeof(split->tail));
+    for(size_t t = 0; t < PUB_TERMS; t++, row += PUB_M) {
+        memcpy(split->main[t], row, SPLIT_MAIN_BYTES);
+        memcpy(&split->tail[t / SPLIT_TAIL_TERMS]
+                           [(t % SPLIT_TAIL_TERMS) * SPLIT_TAIL_BYTES],
+               &row[SPLIT_MAIN_BYTES], SPLIT_TAIL_BYTES);
+    }
+}
+
+rainbow_pk_prepared_t *rainbow_pk_prepare_layout(IN const pk_t *pk,
+                                                 IN const rainbow_pk_layout_t layout)
+{
+    rainbow_pk_prepared_t *ppk = aligned_malloc(sizeof(*ppk));
+    if(NULL == ppk) {
+        return NULL;
+    }
+
+    if(SUCCESS != hash_msg(ppk->fingerprint, sizeof(ppk->fingerprint),
+                           (const uint8_t *)pk, sizeof(*pk))) {
+        aligned_free(ppk);
+        return NULL;
+    }
+
+    ppk->layout = layout;
+    switch(layout) {
+        case RAINBOW_PK_LAYOUT_SPLIT:
+            pk_to_split(&ppk->u.split, pk);
+            break;
+        case RAINBOW_PK_LAYOUT_EARLY_REJECT:
+            pk_to_early(&ppk->u.early, pk);
+            break;
+        default:
+            ppk->layout = RAINBOW_PK_LAYOUT_ROWS;
+            memcpy(&ppk->u.rows, pk, sizeof(ppk->u.rows));
+            break;
+    }
+
+#ifndef USE_AES_FIELD
+    to_gfni((uint8_t *)&ppk->u, (const uint8_t *)&ppk->u, sizeof(ppk->u));
+#endif
+
+    return ppk;
+}
+
+rainbow_pk_prepared_t *rainbow_pk_prepare(IN const pk_t *pk)
+{
+    return rainbow_pk_prepare_layout(pk, RAINBOW_PK_LAYOUT_ROWS);
+}
+
+void rainbow_pk_release(IN rainbow_pk_prepared_t *ppk) { aligned_free(ppk); }
+
+int rainbow_verify_prepared(IN const uint8_t *digest,
+                            IN const uint8_t *sig,
+                            IN const rainbow_pk_prepared_t *ppk)
+{
+    uint8_t digest_ck[PUB_M];
+    uint8_t _sig[PUB_N];
+
+    sig_to_internal(_sig, sig);
+
+    if(RAINBOW_PK_LAYOUT_EARLY_REJECT == ppk->layout) {
+        return verify_early_reject(digest, sig, _sig, &ppk->u.early);
+    }
+
+    eval_prepared(digest_ck, ppk, _sig);
+
+    return check_digest(digest_ck, digest, sig);
+}
+
+// Verifies |n| signatures one by one. Used for the layouts that the batch
+// kernels do not support.
+_INLINE_ int verify_prepared_loop(IN const rainbow_pk_prepared_t *const ppks[],
+                                  IN const size_t ppks_stride,
+                                  IN const uint8_t *const digests[],
+                                  IN const uint8_t *const sigs[],
+                                  IN const size_t         n,
+                                  OUT int                 results[])
+{
+    int ret = 0;
+    for(size_t i = 0; i < n; i++) {
+        results[i] =
+            rainbow_verify_prepared(digests[i], sigs[i], ppks[i * ppks_stride]);
+        ret |= results[i];
+    }
+    return ret;
+}
+
+int rainbow_verify_batch(IN const rainbow_pk_prepared_t *ppk,
+                         IN const uint8_t *const digests[],
+                         IN const uint8_t *const sigs[],
+                         IN const size_t         n,
+                         OUT int                 results[])
+{
+    uint8_t digest_ck[MQ_BATCH * PUB_M];
+    uint8_t _sig[MQ_BATCH * PUB_N];
+    int     ret = 0;
+
+    if(RAINBOW_PK_LAYOUT_ROWS != ppk->layout) {
+        return verify_prepared_loop(&ppk, 0, digests, sigs, n, results);
+    }
+
+    size_t i = 0;
+    for(; i < n; i += MQ_BATCH) {
+        const size_t cnt = ((n - i) < MQ_BATCH) ? (n - i) : MQ_BATCH;
+
+        // A batch costs about MQ_BATCH/2 single evaluations, so a short
+        // remainder is verified one signature at a time.
+        if(cnt <= (MQ_BATCH / 2)) {
+            break;
+        }
+
+        // An incomplete batch is padded with the last signature.
+        for(size_t k = 0; k < MQ_BATCH; k++) {
+            sig_to_internal(&_sig[k * PUB_N], sigs[i + ((k < cnt) ? k : (cnt - 1))]);
+        }
+
+        mq_gf256_n140_m72_monomials_batch(digest_ck, ppk->u.rows.pk, _sig);
+
+        for(size_t k = 0; k < cnt; k++) {
+            results[i + k] =
+                check_digest(&digest_ck[k * PUB_M], digests[i + k], sigs[i + k]);
+            ret |= results[i + k];
+        }
+    }
+
+    if(i < n) {
+        ret |= verify_prepared_loop(&ppk, 0, &digests[i], &sigs[i], n - i,
+                                    &results[i]);
+    }
+
+    return ret;
+}
+
+int rainbow_verify_multi(IN const rainbow_pk_prepared_t *const ppks[],
+                         IN const uint8_t *const               digests[],
+                         IN const uint8_t *const               sigs[],
+                         IN const size_t                       n,
+                         OUT int                               results[])
+{
+    uint8_t        digest_ck[MQ_MULTI * PUB_M];
+    uint8_t        _sig[MQ_MULTI * PUB_N];
+    const uint8_t *pk_mat[MQ_MULTI];
+    int            ret = 0;
+
+    for(size_t i = 0; i < n; i += MQ_MULTI) {
+        const size_t cnt = ((n - i) < MQ_MULTI) ? (n - i) : MQ_MULTI;
+
+        uint32_t rows_only = 1;
+        for(size_t k = 0; k < cnt; k++) {
+            rows_only &= (RAINBOW_PK_LAYOUT_ROWS == ppks[i + k]->layout);
+        }
+
+        if(!rows_only) {
+            ret |= verify_prepared_loop(&ppks[i], 1, &digests[i], &sigs[i], cnt,
+                                        &results[i]);
+            continue;
+        }
+
+        // An incomplete group is padded with the last item.
+        for(size_t k = 0; k < MQ_MULTI; k++) {
+            const size_t idx = i + ((k < cnt) ? k : (cnt - 1));
+            pk_mat[k]        = ppks[idx]->u.rows.pk;
+            sig_to_internal(&_sig[k * PUB_N], sigs[idx]);
+        }
+
+        mq_gf256_n140_m72_multi(digest_ck, pk_mat, _sig);
+
+        for(size_t k = 0; k < cnt; k++) {
+            results[i + k] =
+                check_digest(&digest_ck[k * PUB_M], digests[i + k], sigs[i + k]);
+            ret |= results[i + k];
+        }
+    }
+
+    return ret;
+}
+
+// The public key is streamed in chunks of STREAM_CHUNK_ROWS rows (~16KB). A
+// chunk read on the evaluating CPU is still in the L1 cache when it is
+// evaluated (64KB chunks are evicted by the copy, and cost ~30% more), and the
+// two chunk buffers stay well below the glibc mmap threshold. A multiple of 8
+// rows keeps the tails of the rows in whole groups.
+#define STREAM_CHUNK_ROWS  (224)
+#define STREAM_CHUNK_BYTES (STREAM_CHUNK_ROWS * PUB_M)
+#define STREAM_CHUNKS      ((PUB_TERMS + STREAM_CHUNK_ROWS - 1) / STREAM_CHUNK_ROWS)
+
+// Two chunk buffers: the reader thread fills one while the other is evaluated.
+typedef struct pk_stream_st {
+    rainbow_pk_read_cb read_cb;
+    void *             ctx;
+    int                pk_to_gfni;
+    uint8_t *          buf[2];
+    uint32_t           full[2];
+    int                err;
+    pthread_mutex_t    lock;
+    pthread_cond_t     cond;
+} pk_stream_t;
+
+// Waits until s->full[slot] == full, and returns the reader error.
+_INLINE_ int wait_slot(IN OUT pk_stream_t *s,
+                       IN const size_t slot,
+                       IN const uint32_t full)
+{
+    pthread_mutex_lock(&s->lock);
+    while(full != s->full[slot]) {
+        pthread_cond_wait(&s->cond, &s->lock);
+    }
+    const int err = s->err;
+    pthread_mutex_unlock(&s->lock);
+
+    return err;
+}
+
+_INLINE_ void set_slot(IN OUT pk_stream_t *s,
+                       IN const size_t slot,
+                       IN const uint32_t full,
+                       IN const int      err)
+{
+    pthread_mutex_lock(&s->lock);
+    s->full[slot] = full;
+    s->err |= err;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+_INLINE_ size_t chunk_rows(IN const size_t chunk)
+{
+    const size_t rem = PUB_TERMS - (chunk * STREAM_CHUNK_ROWS);
+    return (rem < STREAM_CHUNK_ROWS) ? rem : STREAM_CHUNK_ROWS;
+}
+
+_INLINE_ void *pk_stream_reader(IN OUT void *arg)
+{
+    pk_stream_t *s = arg;
+
+    for(size_t c = 0; c < STREAM_CHUNKS; c++) {
+        const size_t slot = c & 1;
+
+        wait_slot(s, slot, 0);
+
+        const int err = s->read_cb(s->ctx, s->buf[slot], chunk_rows(c) * PUB_M);
+        set_slot(s, slot, 1, err);
+
+        if(0 != err) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// Consumes the chunks in order as the reader thread fills them.
+_INLINE_ int pk_stream_eval(OUT mq_stream_t *st, IN OUT pk_stream_t *s)
+{
+    for(size_t c = 0; c < STREAM_CHUNKS; c++) {
+        const size_t slot = c & 1;
+
+        if(0 != wait_slot(s, slot, 1)) {
+            return ERROR;
+        }
+
+        mq_gf256_n140_m72_stream_update(st, s->buf[slot], chunk_rows(c),
+                                        s->pk_to_gfni);
+
+        set_slot(s, slot, 0, 0);
+    }
+
+    return SUCCESS;
+}
+
+// Reads and evaluates the chunks in turn, without a reader thread.
+_INLINE_ int pk_stream_read_eval(OUT mq_stream_t *st, IN OUT pk_stream_t *s)
+{
+    for(size_t c = 0; c < STREAM_CHUNKS; c++) {
+        if(0 != s->read_cb(s->ctx, s->buf[0], chunk_rows(c) * PUB_M)) {
+            return ERROR;
+        }
+
+        mq_gf256_n140_m72_stream_update(st, s->buf[0], chunk_rows(c),
+                                        s->pk_to_gfni);
+    }
+
+    return SUCCESS;
+}
+
+int rainbow_verify_stream(IN const uint8_t *digest,
+                          IN const uint8_t *sig,
+                          IN rainbow_pk_read_cb read_cb,
+                          IN void *ctx)
+{
+    mq_stream_t st;
+    pk_stream_t s;
+    pthread_t   reader;
+    uint8_t     digest_ck[PUB_M];
+    uint8_t     _sig[PUB_N];
+    int         eval_ret = ERROR;
+    int         ret      = ERROR;
+
+    s.read_cb    = read_cb;
+    s.ctx        = ctx;
+    s.pk_to_gfni = 1;
+#ifdef USE_AES_FIELD
+    s.pk_to_gfni = 0;
+#endif
+    s.full[0] = 0;
+    s.full[1] = 0;
+    s.err     = 0;
+    s.buf[0]  = aligned_malloc(2 * STREAM_CHUNK_BYTES);
+    if(NULL == s.buf[0]) {
+        return ERROR;
+    }
+    s.buf[1] = &s.buf[0][STREAM_CHUNK_BYTES];
+
+    if(0 != pthread_mutex_init(&s.lock, NULL)) {
+        goto free_buf;
+    }
+    if(0 != pthread_cond_init(&s.cond, NULL)) {
+        goto destroy_lock;
+    }
+
+    sig_to_internal(_sig, sig);
+    mq_gf256_n140_m72_stream_init(&st, _sig);
+
+    // The reader thread only overlaps the reads with the evaluation when it
+    // has a CPU of its own. On a single CPU its handoffs cost several times
+    // the whole verify, so the chunks are read in turn instead.
+    if(1 == team_allowed_cpus()) {
+        eval_ret = pk_stream_read_eval(&st, &s);
+    } else if(0 == pthread_create(&reader, NULL, pk_stream_reader, &s)) {
+        eval_ret = pk_stream_eval(&st, &s);
+        pthread_join(reader, NULL);
+    }
+
+    if(SUCCESS == eval_ret) {
+        mq_gf256_n140_m72_stream_final(digest_ck, &st);
+        ret = check_digest(digest_ck, digest, sig);
+    }
+
+    pthread_cond_destroy(&s.cond);
+destroy_lock:
+    pthread_mutex_destroy(&s.lock);
+free_buf:
+    aligned_free(s.buf[0]);
+    return ret;
+}
+
+_INLINE_ int read_fd(IN void *ctx, OUT uint8_t *buf, IN size_t len)
+{
+    const int fd = *(const int *)ctx;
+
+    while(len > 0) {
+        const ssize_t r = read(fd, buf, len);
+        if(r < 0) {
+            if(EINTR == errno) {
+                continue;
+            }
+            return ERROR;
+        }
+        if(0 == r) {
+            // The public key is truncated
+            return ERROR;
+        }
+        buf += r;
+        len -= (size_t)r;
+    }
+
+    return SUCCESS;
+}
+
+int rainbow_verify_stream_fd(IN const uint8_t *digest,
+                             IN const uint8_t *sig,
+                             IN int            fd)
+{
+    // The advice only lets the kernel read ahead while the chunks are
+    // evaluated. It fails on pipes and sockets, which are read as well.
+    (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    return rainbow_verify_stream(digest, sig, read_fd, &fd);
+}
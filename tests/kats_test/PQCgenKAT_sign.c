@@ -38,8 +38,7 @@ _INLINE_ int crypto_sign_keypair(uint8_t *pk, uint8_t *sk)
     uint8_t sk_seed[SKSEED_BYTE_LEN] = {0};
     randombytes(sk_seed, SKSEED_BYTE_LEN);
 
-    rainbow_keypair((pk_t *)pk, (sk_t *)sk, sk_seed);
-    return 0;
+    return rainbow_keypair((pk_t *)pk, (sk_t *)sk, sk_seed);
 }
 
 _INLINE_ int crypto_sign(uint8_t *      sm,
@@ -78,16 +77,17 @@ _INLINE_ int crypto_sign_open(uint8_t *      m,
 int main(int argc, char *argv[])
 {
     char     fn_req[32], fn_rsp[32];
-    FILE *   fp_req, *fp_rsp;
+    FILE *   fp_req = NULL, *fp_rsp = NULL;
     uint8_t  seed[48];
     uint8_t  msg[3300];
     uint8_t  entropy_input[48];
-    uint8_t *m, *sm, *m1;
+    uint8_t *m = NULL, *sm = NULL, *m1 = NULL;
     uint64_t mlen, smlen, mlen1;
     int      count;
     int      done;
-    uint8_t  pk[CRYPTO_PUBLICKEYBYTES], sk[CRYPTO_SECRETKEYBYTES];
+    uint8_t *pk, *sk;
     int      ret_val;
+    int      ret = KAT_SUCCESS;
     int      j;
     int      num_tests = 15;
 
@@ -106,16 +106,28 @@ int main(int argc, char *argv[])
     long long t_keypair[num_tests], t_sign[num_tests], t_open[num_tests];
     long long c_keypair1[num_tests], c_sign1[num_tests], c_open1[num_tests];
 
+    // The keys are too large for small stacks. The allocation follows the
+    // arrays above, so that the jumps to |out| do not enter their scope.
+    pk = (uint8_t *)malloc(CRYPTO_PUBLICKEYBYTES);
+    sk = (uint8_t *)malloc(CRYPTO_SECRETKEYBYTES);
+    if((NULL == pk) || (NULL == sk)) {
+        printf("Couldn't allocate the keys\n");
+        ret = KAT_CRYPTO_FAILURE;
+        goto out;
+    }
+
     // Create the REQUEST file
     sprintf(fn_req, "PQCsignKAT_%ld.req", CRYPTO_SECRETKEYBYTES);
     if((fp_req = fopen(fn_req, "w")) == NULL) {
         printf("Couldn't open <%s> for write\n", fn_req);
-        return KAT_FILE_OPEN_ERROR;
+        ret = KAT_FILE_OPEN_ERROR;
+        goto out;
     }
     sprintf(fn_rsp, "PQCsignKAT_%ld.rsp", CRYPTO_SECRETKEYBYTES);
     if((fp_rsp = fopen(fn_rsp, "w")) == NULL) {
         printf("Couldn't open <%s> for write\n", fn_rsp);
-        return KAT_FILE_OPEN_ERROR;
+        ret = KAT_FILE_OPEN_ERROR;
+        goto out;
     }
 
     for(int i = 0; i < 48; i++) entropy_input[i] = i;
@@ -142,7 +154,8 @@ int main(int argc, char *argv[])
     // Create the RESPONSE file based on what's in the REQEST file
     if((fp_req = fopen(fn_req, "r")) == NULL) {
         printf("Couldn't open <%s> for read\n", fn_req);
-        return KAT_FILE_OPEN_ERROR;
+        ret = KAT_FILE_OPEN_ERROR;
+        goto out;
     }
 
     fprintf(fp_rsp, "# %s\n\n", AlgName);
@@ -160,7 +173,8 @@ int main(int argc, char *argv[])
 
         if(!ReadHex(fp_req, seed, 48, "seed = ")) {
             printf("ERROR: unable to read 'seed' from <%s>\n", fn_req);
-            return KAT_DATA_ERROR;
+            ret = KAT_DATA_ERROR;
+            goto out;
         }
         fprintBstr(fp_rsp, "seed = ", seed, 48);
 
@@ -170,7 +184,8 @@ int main(int argc, char *argv[])
             fscanf(fp_req, "%ld", &mlen);
         else {
             printf("ERROR: unable to read 'mlen' from <%s>\n", fn_req);
-            return KAT_DATA_ERROR;
+            ret = KAT_DATA_ERROR;
+            goto out;
         }
         fprintf(fp_rsp, "mlen = %ld\n", mlen);
 
@@ -180,7 +195,8 @@ int main(int argc, char *argv[])
 
         if(!ReadHex(fp_req, m, (int)mlen, "msg = ")) {
             printf("ERROR: unable to read 'msg' from <%s>\n", fn_req);
-            return KAT_DATA_ERROR;
+            ret = KAT_DATA_ERROR;
+            goto out;
         }
         fprintBstr(fp_rsp, "msg = ", m, mlen);
 
@@ -188,7 +204,8 @@ int main(int argc, char *argv[])
         c_keypair[j] = jmas_cpucycles();
         if((ret_val = crypto_sign_keypair(pk, sk)) != 0) {
             printf("crypto_sign_keypair returned <%d>\n", ret_val);
-            return KAT_CRYPTO_FAILURE;
+            ret = KAT_CRYPTO_FAILURE;
+            goto out;
         }
         c_keypair1[j] = jmas_cpucycles();
         fprintBstr(fp_rsp, "pk = ", pk, CRYPTO_PUBLICKEYBYTES);
@@ -197,7 +214,8 @@ int main(int argc, char *argv[])
         c_sign[j] = jmas_cpucycles();
         if((ret_val = crypto_sign(sm, &smlen, m, mlen, sk)) != 0) {
             printf("crypto_sign returned <%d>\n", ret_val);
-            return KAT_CRYPTO_FAILURE;
+            ret = KAT_CRYPTO_FAILURE;
+            goto out;
         }
         c_sign1[j] = jmas_cpucycles();
         fprintf(fp_rsp, "smlen = %ld\n", smlen);
@@ -207,7 +225,8 @@ int main(int argc, char *argv[])
         c_open[j] = jmas_cpucycles();
         if((ret_val = crypto_sign_open(m1, &mlen1, sm, smlen, pk)) != 0) {
             printf("crypto_sign_open returned <%d>\n", ret_val);
-            return KAT_CRYPTO_FAILURE;
+            ret = KAT_CRYPTO_FAILURE;
+            goto out;
         }
         c_open1[j] = jmas_cpucycles();
 
@@ -215,17 +234,22 @@ int main(int argc, char *argv[])
             printf("crypto_sign_open returned bad 'mlen': Got <%ld>, expected "
                    "<%ld>\n",
                    mlen1, mlen);
-            return KAT_CRYPTO_FAILURE;
+            ret = KAT_CRYPTO_FAILURE;
+            goto out;
         }
 
         if(memcmp(m, m1, mlen)) {
             printf("crypto_sign_open returned bad 'm' value\n");
-            return KAT_CRYPTO_FAILURE;
+            ret = KAT_CRYPTO_FAILURE;
+            goto out;
         }
 
         free(m);
         free(m1);
         free(sm);
+        m  = NULL;
+        m1 = NULL;
+        sm = NULL;
         j++;
     } while(!done);
 
@@ -246,10 +270,21 @@ int main(int argc, char *argv[])
         jmas_print_results("crypto_sign_open", t_open, c_open, c_open1,
                            num_tests);
     }
-    fclose(fp_req);
-    fclose(fp_rsp);
 
-    return KAT_SUCCESS;
+out:
+    if(NULL != fp_req) {
+        fclose(fp_req);
+    }
+    if(NULL != fp_rsp) {
+        fclose(fp_rsp);
+    }
+    free(m);
+    free(m1);
+    free(sm);
+    free(sk);
+    free(pk);
+
+    return ret;
 }
 
 //
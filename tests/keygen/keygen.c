@@ -0,0 +1,181 @@
+/*
+ * Copyright 2020 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License").
+ * You may not use this file except in compliance with the License.
+ * A copy of the License is located at
+ *
+ * http://aws.amazon.com/apache2.0
+ *
+ * or in the "license" file accompanying this file. This file is distributed
+ * on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+ * express or implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ * The license is detailed in the file LICENSE.md, and applies to this file.
+ *
+ * The code was written by Nir Drucker and Shay Gueron
+ * AWS Cryptographic Algorithms Group.
+ * (ndrucker@amazon.com, gueron@amazon.com)
+ */
+
+// Generates keypairs in bulk from fresh random seeds, and reports the rate.
+// Usage: main <n_keys> [n_threads] [out_file]
+// Every keypair is appended to out_file as pk || sk. Without out_file, the
+// keys are discarded.
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "api.h"
+
+#define MAX_THREADS_PER_CPU (4)
+
+typedef struct keygen_out_st {
+    FILE * f;
+    size_t n_keys;
+} keygen_out_t;
+
+_INLINE_ uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+_INLINE_ int write_keypair(IN void *ctx,
+                           IN size_t     i,
+                           IN const pk_t *pk,
+                           IN const sk_t *sk)
+{
+    keygen_out_t *out = ctx;
+    (void)i;
+
+    if((NULL != out->f) && ((1 != fwrite(pk, sizeof(*pk), 1, out->f)) ||
+                            (1 != fwrite(sk, sizeof(*sk), 1, out->f)))) {
+        return ERROR;
+    }
+
+    out->n_keys++;
+    return SUCCESS;
+}
+
+_INLINE_ int fill_random(OUT uint8_t *buf, IN size_t len)
+{
+    while(len > 0) {
+        const ssize_t r = getrandom(buf, len, 0);
+        if(r <= 0) {
+            return ERROR;
+        }
+        buf += r;
+        len -= (size_t)r;
+    }
+
+    return SUCCESS;
+}
+
+// Parses a positive decimal count of at most |max|. Returns 0 on success.
+_INLINE_ int parse_count(OUT size_t *out, IN const char *str, IN size_t max)
+{
+    char *end = NULL;
+
+    // strtoul accepts (and negates) a leading minus sign
+    if(('\0' == str[0]) || ('-' == str[0])) {
+        return ERROR;
+    }
+
+    errno                   = 0;
+    const unsigned long val = strtoul(str, &end, 10);
+    if((0 != errno) || ('\0' != *end) || (0 == val) || (val > max)) {
+        return ERROR;
+    }
+
+    *out = (size_t)val;
+    return SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    keygen_out_t    out       = {NULL, 0};
+    uint8_t *       seed_buf  = NULL;
+    const uint8_t **seeds     = NULL;
+    size_t          n         = 0;
+    size_t          n_threads = 1;
+    int             ret       = ERROR;
+
+    if((argc < 2) || (argc > 4)) {
+        printf("Usage: %s <n_keys> [n_threads] [out_file]\n", argv[0]);
+        return ERROR;
+    }
+
+    // The seed buffers below must not overflow their sizes
+    const size_t max_n = (SIZE_MAX - 1) / SKSEED_BYTE_LEN;
+    if(SUCCESS != parse_count(&n, argv[1], max_n)) {
+        printf("Invalid number of keys: %s\n", argv[1]);
+        return ERROR;
+    }
+
+    // More threads than a few per CPU only add contention
+    const long   n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const size_t max_threads =
+        MAX_THREADS_PER_CPU * ((n_cpus > 0) ? (size_t)n_cpus : 1);
+    if(argc > 2) {
+        if(SUCCESS != parse_count(&n_threads, argv[2], max_threads)) {
+            printf("Invalid number of threads: %s (at most %lu)\n", argv[2],
+                   (unsigned long)max_threads);
+            return ERROR;
+        }
+    } else {
+        n_threads = max_threads / MAX_THREADS_PER_CPU;
+    }
+
+    if(argc > 3) {
+        out.f = fopen(argv[3], "wb");
+        if(NULL == out.f) {
+            printf("Opening %s failed\n", argv[3]);
+            return ERROR;
+        }
+    }
+
+    seed_buf = malloc((n * SKSEED_BYTE_LEN) + 1);
+    seeds    = malloc((n * sizeof(seeds[0])) + 1);
+    if((NULL == seed_buf) || (NULL == seeds) ||
+       (SUCCESS != fill_random(seed_buf, n * SKSEED_BYTE_LEN))) {
+        printf("Generating the seeds failed\n");
+        goto out;
+    }
+
+    for(size_t i = 0; i < n; i++) {
+        seeds[i] = &seed_buf[i * SKSEED_BYTE_LEN];
+    }
+
+    const uint64_t start = now_ns();
+    ret = rainbow_keypair_batch(seeds, n, n_threads, write_keypair, &out);
+    const double secs = (double)(now_ns() - start) / 1e9;
+
+    if(SUCCESS != ret) {
+        printf("rainbow_keypair_batch failed after %lu keys\n",
+               (unsigned long)out.n_keys);
+        goto out;
+    }
+
+    printf("Generated %lu keys with %lu threads in %.3f s: %.1f keys/s\n",
+           (unsigned long)n, (unsigned long)n_threads, secs,
+           (secs > 0) ? ((double)n / secs) : 0.0);
+
+out:
+    if(NULL != seed_buf) {
+        secure_clean(seed_buf, n * SKSEED_BYTE_LEN);
+    }
+    free(seed_buf);
+    free(seeds);
+    if((NULL != out.f) && (0 != fclose(out.f))) {
+        ret = ERROR;
+    }
+
+    return ret;
+}
@@ -18,18 +18,30 @@
  * (ndrucker@amazon.com, gueron@amazon.com)
  */
 
+// For clock_gettime and sched_getaffinity
+#define _GNU_SOURCE
+
 #include "api.h"
+#include "gfni.h"
+#include "prepared.h"
+#include "sign_internal.h"
 #include "utils_hash.h"
+#include "utils_mem.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
 
 #include "measurements.h"
 
 _INLINE_ int crypto_sign_keypair(OUT uint8_t *pk, OUT uint8_t *sk)
 {
     uint8_t sk_seed[SKSEED_BYTE_LEN] = {0};
-    rainbow_keypair((pk_t *)pk, (sk_t *)sk, sk_seed);
-    return 0;
+    return rainbow_keypair((pk_t *)pk, (sk_t *)sk, sk_seed);
 }
 
 _INLINE_ int crypto_sign(OUT uint8_t *sm,
@@ -47,6 +59,21 @@ _INLINE_ int crypto_sign(OUT uint8_t *sm,
     return rainbow_sign(sm + mlen, (const sk_t *)sk, digest);
 }
 
+_INLINE_ int crypto_sign_prepared(OUT uint8_t *sm,
+                                  OUT uint64_t *smlen,
+                                  IN const uint8_t *m,
+                                  IN const uint64_t mlen,
+                                  IN const rainbow_sk_prepared_t *psk)
+{
+    uint8_t digest[HASH_BYTE_LEN];
+    hash_msg(digest, HASH_BYTE_LEN, m, mlen);
+
+    memcpy(sm, m, mlen);
+    *smlen = mlen + SIG_BYTE_LEN;
+
+    return rainbow_sign_prepared(sm + mlen, psk, digest);
+}
+
 _INLINE_ int crypto_sign_open(OUT uint8_t *m,
                               OUT uint64_t *mlen,
                               IN const uint8_t *sm,
@@ -66,21 +93,999 @@ _INLINE_ int crypto_sign_open(OUT uint8_t *m,
     return rainbow_verify(digest, sm + (*mlen), (const pk_t *)pk);
 }
 
+_INLINE_ int crypto_sign_open_prepared(OUT uint8_t *m,
+                                       OUT uint64_t *mlen,
+                                       IN const uint8_t *sm,
+                                       IN const uint64_t smlen,
+                                       IN const rainbow_pk_prepared_t *ppk)
+{
+    if(SIG_BYTE_LEN > smlen) {
+        return -1;
+    }
+
+    memcpy(m, sm, smlen - SIG_BYTE_LEN);
+    *mlen = smlen - SIG_BYTE_LEN;
+
+    uint8_t digest[HASH_BYTE_LEN];
+    hash_msg(digest, HASH_BYTE_LEN, m, *mlen);
+
+    return rainbow_verify_prepared(digest, sm + (*mlen), ppk);
+}
+
+#define BATCH_SIZE (10)
+#define BAD_SIG    (3)
+
+// Signs BATCH_SIZE digests, corrupts one of the signatures, and checks that the
+// batch verification rejects exactly this signature.
+_INLINE_ int test_verify_batch(IN const rainbow_sk_prepared_t *psk,
+                               IN const rainbow_pk_prepared_t *ppk)
+{
+    uint8_t        digest[BATCH_SIZE][HASH_BYTE_LEN];
+    uint8_t        sig[BATCH_SIZE][SIG_BYTE_LEN];
+    const uint8_t *digests[BATCH_SIZE];
+    const uint8_t *sigs[BATCH_SIZE];
+    int            results[BATCH_SIZE];
+
+    for(size_t i = 0; i < BATCH_SIZE; i++) {
+        memset(digest[i], (int)i, HASH_BYTE_LEN);
+        GUARD(rainbow_sign_prepared(sig[i], psk, digest[i]));
+        digests[i] = digest[i];
+        sigs[i]    = sig[i];
+    }
+    sig[BAD_SIG][0] ^= 1;
+
+    MEASURE("Verify batch (10 signatures)",
+            rainbow_verify_batch(ppk, digests, sigs, BATCH_SIZE, results););
+
+    for(size_t i = 0; i < BATCH_SIZE; i++) {
+        if(results[i] != ((BAD_SIG == i) ? ERROR : SUCCESS)) {
+            return ERROR;
+        }
+    }
+
+    return SUCCESS;
+}
+
+#define SIGN_BATCH_SIZE (20)
+
+// Signs SIGN_BATCH_SIZE digests with rainbow_sign_batch and checks that the
+// signatures are identical to the ones of rainbow_sign.
+_INLINE_ int test_sign_batch(IN const uint8_t *sk)
+{
+    uint8_t        digest[SIGN_BATCH_SIZE][HASH_BYTE_LEN];
+    uint8_t        sig[SIGN_BATCH_SIZE][SIG_BYTE_LEN];
+    uint8_t        sig_ref[SIG_BYTE_LEN];
+    uint8_t *      sigs[SIGN_BATCH_SIZE];
+    const uint8_t *digests[SIGN_BATCH_SIZE];
+    int            ret = 0;
+
+    for(size_t i = 0; i < SIGN_BATCH_SIZE; i++) {
+        memset(digest[i], (int)i, HASH_BYTE_LEN);
+        digests[i] = digest[i];
+        sigs[i]    = sig[i];
+    }
+
+    MEASURE("Sign batch (20 signatures)",
+            ret = rainbow_sign_batch(sigs, (const sk_t *)sk, digests,
+                                     SIGN_BATCH_SIZE););
+    GUARD(ret);
+
+    MEASURE("Sign loop (20 signatures)",
+            for(size_t i = 0; i < SIGN_BATCH_SIZE; i++) {
+                ret |= rainbow_sign(sig_ref, (const sk_t *)sk, digests[i]);
+            });
+    GUARD(ret);
+
+    for(size_t i = 0; i < SIGN_BATCH_SIZE; i++) {
+        GUARD(rainbow_sign(sig_ref, (const sk_t *)sk, digests[i]));
+        if(0 != memcmp(sig_ref, sig[i], SIG_BYTE_LEN)) {
+            return ERROR;
+        }
+    }
+
+    return SUCCESS;
+}
+
+#define MULTI_SIZE (8)
+
+// Verifies MULTI_SIZE signatures that alternate between two keys. One of the
+// signatures is checked against the wrong key and must be rejected.
+_INLINE_ int test_verify_multi(IN const rainbow_sk_prepared_t *psk,
+                               IN const rainbow_pk_prepared_t *ppk)
+{
+    const rainbow_pk_prepared_t *ppks[MULTI_SIZE];
+    const rainbow_sk_prepared_t *psks[2];
+    const rainbow_pk_prepared_t *keys[2];
+    rainbow_pk_prepared_t *      ppk2                     = NULL;
+    rainbow_sk_prepared_t *      psk2                     = NULL;
+    uint8_t                      sk_seed[SKSEED_BYTE_LEN] = {1};
+    uint8_t                      digest[MULTI_SIZE][HASH_BYTE_LEN];
+    uint8_t                      sig[MULTI_SIZE][SIG_BYTE_LEN];
+    const uint8_t *              digests[MULTI_SIZE];
+    const uint8_t *              sigs[MULTI_SIZE];
+    int                          results[MULTI_SIZE];
+    int                          ret = ERROR;
+
+    pk_t *pk2 = malloc(sizeof(*pk2));
+    sk_t *sk2 = malloc(sizeof(*sk2));
+    if((NULL == pk2) || (NULL == sk2)) {
+        goto out;
+    }
+
+    if(SUCCESS != rainbow_keypair(pk2, sk2, sk_seed)) {
+        goto out;
+    }
+    ppk2 = rainbow_pk_prepare(pk2);
+    psk2 = rainbow_sk_prepare(sk2);
+    if((NULL == ppk2) || (NULL == psk2)) {
+        goto out;
+    }
+
+    keys[0] = ppk;
+    keys[1] = ppk2;
+    psks[0] = psk;
+    psks[1] = psk2;
+
+    for(size_t i = 0; i < MULTI_SIZE; i++) {
+        memset(digest[i], (int)i, HASH_BYTE_LEN);
+        if(0 != rainbow_sign_prepared(sig[i], psks[i & 1], digest[i])) {
+            goto out;
+        }
+        ppks[i]    = keys[i & 1];
+        digests[i] = digest[i];
+        sigs[i]    = sig[i];
+    }
+    ppks[BAD_SIG] = keys[(BAD_SIG + 1) & 1];
+
+    MEASURE("Verify multi (8 signatures, 2 keys)",
+            rainbow_verify_multi(ppks, digests, sigs, MULTI_SIZE, results););
+
+    MEASURE("Verify prepared loop (8 signatures, 2 keys)",
+            for(size_t i = 0; i < MULTI_SIZE; i++) {
+                results[i] = rainbow_verify_prepared(digests[i], sigs[i], ppks[i]);
+            });
+
+    ret = SUCCESS;
+    for(size_t i = 0; i < MULTI_SIZE; i++) {
+        if(results[i] != ((BAD_SIG == i) ? ERROR : SUCCESS)) {
+            ret = ERROR;
+        }
+    }
+
+out:
+    rainbow_pk_release(ppk2);
+    rainbow_sk_release(psk2);
+    free(pk2);
+    free(sk2);
+    return ret;
+}
+
+typedef struct mem_reader_st {
+    const uint8_t *p;
+    size_t         left;
+} mem_reader_t;
+
+_INLINE_ int mem_read(IN void *ctx, OUT uint8_t *buf, IN size_t len)
+{
+    mem_reader_t *r = ctx;
+    if(len > r->left) {
+        return ERROR;
+    }
+
+    memcpy(buf, r->p, len);
+    r->p += len;
+    r->left -= len;
+    return SUCCESS;
+}
+
+// Verifies a signature with the public key streamed from memory and from a
+// file, and checks that a truncated key is rejected.
+_INLINE_ int test_verify_stream(IN const uint8_t *pk,
+                                IN const uint8_t *digest,
+                                IN const uint8_t *sig)
+{
+    mem_reader_t r;
+    int          ret = ERROR;
+
+    MEASURE("Verify (streamed pk)", r.p = pk; r.left = sizeof(pk_t);
+            ret = rainbow_verify_stream(digest, sig, mem_read, &r););
+    if(0 != ret) {
+        return ERROR;
+    }
+
+    r.p    = pk;
+    r.left = sizeof(pk_t) - 1;
+    if(0 == rainbow_verify_stream(digest, sig, mem_read, &r)) {
+        return ERROR;
+    }
+
+    FILE *f = tmpfile();
+    if(NULL == f) {
+        return ERROR;
+    }
+
+    const int fd = fileno(f);
+    if((sizeof(pk_t) != fwrite(pk, 1, sizeof(pk_t), f)) || (0 != fflush(f))) {
+        goto out;
+    }
+
+    MEASURE("Verify (streamed pk from a file)", lseek(fd, 0, SEEK_SET);
+            ret = rainbow_verify_stream_fd(digest, sig, fd););
+
+out:
+    fclose(f);
+    return ret;
+}
+
+_INLINE_ uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+#define POOL_DEPTH         (64)
+#define POOL_LOW_WATERMARK (16)
+#define POOL_SIGNS         (POOL_DEPTH - POOL_LOW_WATERMARK)
+
+// Fills a signing pool, and measures online signing (from the pool) against
+// signing with a prepared key. Every online signature must verify, and two
+// signatures of the same digest must differ.
+_INLINE_ int test_sign_online(IN const rainbow_sk_prepared_t *psk,
+                              IN const rainbow_pk_prepared_t *ppk)
+{
+    const struct timespec poll = {0, 1000000};
+    uint8_t               digest[HASH_BYTE_LEN] = {0};
+    uint8_t               sig[POOL_SIGNS][SIG_BYTE_LEN];
+    int                   ret = ERROR;
+
+    // The sizes of the bundle and worker arrays would overflow
+    if((NULL != rainbow_sign_pool_create(psk, SIZE_MAX, 0, 1)) ||
+       (NULL != rainbow_sign_pool_create(psk, 1, 0, SIZE_MAX))) {
+        return ERROR;
+    }
+
+    rainbow_sign_pool_t *pool =
+        rainbow_sign_pool_create(psk, POOL_DEPTH, POOL_LOW_WATERMARK, 1);
+    if(NULL == pool) {
+        return ERROR;
+    }
+
+    while(POOL_DEPTH != rainbow_sign_pool_available(pool)) {
+        nanosleep(&poll, NULL);
+    }
+
+    uint64_t start = now_ns();
+    for(size_t i = 0; i < POOL_SIGNS; i++) {
+        if(0 != rainbow_sign_online(sig[i], pool, digest)) {
+            goto out;
+        }
+    }
+    printf("Sign (online, from the pool) took %.1f ns\n",
+           (double)(now_ns() - start) / POOL_SIGNS);
+
+    start = now_ns();
+    for(size_t i = 0; i < POOL_SIGNS; i++) {
+        if(0 != rainbow_sign_prepared(sig[0], psk, digest)) {
+            goto out;
+        }
+    }
+    printf("Sign (prepared sk) took %.1f ns\n",
+           (double)(now_ns() - start) / POOL_SIGNS);
+
+    if((0 == memcmp(sig[1], sig[2], SIG_BYTE_LEN)) ||
+       (0 != rainbow_sign_pool_status(pool))) {
+        goto out;
+    }
+
+    ret = SUCCESS;
+    for(size_t i = 0; i < POOL_SIGNS; i++) {
+        if(0 != rainbow_verify_prepared(digest, sig[i], ppk)) {
+            ret = ERROR;
+        }
+    }
+
+out:
+    rainbow_sign_pool_release(pool);
+    return ret;
+}
+
+#define TEAM_HELPERS (2)
+#define TEAM_SIGNS   (400)
+
+_INLINE_ int cmp_u64(IN const void *a, IN const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+_INLINE_ void print_latency(IN const char *msg, IN OUT uint64_t *lat)
+{
+    qsort(lat, TEAM_SIGNS, sizeof(lat[0]), cmp_u64);
+    printf("%s latency: p50 %lu ns, p99 %lu ns\n", msg,
+           (unsigned long)lat[TEAM_SIGNS / 2],
+           (unsigned long)lat[(TEAM_SIGNS * 99) / 100]);
+}
+
+// Measures the latency distribution of single signs with and without a
+// helper team. The team only pays off when the helpers have idle cores of
+// their own, so they are pinned only when CPUs 1..TEAM_HELPERS are in the
+// affinity mask, and the team starts no more helpers than the other CPUs of
+// the mask (none on a single CPU, where both paths do the same work). A team
+// of 0 helpers is valid as well. All paths must output the same signatures.
+_INLINE_ int test_sign_team(IN const rainbow_sk_prepared_t *psk)
+{
+    cpu_set_t set;
+    size_t    n_cpus    = 0;
+    int       first_cpu = 1;
+    uint8_t   digest[HASH_BYTE_LEN] = {0};
+    uint8_t   sig1[SIG_BYTE_LEN];
+    uint8_t   sig2[SIG_BYTE_LEN];
+    uint64_t  lat1[TEAM_SIGNS];
+    uint64_t  lat2[TEAM_SIGNS];
+    int       ret = SUCCESS;
+
+    CPU_ZERO(&set);
+    if(0 == sched_getaffinity(0, sizeof(set), &set)) {
+        n_cpus = (size_t)CPU_COUNT(&set);
+    }
+    for(int cpu = 1; cpu <= TEAM_HELPERS; cpu++) {
+        if(!CPU_ISSET(cpu, &set)) {
+            first_cpu = -1;
+        }
+    }
+
+    rainbow_team_t *team = rainbow_team_create(0, -1);
+    if(NULL == team) {
+        return ERROR;
+    }
+    ret |= (0 == rainbow_team_size(team)) ? SUCCESS : ERROR;
+    ret |= rainbow_sign_prepared(sig1, psk, digest);
+    ret |= rainbow_sign_prepared_team(sig2, psk, digest, team);
+    if(0 != memcmp(sig1, sig2, SIG_BYTE_LEN)) {
+        ret = ERROR;
+    }
+    rainbow_team_release(team);
+
+    team = rainbow_team_create(TEAM_HELPERS, first_cpu);
+    if(NULL == team) {
+        return ERROR;
+    }
+
+    for(size_t i = 0; i < TEAM_SIGNS; i++) {
+        memcpy(digest, &i, sizeof(i));
+
+        uint64_t start = now_ns();
+        ret |= rainbow_sign_prepared(sig1, psk, digest);
+        lat1[i] = now_ns() - start;
+
+        start = now_ns();
+        ret |= rainbow_sign_prepared_team(sig2, psk, digest, team);
+        lat2[i] = now_ns() - start;
+
+        if(0 != memcmp(sig1, sig2, SIG_BYTE_LEN)) {
+            ret = ERROR;
+        }
+    }
+
+    const size_t n_helpers = rainbow_team_size(team);
+    if((n_cpus > 0) && (n_helpers >= n_cpus)) {
+        ret = ERROR;
+    }
+
+    printf("Sign team: %d helpers requested, %zu started, %zu allowed CPUs\n",
+           TEAM_HELPERS, n_helpers, n_cpus);
+    if(0 == n_helpers) {
+        printf("Sign team: no helper started, both paths ran on the caller "
+               "alone, so the latencies do not measure the team\n");
+    }
+    print_latency("Sign (prepared sk)", lat1);
+    print_latency("Sign (prepared sk, team)", lat2);
+
+    rainbow_team_release(team);
+    return ret;
+}
+
+#define KEYPAIR_MT_THREADS (4)
+
+// Checks that the multithreaded keypair is the same as the serial one (|pk|
+// and |sk| were generated from the zero seed), and compares their times. A
+// team of the caller is reused for several keypairs.
+_INLINE_ int test_keypair_mt(IN const uint8_t *pk, IN const uint8_t *sk)
+{
+    const uint8_t sk_seed[SKSEED_BYTE_LEN] = {0};
+    int           ret                      = SUCCESS;
+
+    pk_t *          pk2  = malloc(sizeof(*pk2));
+    sk_t *          sk2  = malloc(sizeof(*sk2));
+    rainbow_team_t *team = rainbow_team_create(KEYPAIR_MT_THREADS - 1, -1);
+    if((NULL == pk2) || (NULL == sk2) || (NULL == team)) {
+        ret = ERROR;
+        goto out;
+    }
+
+    // Warm up the pages of the keys
+    ret |= rainbow_keypair(pk2, sk2, sk_seed);
+
+    for(size_t n_threads = 1; n_threads <= KEYPAIR_MT_THREADS; n_threads *= 2) {
+        const uint64_t start = now_ns();
+        ret |= rainbow_keypair_mt(pk2, sk2, sk_seed, n_threads);
+        const uint64_t t = now_ns() - start;
+
+        if((0 != memcmp(pk, pk2, sizeof(*pk2))) ||
+           (0 != memcmp(sk, sk2, sizeof(*sk2)))) {
+            ret = ERROR;
+        }
+
+        printf("Keypair (%lu threads) took %lu us\n", (unsigned long)n_threads,
+               (unsigned long)(t / 1000));
+    }
+
+    for(size_t i = 0; i < 2; i++) {
+        memset(pk2, 0, sizeof(*pk2));
+        ret |= rainbow_keypair_team(pk2, sk2, sk_seed, team);
+        if((0 != memcmp(pk, pk2, sizeof(*pk2))) ||
+           (0 != memcmp(sk, sk2, sizeof(*sk2)))) {
+            ret = ERROR;
+        }
+    }
+
+out:
+    rainbow_team_release(team);
+    free(sk2);
+    free(pk2);
+    return ret;
+}
+
+#define KEYPAIR_BATCH_SIZE (3)
+
+typedef struct batch_check_st {
+    pk_t * pk;
+    sk_t * sk;
+    size_t next;
+    int    ret;
+} batch_check_t;
+
+// Checks that key |i| arrives in order and equals the key of rainbow_keypair.
+_INLINE_ int check_batch_key(IN void *ctx,
+                             IN size_t     i,
+                             IN const pk_t *pk,
+                             IN const sk_t *sk)
+{
+    batch_check_t *check                    = ctx;
+    uint8_t        sk_seed[SKSEED_BYTE_LEN] = {0};
+
+    sk_seed[0] = (uint8_t)i;
+    check->ret |= rainbow_keypair(check->pk, check->sk, sk_seed);
+    if((check->next != i) || (0 != memcmp(pk, check->pk, sizeof(*pk))) ||
+       (0 != memcmp(sk, check->sk, sizeof(*sk)))) {
+        check->ret = ERROR;
+    }
+
+    check->next++;
+    return SUCCESS;
+}
+
+_INLINE_ int test_keypair_batch(void)
+{
+    uint8_t        seed_buf[KEYPAIR_BATCH_SIZE][SKSEED_BYTE_LEN] = {{0}};
+    const uint8_t *seeds[KEYPAIR_BATCH_SIZE];
+    batch_check_t  check = {NULL, NULL, 0, SUCCESS};
+
+    for(size_t i = 0; i < KEYPAIR_BATCH_SIZE; i++) {
+        seed_buf[i][0] = (uint8_t)i;
+        seeds[i]       = seed_buf[i];
+    }
+
+    check.pk = malloc(sizeof(*check.pk));
+    check.sk = malloc(sizeof(*check.sk));
+    if((NULL == check.pk) || (NULL == check.sk)) {
+        check.ret = ERROR;
+        goto out;
+    }
+
+    check.ret |= rainbow_keypair_batch(seeds, KEYPAIR_BATCH_SIZE, 2,
+                                       check_batch_key, &check);
+    if(KEYPAIR_BATCH_SIZE != check.next) {
+        check.ret = ERROR;
+    }
+
+    // The size of the worker array would overflow
+    const size_t huge = (SIZE_MAX / sizeof(pthread_t)) + 2;
+    if(SUCCESS == rainbow_keypair_batch(seeds, KEYPAIR_BATCH_SIZE, huge,
+                                        check_batch_key, &check)) {
+        check.ret = ERROR;
+    }
+
+out:
+    free(check.sk);
+    free(check.pk);
+    return check.ret;
+}
+
+#define STREAM_SEEDS (3)
+
+typedef struct stream_check_st {
+    uint8_t *buf;
+    size_t   len;
+    size_t   max_chunk;
+    size_t   fail_at; // Fails the write that reaches this length (0 never)
+} stream_check_t;
+
+_INLINE_ int collect_pk(IN void *ctx, IN const uint8_t *buf, IN size_t len)
+{
+    stream_check_t *check = ctx;
+
+    if(((check->len + len) > sizeof(pk_t)) ||
+       ((0 != check->fail_at) && ((check->len + len) >= check->fail_at))) {
+        return ERROR;
+    }
+
+    memcpy(&check->buf[check->len], buf, len);
+    check->len += len;
+    check->max_chunk = (len > check->max_chunk) ? len : check->max_chunk;
+    return SUCCESS;
+}
+
+// Checks that the streamed public key is the one of rainbow_keypair (|pk| and
+// |sk| were generated from the zero seed), also for other seeds, and that a
+// failed write zeroizes the secret key.
+_INLINE_ int test_keypair_stream(IN const uint8_t *pk, IN const uint8_t *sk)
+{
+    uint8_t        sk_seed[SKSEED_BYTE_LEN] = {0};
+    stream_check_t check                    = {NULL, 0, 0, 0};
+    int            ret                      = SUCCESS;
+
+    sk_t *sk2 = malloc(sizeof(*sk2));
+    pk_t *pk3 = malloc(sizeof(*pk3));
+    sk_t *sk3 = malloc(sizeof(*sk3));
+    check.buf = malloc(sizeof(pk_t));
+    if((NULL == sk2) || (NULL == pk3) || (NULL == sk3) || (NULL == check.buf)) {
+        ret = ERROR;
+        goto out;
+    }
+
+    const uint64_t start = now_ns();
+    ret |= rainbow_keypair_stream(sk2, sk_seed, collect_pk, &check);
+    const uint64_t t = now_ns() - start;
+
+    if((sizeof(pk_t) != check.len) || (0 != memcmp(pk, check.buf, check.len)) ||
+       (0 != memcmp(sk, sk2, sizeof(*sk2)))) {
+        ret = ERROR;
+    }
+
+    printf("Keypair (streamed pk, chunks of up to %lu bytes) took %lu us\n",
+           (unsigned long)check.max_chunk, (unsigned long)(t / 1000));
+
+    for(size_t i = 1; i < STREAM_SEEDS; i++) {
+        for(size_t j = 0; j < sizeof(sk_seed); j++) {
+            sk_seed[j] = (uint8_t)((i * 101) + (j * 7));
+        }
+
+        check.len = 0;
+        ret |= rainbow_keypair(pk3, sk3, sk_seed);
+        ret |= rainbow_keypair_stream(sk2, sk_seed, collect_pk, &check);
+        if((sizeof(pk_t) != check.len) ||
+           (0 != memcmp(pk3, check.buf, check.len)) ||
+           (0 != memcmp(sk3, sk2, sizeof(*sk2)))) {
+            ret = ERROR;
+        }
+    }
+
+    // A write that fails in the middle of the public key
+    check.len     = 0;
+    check.fail_at = sizeof(pk_t) / 2;
+    if(SUCCESS == rainbow_keypair_stream(sk2, sk_seed, collect_pk, &check)) {
+        ret = ERROR;
+    }
+    for(size_t j = 0; j < sizeof(*sk2); j++) {
+        ret |= ((const uint8_t *)sk2)[j];
+    }
+
+out:
+    free(check.buf);
+    free(sk3);
+    free(pk3);
+    free(sk2);
+    return ret;
+}
+
+// Signs with bundle |b| with and without the fault check |mode| of the maps
+// |m|. Returns SUCCESS if the unchecked signature is released but does not
+// verify, and the checked one is not released.
+_INLINE_ int fault_check_catches(IN OUT sk_maps_t *m,
+                                 IN const vinegar_bundle_t *b,
+                                 IN const rainbow_pk_prepared_t *ppk,
+                                 IN const uint32_t               mode)
+{
+    uint8_t digest[HASH_BYTE_LEN] = {0};
+    uint8_t seed[HASH_BYTE_LEN]   = {0};
+    uint8_t sig[SIG_BYTE_LEN];
+    prng_t  prng;
+    int     ret = ERROR;
+
+    m->fault_check = RAINBOW_FAULT_CHECK_OFF;
+    prng_set(&prng, seed, sizeof(seed));
+    if((0 == sign_with_bundle(sig, &prng, m, b, digest)) &&
+       (0 != rainbow_verify_prepared(digest, sig, ppk))) {
+        m->fault_check = mode;
+        prng_set(&prng, seed, sizeof(seed));
+        ret = (0 == sign_with_bundle(sig, &prng, m, b, digest)) ? ERROR : SUCCESS;
+    }
+
+    prng_clear(&prng);
+    return ret;
+}
+
+// Checks that the fault checks do not change the signatures, measures their
+// cost, and that they stop the signatures of a faulty bundle: both checks in
+// the online part (the inverse of the layer 1 system), and the full check in
+// the vinegar maps.
+_INLINE_ int test_fault_check(IN OUT rainbow_sk_prepared_t *psk,
+                              IN const rainbow_pk_prepared_t *ppk)
+{
+    uint8_t          digest[HASH_BYTE_LEN] = {0};
+    uint8_t          seed[HASH_BYTE_LEN]   = {0};
+    uint8_t          sig1[SIG_BYTE_LEN];
+    uint8_t          sig2[SIG_BYTE_LEN];
+    uint8_t          sig3[SIG_BYTE_LEN];
+    vinegar_bundle_t b;
+    prng_t           prng;
+    sk_maps_t        m;
+    int              ret  = ERROR;
+    int              ret2 = ERROR;
+
+    MEASURE("Sign (prepared sk, no fault check)",
+            rainbow_sign_prepared(sig1, psk, digest););
+    rainbow_sk_set_fault_check(psk, RAINBOW_FAULT_CHECK);
+    MEASURE("Sign (prepared sk, fault check)",
+            ret = rainbow_sign_prepared(sig2, psk, digest););
+    rainbow_sk_set_fault_check(psk, RAINBOW_FAULT_CHECK_FULL);
+    MEASURE("Sign (prepared sk, full fault check)",
+            ret2 = rainbow_sign_prepared(sig3, psk, digest););
+    rainbow_sk_set_fault_check(psk, RAINBOW_FAULT_CHECK_OFF);
+    if((0 != ret) || (0 != ret2) || (0 != memcmp(sig1, sig2, sizeof(sig1))) ||
+       (0 != memcmp(sig1, sig3, sizeof(sig1)))) {
+        ret = ERROR;
+        goto out;
+    }
+
+    sk_maps_of_prepared(&m, psk);
+    prng_set(&prng, seed, sizeof(seed));
+    vinegar_bundle_compute(&b, &prng, &m);
+
+    // Flip a bit of the inverse of the layer 1 system
+    b.mat_l1[0] ^= 1;
+    ret = fault_check_catches(&m, &b, ppk, RAINBOW_FAULT_CHECK);
+    ret |= fault_check_catches(&m, &b, ppk, RAINBOW_FAULT_CHECK_FULL);
+    b.mat_l1[0] ^= 1;
+
+    // Flip a bit of a layer 2 vinegar product
+    b.r_l2_F1[0] ^= 1;
+    ret |= fault_check_catches(&m, &b, ppk, RAINBOW_FAULT_CHECK_FULL);
+
+out:
+    secure_clean((uint8_t *)&b, sizeof(b));
+    prng_clear(&prng);
+    return ret;
+}
+
+#define STACK_TEST_BYTES (64 * 1024)
+#define STACK_FILL       (0xa5)
+
+// makecontext passes only int arguments, so the job is a global.
+typedef struct stack_job_st {
+    const uint8_t *sk;
+    const uint8_t *pk;
+    void *         ws;
+    uint8_t        digest[HASH_BYTE_LEN];
+    uint8_t        sig[SIG_BYTE_LEN];
+    int            verify;
+    int            check;
+    int            ret;
+} stack_job_t;
+
+static stack_job_t stack_job;
+static ucontext_t  stack_caller;
+
+static void stack_job_run(void)
+{
+    if(stack_job.verify) {
+        stack_job.ret =
+            rainbow_verify(stack_job.digest, stack_job.sig, (const pk_t *)stack_job.pk);
+    } else if(stack_job.check) {
+        stack_job.ret =
+            rainbow_sign_ws_checked(stack_job.sig, (const sk_t *)stack_job.sk,
+                                    stack_job.digest, stack_job.ws,
+                                    RAINBOW_FAULT_CHECK_FULL);
+    } else {
+        stack_job.ret = rainbow_sign_ws(stack_job.sig, (const sk_t *)stack_job.sk,
+                                        stack_job.digest, stack_job.ws);
+    }
+}
+
+// Runs the job on a filled stack of STACK_TEST_BYTES, and returns the number
+// of bytes that were overwritten (the high-water mark).
+_INLINE_ size_t stack_job_high_water(IN uint8_t *stack)
+{
+    ucontext_t ctx;
+
+    memset(stack, STACK_FILL, STACK_TEST_BYTES);
+    getcontext(&ctx);
+    ctx.uc_stack.ss_sp   = stack;
+    ctx.uc_stack.ss_size = STACK_TEST_BYTES;
+    ctx.uc_link          = &stack_caller;
+    makecontext(&ctx, stack_job_run, 0);
+    swapcontext(&stack_caller, &ctx);
+
+    size_t untouched = 0;
+    while((untouched < STACK_TEST_BYTES) && (STACK_FILL == stack[untouched])) {
+        untouched++;
+    }
+    return STACK_TEST_BYTES - untouched;
+}
+
+// Signs with a workspace and verifies on a small stack, and checks the stack
+// high-water mark against RAINBOW_LOW_STACK_BYTES.
+_INLINE_ int test_low_stack(IN const uint8_t *sk, IN const uint8_t *pk)
+{
+    uint8_t sig_ref[SIG_BYTE_LEN];
+    int     ret = ERROR;
+
+    uint8_t *stack = malloc(STACK_TEST_BYTES);
+    void *   ws    = aligned_malloc(rainbow_workspace_size());
+    if((NULL == stack) || (NULL == ws)) {
+        goto out;
+    }
+
+    memset(&stack_job, 0, sizeof(stack_job));
+    stack_job.sk = sk;
+    stack_job.pk = pk;
+    stack_job.ws = ws;
+
+    // With and without the fault check
+    size_t sign_stack = 0;
+    for(int check = 0; check <= 1; check++) {
+        stack_job.check   = check;
+        const size_t used = stack_job_high_water(stack);
+
+        if((0 != stack_job.ret) ||
+           (0 != rainbow_sign(sig_ref, (const sk_t *)sk, stack_job.digest)) ||
+           (0 != memcmp(sig_ref, stack_job.sig, sizeof(sig_ref)))) {
+            goto out;
+        }
+        sign_stack = (used > sign_stack) ? used : sign_stack;
+    }
+
+    stack_job.verify        = 1;
+    const size_t verify_stack = stack_job_high_water(stack);
+    if(0 != stack_job.ret) {
+        goto out;
+    }
+
+    printf("Stack high-water: sign (workspace) %zu bytes, verify %zu bytes, "
+           "workspace %zu bytes\n",
+           sign_stack, verify_stack, rainbow_workspace_size());
+
+    if((sign_stack <= RAINBOW_LOW_STACK_BYTES) &&
+       (verify_stack <= RAINBOW_LOW_STACK_BYTES)) {
+        ret = SUCCESS;
+    }
+
+out:
+    free(stack);
+    aligned_free(ws);
+    return ret;
+}
+
+#define SIGCACHE_CAPACITY (1024)
+#define SIGCACHE_LOOKUPS  (100000)
+
+// Checks that a valid signature is cached after its first verification, that
+// a bad signature is never accepted, and measures the cost of a cache hit.
+_INLINE_ int test_sigcache(IN const rainbow_sk_prepared_t *psk,
+                           IN const rainbow_pk_prepared_t *ppk)
+{
+    uint8_t  digest[HASH_BYTE_LEN] = {0};
+    uint8_t  sig[SIG_BYTE_LEN];
+    uint64_t hits   = 0;
+    uint64_t misses = 0;
+    int      ret    = ERROR;
+
+    rainbow_sigcache_t *cache = rainbow_sigcache_create(SIGCACHE_CAPACITY);
+    if(NULL == cache) {
+        return ERROR;
+    }
+
+    if((0 != rainbow_sign_prepared(sig, psk, digest)) ||
+       (0 != rainbow_verify_cached(cache, digest, sig, ppk)) ||
+       (0 != rainbow_verify_cached(cache, digest, sig, ppk))) {
+        goto out;
+    }
+
+    sig[0] ^= 1;
+    if((0 == rainbow_verify_cached(cache, digest, sig, ppk)) ||
+       (0 == rainbow_verify_cached(cache, digest, sig, ppk))) {
+        goto out;
+    }
+    sig[0] ^= 1;
+
+    // 1 hit (second lookup of the valid signature), 3 misses.
+    rainbow_sigcache_stats(cache, &hits, &misses);
+    if((1 != hits) || (3 != misses)) {
+        goto out;
+    }
+
+    const uint64_t start = now_ns();
+    for(size_t i = 0; i < SIGCACHE_LOOKUPS; i++) {
+        if(0 != rainbow_verify_cached(cache, digest, sig, ppk)) {
+            goto out;
+        }
+    }
+    printf("Verify (sigcache hit) took %.1f ns\n",
+           (double)(now_ns() - start) / SIGCACHE_LOOKUPS);
+
+    ret = SUCCESS;
+
+out:
+    rainbow_sigcache_release(cache);
+    return ret;
+}
+
+// Checks the 36x36 inversion and solver on a cyclic permutation matrix, where
+// every pivot is zero until a swap, and on a singular matrix. The inverse of a
+// permutation matrix is its transpose in both field representations.
+_INLINE_ int test_zero_pivots(void)
+{
+    uint8_t a[O1 * O1] = {0};
+    uint8_t inv[O1 * O1];
+    uint8_t b[O1];
+    uint8_t x[O1];
+
+    // Line i has its 1 in position i + 1 (mod O1)
+    for(size_t i = 0; i < O1; i++) {
+        a[(i * O1) + ((i + 1) % O1)] = 1;
+        b[i]                         = (uint8_t)(i + 1);
+    }
+
+    if((1 != gf256mat_inv_36(inv, a)) || (1 != gf256mat_solve_36(x, a, b))) {
+        return ERROR;
+    }
+
+    for(size_t i = 0; i < O1; i++) {
+        for(size_t j = 0; j < O1; j++) {
+            if(inv[(i * O1) + j] != a[(j * O1) + i]) {
+                return ERROR;
+            }
+        }
+
+        // The lines of |a| are its columns, so a * e_i = e_{i + 1}
+        if(x[i] != b[(i + 1) % O1]) {
+            return ERROR;
+        }
+    }
+
+    memset(a, 0, O1);
+    if((0 != gf256mat_inv_36(inv, a)) || (0 != gf256mat_solve_36(x, a, b))) {
+        return ERROR;
+    }
+
+    return SUCCESS;
+}
+
+typedef struct vinegar_maps_st {
+    uint8_t r_l1_F1[O1];
+    uint8_t r_l2_F1[O2];
+    uint8_t mat_l1[O1 * O1];
+    uint8_t mat_l2_F3[O2 * O2];
+    uint8_t mat_l2_F2[O1 * O2];
+} vinegar_maps_t;
+
+_INLINE_ void vinegar_maps_separate(OUT vinegar_maps_t *v,
+                                    IN const sk_t *sk,
+                                    IN const uint8_t *vinegar)
+{
+    memset(v->r_l1_F1, 0, sizeof(v->r_l1_F1));
+    memset(v->r_l2_F1, 0, sizeof(v->r_l2_F1));
+    multab_trimat_36(v->r_l1_F1, sk->l1_F1, vinegar, V1);
+    multab_trimat_36(v->r_l2_F1, sk->l2_F1, vinegar, V1);
+    gfmat_prod_native(v->mat_l1, sk->l1_F2, O1 * O1, V1, vinegar);
+    gfmat_prod_native(v->mat_l2_F3, sk->l2_F3, O2 * O2, V1, vinegar);
+    gfmat_prod_native(v->mat_l2_F2, sk->l2_F2, O1 * O2, V1, vinegar);
+}
+
+// Compares the fused vinegar kernels with the sequence of the separate kernels
+_INLINE_ int test_vinegar_maps(IN const uint8_t *sk, IN const rainbow_sk_prepared_t *psk)
+{
+    vinegar_maps_t v1;
+    vinegar_maps_t v2;
+    vinegar_maps_t v3;
+    uint8_t        vinegar[V1];
+    int            ret = 0;
+
+    sk_t *_sk = malloc(sizeof(sk_t));
+    if(NULL == _sk) {
+        return -1;
+    }
+
+    // The prepared key is in the internal field representation
+#ifdef USE_AES_FIELD
+    memcpy(_sk, sk, sizeof(sk_t));
+#else
+    to_gfni((uint8_t *)_sk, sk, sizeof(sk_t));
+#endif
+
+    for(size_t i = 0; i < V1; i++) {
+        vinegar[i] = (uint8_t)((i * 37) + 11);
+    }
+
+    MEASURE("Vinegar maps (separate kernels)",
+            vinegar_maps_separate(&v1, _sk, vinegar););
+    MEASURE("Vinegar maps (fused kernel)",
+            vinegar_maps_36(v2.r_l1_F1, v2.r_l2_F1, v2.mat_l1, v2.mat_l2_F3,
+                            v2.mat_l2_F2, _sk, vinegar););
+    MEASURE("Vinegar maps (fused kernel, interleaved sk)",
+            vinegar_maps_interleaved_36(v3.r_l1_F1, v3.r_l2_F1, v3.mat_l1,
+                                        v3.mat_l2_F3, v3.mat_l2_F2, &psk->ilv,
+                                        psk->l2_F3, vinegar););
+
+    if((0 != memcmp(&v1, &v2, sizeof(v1))) || (0 != memcmp(&v1, &v3, sizeof(v1)))) {
+        ret = -1;
+    }
+
+    // The quadratic-form engine against the row loop, for F1 and F5
+    uint8_t y1[O2];
+    uint8_t y2[O2];
+    MEASURE("F1 (dim 68, row loop)", multab_trimat_36(y1, _sk->l2_F1, vinegar, V1););
+    MEASURE("F1 (dim 68, quadratic form)", quad_form_36(y2, _sk->l2_F1, vinegar, V1););
+    if(0 != memcmp(y1, y2, sizeof(y1))) {
+        ret = -1;
+    }
+    MEASURE("F5 (dim 36, row loop)", multab_trimat_36(y1, _sk->l2_F5, vinegar, O1););
+    MEASURE("F5 (dim 36, quadratic form)", quad_form_36(y2, _sk->l2_F5, vinegar, O1););
+    if(0 != memcmp(y1, y2, sizeof(y1))) {
+        ret = -1;
+    }
+
+    // The prepared key must convert back to the original key
+    rainbow_sk_export(_sk, psk);
+    if(0 != memcmp(_sk, sk, sizeof(sk_t))) {
+        ret = -1;
+    }
+
+    free(_sk);
+    return ret;
+}
+
 int main(void)
 {
-    uint8_t pk[CRYPTO_PUBLICKEYBYTES] = {0};
-    uint8_t sk[CRYPTO_SECRETKEYBYTES] = {0};
+    // The keys are too large for small stacks
+    uint8_t *pk = calloc(1, CRYPTO_PUBLICKEYBYTES);
+    uint8_t *sk = calloc(1, CRYPTO_SECRETKEYBYTES);
 
     uint8_t  m[]   = "This is the message to be signed.";
     uint8_t *m1    = NULL;
     uint8_t *sm    = NULL;
+    uint8_t *sm2   = NULL;
     uint64_t mlen  = sizeof(m);
     uint64_t mlen1 = 0;
     uint64_t smlen = 0;
     int      ret   = 0;
 
-    m1 = (uint8_t *)malloc(mlen);
-    sm = (uint8_t *)malloc(mlen + CRYPTO_BYTES);
+    rainbow_pk_prepared_t *ppk       = NULL;
+    rainbow_sk_prepared_t *psk       = NULL;
+    rainbow_pk_prepared_t *ppk_split = NULL;
+    rainbow_pk_prepared_t *ppk_early = NULL;
+
+    m1  = (uint8_t *)malloc(mlen);
+    sm  = (uint8_t *)malloc(mlen + CRYPTO_BYTES);
+    sm2 = (uint8_t *)malloc(mlen + CRYPTO_BYTES);
+    if((NULL == pk) || (NULL == sk)) {
+        printf("Allocating the keys failed\n");
+        ret = -1;
+        goto out;
+    }
 
     MEASURE("Keypair", ret = crypto_sign_keypair(pk, sk););
     if(0 != ret) {
@@ -94,17 +1099,189 @@ int main(void)
         goto out;
     }
 
+    psk = rainbow_sk_prepare((const sk_t *)sk);
+    if(NULL == psk) {
+        printf("rainbow_sk_prepare failed\n");
+        ret = -1;
+        goto out;
+    }
+
+    MEASURE("Sign (prepared sk)",
+            ret = crypto_sign_prepared(sm2, &smlen, m, sizeof(m), psk););
+    if((0 != ret) || (0 != memcmp(sm, sm2, smlen))) {
+        printf("crypto_sign_prepared failed\n");
+        ret = -1;
+        goto out;
+    }
+
     MEASURE("Verify", ret = crypto_sign_open(m1, &mlen1, sm, smlen, pk););
     if(0 != ret) {
         printf("crypto_sign_open failed\n");
         goto out;
     }
 
+    ppk = rainbow_pk_prepare((const pk_t *)pk);
+    if(NULL == ppk) {
+        printf("rainbow_pk_prepare failed\n");
+        ret = -1;
+        goto out;
+    }
+
+    MEASURE("Verify (prepared pk)",
+            ret = crypto_sign_open_prepared(m1, &mlen1, sm, smlen, ppk););
+    if(0 != ret) {
+        printf("crypto_sign_open_prepared failed\n");
+        goto out;
+    }
+
+    ppk_split = rainbow_pk_prepare_layout((const pk_t *)pk, RAINBOW_PK_LAYOUT_SPLIT);
+    if(NULL == ppk_split) {
+        printf("rainbow_pk_prepare_layout failed\n");
+        ret = -1;
+        goto out;
+    }
+
+    MEASURE("Verify (prepared pk, split layout)",
+            ret = crypto_sign_open_prepared(m1, &mlen1, sm, smlen, ppk_split););
+    if(0 != ret) {
+        printf("crypto_sign_open_prepared (split layout) failed\n");
+        goto out;
+    }
+
+    // A modified signature must be rejected
+    sm[smlen - 1] ^= 1;
+    ret = crypto_sign_open_prepared(m1, &mlen1, sm, smlen, ppk_split);
+    sm[smlen - 1] ^= 1;
+    if(0 == ret) {
+        printf("crypto_sign_open_prepared (split layout) accepted a bad signature\n");
+        ret = -1;
+        goto out;
+    }
+
+    ppk_early =
+        rainbow_pk_prepare_layout((const pk_t *)pk, RAINBOW_PK_LAYOUT_EARLY_REJECT);
+    if(NULL == ppk_early) {
+        printf("rainbow_pk_prepare_layout failed\n");
+        ret = -1;
+        goto out;
+    }
+
+    MEASURE("Verify (prepared pk, early-reject layout)",
+            ret = crypto_sign_open_prepared(m1, &mlen1, sm, smlen, ppk_early););
+    if(0 != ret) {
+        printf("crypto_sign_open_prepared (early-reject layout) failed\n");
+        goto out;
+    }
+
+    sm[smlen - 1] ^= 1;
+    MEASURE("Reject (prepared pk, early-reject layout)",
+            ret = crypto_sign_open_prepared(m1, &mlen1, sm, smlen, ppk_early););
+    sm[smlen - 1] ^= 1;
+    if(0 == ret) {
+        printf("crypto_sign_open_prepared (early-reject layout) accepted a bad "
+               "signature\n");
+        ret = -1;
+        goto out;
+    }
+
+    ret = test_zero_pivots();
+    if(0 != ret) {
+        printf("gf256mat_inv_36 failed\n");
+        goto out;
+    }
+
+    ret = test_vinegar_maps(sk, psk);
+    if(0 != ret) {
+        printf("vinegar_maps_36 failed\n");
+        goto out;
+    }
+
+    ret = test_sign_batch(sk);
+    if(0 != ret) {
+        printf("rainbow_sign_batch failed\n");
+        goto out;
+    }
+
+    ret = test_verify_batch(psk, ppk);
+    if(0 != ret) {
+        printf("rainbow_verify_batch failed\n");
+        goto out;
+    }
+
+    ret = test_verify_multi(psk, ppk);
+    if(0 != ret) {
+        printf("rainbow_verify_multi failed\n");
+        goto out;
+    }
+
+    uint8_t digest[HASH_BYTE_LEN];
+    hash_msg(digest, HASH_BYTE_LEN, m, sizeof(m));
+    ret = test_verify_stream(pk, digest, sm + sizeof(m));
+    if(0 != ret) {
+        printf("rainbow_verify_stream failed\n");
+        goto out;
+    }
+
+    ret = test_sign_online(psk, ppk);
+    if(0 != ret) {
+        printf("rainbow_sign_online failed\n");
+        goto out;
+    }
+
+    ret = test_sign_team(psk);
+    if(0 != ret) {
+        printf("rainbow_sign_prepared_team failed\n");
+        goto out;
+    }
+
+    ret = test_keypair_mt(pk, sk);
+    if(0 != ret) {
+        printf("rainbow_keypair_mt or rainbow_keypair_team failed\n");
+        goto out;
+    }
+
+    ret = test_keypair_batch();
+    if(0 != ret) {
+        printf("rainbow_keypair_batch failed\n");
+        goto out;
+    }
+
+    ret = test_keypair_stream(pk, sk);
+    if(0 != ret) {
+        printf("rainbow_keypair_stream failed\n");
+        goto out;
+    }
+
+    ret = test_low_stack(sk, pk);
+    if(0 != ret) {
+        printf("rainbow_sign_ws failed\n");
+        goto out;
+    }
+
+    ret = test_fault_check(psk, ppk);
+    if(0 != ret) {
+        printf("rainbow_sk_set_fault_check failed\n");
+        goto out;
+    }
+
+    ret = test_sigcache(psk, ppk);
+    if(0 != ret) {
+        printf("rainbow_verify_cached failed\n");
+        goto out;
+    }
+
     printf("Success\n");
 
 out:
+    rainbow_pk_release(ppk);
+    rainbow_pk_release(ppk_split);
+    rainbow_pk_release(ppk_early);
+    rainbow_sk_release(psk);
+    free(sm2);
     free(sm);
     free(m1);
+    free(sk);
+    free(pk);
 
     return ret;
 }